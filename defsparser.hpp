@@ -0,0 +1,114 @@
+//  SPDX-License-Identifier: GPL-3.0-or-later
+//
+//  Copyright (c) 2024 plan44.ch / Lukas Zeller, Zurich, Switzerland
+//
+//  Author: Lukas Zeller <luz@plan44.ch>
+//
+//  This file is part of p44utils.
+//
+//  p44utils is free software: you can redistribute it and/or modify
+//  it under the terms of the GNU General Public License as published by
+//  the Free Software Foundation, either version 3 of the License, or
+//  (at your option) any later version.
+//
+//  p44utils is distributed in the hope that it will be useful,
+//  but WITHOUT ANY WARRANTY; without even the implied warranty of
+//  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+//  GNU General Public License for more details.
+//
+//  You should have received a copy of the GNU General Public License
+//  along with p44utils. If not, see <http://www.gnu.org/licenses/>.
+//
+
+#ifndef __p44maintd__defsparser__
+#define __p44maintd__defsparser__
+
+#include <string>
+#include <string.h>
+#include <ctype.h>
+
+#include <boost/utility/string_view.hpp>
+
+// Parser for .defs files, scanning the entire file contents in place.
+// Lines are KEY=VALUE, with whitespace around KEY and before VALUE ignored. Lines starting with # are comments.
+// VALUE starting with a double or single quote extends to the matching unescaped quote (or end of line),
+// with \ escaping the next char. Otherwise VALUE is used as-is up to the end of the line.
+class DefsParser
+{
+  const char *mCursor;
+  const char *mEnd;
+  std::string mUnescaped; // only used for values containing escapes
+
+  static bool isWS(char aC) { return isspace((unsigned char)aC); }
+
+public:
+
+  DefsParser(const char *aText, size_t aSize) : mCursor(aText), mEnd(aText+aSize) {};
+
+  // get next key/value
+  // @return false if no more key/value pairs
+  // @note aKey and aValue point into the text or the parser itself, and are valid until next call only
+  bool next(boost::string_view &aKey, boost::string_view &aValue)
+  {
+    while (mCursor<mEnd) {
+      // isolate line
+      const char *ls = mCursor;
+      const char *le = (const char *)memchr(ls, '\n', mEnd-ls);
+      if (le) mCursor = le+1; else mCursor = le = mEnd;
+      if (le>ls && le[-1]=='\r') le--;
+      // skip empty and comment lines
+      const char *p = ls;
+      while (p<le && isWS(*p)) p++;
+      if (p>=le || *p=='#') continue;
+      // key
+      const char *eq = (const char *)memchr(p, '=', le-p);
+      if (!eq) continue;
+      const char *ke = eq;
+      while (ke>p && isWS(ke[-1])) ke--;
+      if (ke==p) continue; // empty key
+      aKey = boost::string_view(p, ke-p);
+      // value
+      p = eq+1;
+      while (p<le && isWS(*p)) p++;
+      if (p<le && (*p=='"' || *p=='\'')) {
+        // quoted: \ is escape and string ends when quote appears again
+        char quote = *p++;
+        const char *qe = (const char *)memchr(p, quote, le-p);
+        if (!qe) qe = le;
+        const char *esc = (const char *)memchr(p, '\\', qe-p);
+        if (!esc) {
+          // no escapes, can use text in place
+          aValue = boost::string_view(p, qe-p);
+        }
+        else {
+          // need to unescape
+          mUnescaped.assign(p, esc-p);
+          p = esc;
+          while (p<le) {
+            if (*p=='\\') {
+              if (++p>=le) break;
+            }
+            else if (*p==quote) {
+              break;
+            }
+            const char *n = p+1;
+            while (n<le && *n!='\\' && *n!=quote) n++;
+            mUnescaped.append(p, n-p);
+            p = n;
+          }
+          aValue = mUnescaped;
+        }
+      }
+      else {
+        // use as-is
+        aValue = boost::string_view(p, le-p);
+      }
+      return true;
+    }
+    return false;
+  }
+
+};
+
+
+#endif /* __p44maintd__defsparser__ */
@@ -23,9 +23,60 @@
 #define FLASH_PATH "/flash/"
 #define DEFAULT_DEFS_PATH "/etc/"
 #define COMPUTING_MODULE_FILE "/tmp/p44-computing-module"
+#define DEFAULT_SERVER_WORKERS 4 // max number of requests processed concurrently in --server mode
+#define SERVER_REQUEST_TIMEOUT 10 // seconds to wait for a client to deliver its request
+#define SERVER_STATUS_PREFIX "\nP44EXIT:" // trailer the server appends to the worker's output, followed by
+#define SERVER_STATUS_TRAILER SERVER_STATUS_PREFIX "%03d\n" // the worker's exit status
+#define SERVER_STATUS_TRAILER_LEN 13
+#define CACHE_DIR "/tmp/" // tmpfs, so cached getter results and defs snapshot do not survive reboot
+#define CACHE_FILE_PREFIX "p44maintd_cache_"
+#define DEFS_SNAPSHOT_PREFIX CACHE_FILE_PREFIX "defs_"
+#define GETTER_CACHE_PREFIX CACHE_FILE_PREFIX "getter_"
+#define RESULT_CACHE_FILE CACHE_DIR CACHE_FILE_PREFIX "results" // answers of polled read-only queries
+#define RESULT_CACHE_MAGIC "P44RESULTS1"
+#define DEVINFO_CACHE_TTL 2 // seconds, short because devinfo includes current time and uptime
+#define CONFIG_CACHE_TTL 10 // seconds, for ipconfig/wificonfig/tzconfig queries
+#define BOOT_ID_FILE "/proc/sys/kernel/random/boot_id"
+#define DEFS_SNAPSHOT_MAGIC "P44DEFS1:"
+#define TZ_FILE "/tmp/TZ"
+#define PROPERTY_STORE_FILE "p44_properties" // in FLASH_PATH
+#define PROPERTY_STORE_MAGIC "P44PROPS1\n"
+#define PROPERTY_LEGACY_PREFIX "p44_property_" // former layout with one file per property
+#define PROPERTY_COMPACT_MINSIZE 4096 // property log is never compacted below this size
+#define ALERT_DIR "p44alerts/" // in FLASH_PATH
+#define ALERT_FILE_PREFIX "alert_"
+#define ALERT_INDEX_FILE "index" // in ALERT_DIR
+#define ALERT_INDEX_MAGIC "P44ALERTS2"
+#define ALERT_INDEX_MAGIC_V1 "P44ALERTS1" // former index format without dedup info, upgraded when loaded
+#define DEFAULT_ALERT_RATE_LIMIT 60 // seconds, min interval between two flash writes for the same alert
+#define DEFAULT_MAX_ALERTS 200 // max number of pending alerts
+#define FLASH_CHECKSUMS_FILE "p44_checksums" // in FLASH_PATH, reference checksums for verify
+#define FLASH_CHECKSUMS_MAGIC "P44SUMS1"
+#define FLASH_STATS_FILE CACHE_DIR "p44maintd_flashstats" // per command flash write counters since boot
+#define BACKUP_LIST_FILE "p44configbackup.list" // in defs dir, paths to include in config backups, one per line
+#define BACKUP_DEFS_MEMBER "p44defs" // archive member containing the unit's defs as shell var assignments
+#define BACKUP_MANIFEST_MEMBER "p44manifest" // crc32 content manifest of the backup
+#define BACKUP_DELTA_MEMBER "p44delta" // in incremental backups only: "base <manifest id>" line, then names of deleted members
+#define RESTORE_ARCHIVE_FILE CACHE_DIR "p44maintd_restore.p44cfg" // inspected archive waiting for configrestoreapply
+#define DEFAULT_UCI_NETWORK_INTERFACE "lan" // UCI network interface configured by ipconfig, unless PRODUCT_UCI_NETWORK_INTERFACE is defined
+#if BUILDENV_OPENWRT
+  #define DEFAULT_UCI_PATH "/etc/config/"
+#else
+  #define DEFAULT_UCI_PATH "" // no UCI, use fake config answers unless --ucidir is given
+#endif
+
+#if defined(__ARM_FEATURE_CRC32) && __BYTE_ORDER__==__ORDER_LITTLE_ENDIAN__
+  #define HW_CRC32 1 // use ARMv8 CRC32 instructions
+#else
+  #define HW_CRC32 0
+#endif
 
 #define DEFAULT_LOGLEVEL LOG_EMERG // no logging by default
 
+#ifndef COUNT_ALLOCATIONS
+  #define COUNT_ALLOCATIONS 0 // set to 1 to log number of heap allocations per request
+#endif
+
 #include "application.hpp"
 
 #include "jsonobject.hpp"
@@ -36,28 +87,85 @@
 #include "crc32.hpp"
 #include "fnv.hpp"
 
+#include "defsparser.hpp"
+#include "uciconfig.hpp"
+
+#include <boost/utility/string_view.hpp>
+#include <algorithm>
+#include <set>
+
 #include <stdio.h>
 #include <dirent.h>
 #include <sys/stat.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/wait.h>
+#include <sys/uio.h>
+#include <sys/file.h>
+#include <fcntl.h>
+#include <spawn.h>
+#if HW_CRC32
+  #include <arm_acle.h>
+#endif
 
 #if !BUILDENV_XCODE
   // Linux only
   #include <sys/ioctl.h>
   #include <sys/reboot.h>
   #include <sys/sysinfo.h>
+  #include <linux/netlink.h>
+  #include <linux/rtnetlink.h>
+  #include <arpa/inet.h>
+  #include <sys/sendfile.h>
+  #include <sys/syscall.h>
+  #ifndef CLOSE_RANGE_CLOEXEC
+    #define CLOSE_RANGE_CLOEXEC (1U << 2) // from linux/close_range.h, not in older kernel headers
+  #endif
 #endif
 
 
 using namespace p44;
 
 
+#if COUNT_ALLOCATIONS
+static size_t gNumAllocations = 0;
+
+void *operator new(size_t aSize)
+{
+  gNumAllocations++;
+  void *p = malloc(aSize ? aSize : 1);
+  if (!p) throw std::bad_alloc();
+  return p;
+}
+
+void operator delete(void *aPtr) noexcept
+{
+  free(aPtr);
+}
+
+static void logAllocations(const char *aWhat)
+{
+  LOG(LOG_NOTICE, "%s: %zu heap allocations so far", aWhat, gNumAllocations);
+}
+
+static void resetAllocations()
+{
+  gNumAllocations = 0;
+}
+#else
+static inline void logAllocations(const char *aWhat) {}
+static inline void resetAllocations() {}
+#endif
+
+
 #if BUILDENV_OPENWRT || BUILDENV_XCODE || BUILDENV_GENERIC
 typedef struct {
   const char *tzname;
   const char *tzspec;
 } TZInfo;
 
-static const TZInfo timezones[] = {
+// Note: must be sorted by tzname (plain byte order), which is verified at compile time below
+static constexpr TZInfo timezones[] = {
   { "Africa/Abidjan", "GMT0" },
   { "Africa/Accra", "GMT0" },
   { "Africa/Addis Ababa", "EAT-3" },
@@ -513,11 +621,117 @@ static const TZInfo timezones[] = {
   { NULL, NULL } // terminator
 };
 
+static constexpr size_t numTimezones = sizeof(timezones)/sizeof(TZInfo)-1;
+
+static constexpr bool tzNameLess(const char *aA, const char *aB)
+{
+  return *aA!=*aB ? (uint8_t)*aA<(uint8_t)*aB : (*aA!=0 && tzNameLess(aA+1, aB+1));
+}
+
+static constexpr bool tzSorted(size_t aFrom, size_t aTo)
+{
+  // divide and conquer to keep constexpr recursion depth low
+  return aTo-aFrom<2 || (
+    tzSorted(aFrom, (aFrom+aTo)/2) &&
+    tzSorted((aFrom+aTo)/2, aTo) &&
+    tzNameLess(timezones[(aFrom+aTo)/2-1].tzname, timezones[(aFrom+aTo)/2].tzname)
+  );
+}
+
+static_assert(tzSorted(0, numTimezones), "timezones[] must be sorted by tzname");
+
+
+// Lookups in timezones[]:
+// - timezones[] itself being sorted, name and prefix searches are binary searches
+// - indices ordered by spec for finding all names using a given POSIX TZ spec, built on first such query
+class TimezoneCatalog
+{
+  mutable vector<uint16_t> mBySpec; // timezones[] indices ordered by spec, then name
+
+  struct SpecLess {
+    bool operator()(uint16_t aA, uint16_t aB) const
+    {
+      int c = strcmp(timezones[aA].tzspec, timezones[aB].tzspec);
+      return c<0 || (c==0 && aA<aB);
+    }
+  };
+
+  // @return index of first zone with name not less than aName
+  static size_t lowerBound(boost::string_view aName)
+  {
+    size_t lo = 0, hi = numTimezones;
+    while (lo<hi) {
+      size_t m = (lo+hi)/2;
+      if (boost::string_view(timezones[m].tzname)<aName) lo = m+1; else hi = m;
+    }
+    return lo;
+  }
+
+  TimezoneCatalog() {};
+
+public:
+
+  static const TimezoneCatalog &catalog()
+  {
+    static TimezoneCatalog sCatalog;
+    return sCatalog;
+  }
+
+  // find zone by exact name
+  const TZInfo *find(boost::string_view aName) const
+  {
+    size_t i = lowerBound(aName);
+    return i<numTimezones && aName==timezones[i].tzname ? &timezones[i] : NULL;
+  }
+
+  // get range [aFirst, aEnd) of timezones[] indices of zones with names starting with aPrefix
+  void withPrefix(boost::string_view aPrefix, size_t &aFirst, size_t &aEnd) const
+  {
+    size_t lo = lowerBound(aPrefix);
+    aFirst = lo;
+    size_t hi = numTimezones;
+    while (lo<hi) {
+      size_t m = (lo+hi)/2;
+      if (boost::string_view(timezones[m].tzname).substr(0, aPrefix.size())==aPrefix) lo = m+1; else hi = m;
+    }
+    aEnd = lo;
+  }
+
+  // get all zones using the given POSIX TZ spec, in name order
+  void withSpec(boost::string_view aSpec, vector<const TZInfo *> &aZones) const
+  {
+    aZones.clear();
+    if (mBySpec.empty()) {
+      mBySpec.resize(numTimezones);
+      for (size_t i=0; i<numTimezones; i++) mBySpec[i] = (uint16_t)i;
+      sort(mBySpec.begin(), mBySpec.end(), SpecLess());
+    }
+    size_t lo = 0, hi = mBySpec.size();
+    while (lo<hi) {
+      size_t m = (lo+hi)/2;
+      if (boost::string_view(timezones[mBySpec[m]].tzspec)<aSpec) lo = m+1; else hi = m;
+    }
+    while (lo<mBySpec.size() && aSpec==timezones[mBySpec[lo]].tzspec) {
+      aZones.push_back(&timezones[mBySpec[lo++]]);
+    }
+  }
+
+};
+
 #endif // BUILDENV_OPENWRT || BUILDENV_XCODE
 
 
 extern char **environ;
 
+
+// FNV-1a, constexpr to allow hashing JSON command names at compile time
+static constexpr uint32_t jsonCmdHash(const char *aName, uint32_t aHash = 2166136261u)
+{
+  return *aName ? jsonCmdHash(aName+1, (aHash ^ (uint8_t)*aName) * 16777619u) : aHash;
+}
+
+#define JSON_CMD(n) n, jsonCmdHash(n)
+
 bool checkParam(JsonObjectPtr aParams, const char *aParamName, JsonObjectPtr &aParam)
 {
   bool exists = false;
@@ -539,776 +753,4854 @@ bool checkStringParam(JsonObjectPtr aParams, const char *aParamName, string &aPa
 }
 
 
-static const CmdLineOptionDescriptor options[] = {
-  #ifdef ADDITIONAL_OPTIONS
-  ADDITIONAL_OPTIONS
-  #endif
-  { 0  , "json",            true,  "jsonquery;process JSON config/maintainance command" },
-  { 0  , "factoryreset",    true,  "mode;factory reset, mode: 1=reset dS settings, 2=reset network settings, 3=reset both" },
-  { 0  , "defs",            false, "output all platform, product and unit defs as shell var assignments" },
-  { 0  , "defsdir",         true,  "dir;directory where to read .defs files and pubkey from, defaults to " DEFAULT_DEFS_PATH },
-  { 'i', "deviceinfo",      false, "human readable device info" },
-  { 'l', "loglevel",        true,  "level;set max level of log message detail to show on stderr" },
-  { 0  , "deltatstamps",    false, "show timestamp delta between log lines" },
-  { 'V', "version",         false, "show version" },
-  { 'h', "help",            false, "show this text" },
-  { 0, NULL } // list terminator
-};
-
-
-class P44maintd : public CmdLineApp
+// stages of identification, each producing more of the defs
+typedef enum {
+  identStage_none = -1, // no identification needed at all
+  identStage_basic, // defaults and volatile status defs only
+  identStage_platform, // platform defs
+  identStage_defs, // defs from all .defs files and getters (product, producer, firmware, variant)
+  identStage_full // including unit identity (serial, MAC, host name)
+} IdentStage;
+
+
+// well-known defs, which have a DefKey id for direct access, and the identification stage producing them
+#define WELL_KNOWN_DEFS \
+  WKDEF(PLATFORM_IDENTIFIER, identStage_platform) \
+  WKDEF(PLATFORM_IDENTIFIER_GETTER, identStage_platform) \
+  WKDEF(PLATFORM_NAME, identStage_platform) \
+  WKDEF(PLATFORM_OS_IDENTIFIER, identStage_platform) \
+  WKDEF(PLATFORM_COMPUTINGMODULE, identStage_platform) \
+  WKDEF(PLATFORM_PRODUCT_IDENTIFIER_GETTER, identStage_platform) \
+  WKDEF(PLATFORM_VARIANT_GETTER, identStage_platform) \
+  WKDEF(PLATFORM_SERIALDEV, identStage_platform) \
+  WKDEF(PLATFORM_DALIDEV, identStage_platform) \
+  WKDEF(PLATFORM_RED_LED, identStage_platform) \
+  WKDEF(PLATFORM_GREEN_LED, identStage_platform) \
+  WKDEF(PRODUCT_IDENTIFIER, identStage_defs) \
+  WKDEF(PRODUCT_MODEL, identStage_defs) \
+  WKDEF(PRODUCT_VARIANT, identStage_defs) \
+  WKDEF(PRODUCT_GTIN, identStage_defs) \
+  WKDEF(PRODUCT_HOSTPREFIX, identStage_defs) \
+  WKDEF(PRODUCT_HAS_TINKER, identStage_defs) \
+  WKDEF(PRODUCT_RESTART_TIME, identStage_defs) \
+  WKDEF(PRODUCT_DEFAULT_USER_LEVEL, identStage_defs) \
+  WKDEF(PRODUCT_WEBADMIN_USER, identStage_defs) \
+  WKDEF(PRODUCT_UCI_NETWORK_INTERFACE, identStage_defs) \
+  WKDEF(PRODUCT_COPYRIGHT_YEARS, identStage_defs) \
+  WKDEF(PRODUCT_COPYRIGHT_HOLDER, identStage_defs) \
+  WKDEF(PRODUCER, identStage_defs) \
+  WKDEF(PRODUCER_GETTER, identStage_defs) \
+  WKDEF(FIRMWARE_VERSION, identStage_defs) \
+  WKDEF(FIRMWARE_FEED, identStage_defs) \
+  WKDEF(STATUS_TIME, identStage_basic) \
+  WKDEF(STATUS_IPV4, identStage_basic) \
+  WKDEF(STATUS_USER_LEVEL, identStage_defs) \
+  WKDEF(UNIT_SERIALNO, identStage_full) \
+  WKDEF(UNIT_MAC_DECIMAL, identStage_full) \
+  WKDEF(UNIT_MACADDRESS, identStage_full) \
+  WKDEF(UNIT_HOSTNAME, identStage_full)
+
+typedef enum {
+  noDefKey = -1,
+  #define WKDEF(n, s) def_##n,
+  WELL_KNOWN_DEFS
+  #undef WKDEF
+  numWellKnownDefs
+} DefKey;
+
+
+// identification stage needed to have aKey, noDefKey meaning all defs
+static IdentStage defIdentStage(DefKey aKey)
 {
-  typedef CmdLineApp inherited;
-
-protected:
-
-  // Indicator
-  IndicatorOutputPtr mRedLED;
-  IndicatorOutputPtr mGreenLED;
-
-  // system config
-  string mDefspath;
-  typedef map<string, string> DefsMap;
-  DefsMap mDefs;
+  static const uint8_t stages[numWellKnownDefs] = {
+    #define WKDEF(n, s) s,
+    WELL_KNOWN_DEFS
+    #undef WKDEF
+  };
+  return aKey==noDefKey ? identStage_full : (IdentStage)stages[aKey];
+}
 
-public:
 
-  P44maintd()
+// Storage for defs. All keys and values live in a single string arena, entries refer to them by offset,
+// and an open addressing hash table indexes the entries by key. Well-known keys have their entries
+// at the index of their DefKey, so accessing them by id needs no lookup at all.
+// Note: views returned by get() or an Iterator are only valid until the map is modified.
+class DefsMap
+{
+  typedef struct {
+    uint32_t hash;
+    uint32_t keyOffs;
+    uint32_t keyLen;
+    uint32_t valOffs; // noValue if not defined
+    uint32_t valLen;
+  } Entry;
+  static const uint32_t noValue = 0xFFFFFFFF;
+
+  string mArena; // all keys and values, each NUL terminated
+  vector<Entry> mEntries;
+  vector<int32_t> mSlots; // hash table of entry indices (-1 = empty), size is power of 2
+  size_t mNumDefined;
+
+  static uint32_t hashKey(boost::string_view aKey)
   {
-    mDefspath = DEFAULT_DEFS_PATH;
-    // set dummy LEDs
-    mRedLED = IndicatorOutputPtr (new IndicatorOutput("missing", false));
-    mGreenLED = IndicatorOutputPtr (new IndicatorOutput("missing", false));
+    uint32_t h = 2166136261u; // FNV-1a
+    for (size_t i=0; i<aKey.size(); i++) h = (h ^ (uint8_t)aKey[i]) * 16777619u;
+    return h;
   }
 
-
-  virtual int main(int argc, char **argv)
+  static const char *wellKnownName(int aKey)
   {
-    const char *usageText = "Usage: %1$s [options]\n";
-
-    // parse the command line, exits when syntax errors occur
-    setCommandDescriptors(usageText, options);
-    if (parseCommandLine(argc, argv)) {
-      if (numOptions()<1) {
-        // show usage
-        showUsage();
-        terminateApp(EXIT_SUCCESS);
-      }
-      else {
-        // different defs dir?
-        getStringOption("defsdir", mDefspath);
-        if (mDefspath.size()>0 && mDefspath[mDefspath.size()-1]!='/')
-          mDefspath += '/';
-
-        // log level?
-        int loglevel = DEFAULT_LOGLEVEL;
-        getIntOption("loglevel", loglevel);
-        SETLOGLEVEL(loglevel);
-        SETERRLEVEL(loglevel, false); // all diagnostics go to stderr
-        SETDELTATIME(getOption("deltatstamps"));
-      }
-    }
-
-    // app now ready to run
-    return run();
+    static const char *names[numWellKnownDefs] = {
+      #define WKDEF(n, s) #n,
+      WELL_KNOWN_DEFS
+      #undef WKDEF
+    };
+    return names[aKey];
   }
 
-
-  void enableLEDs()
+  uint32_t store(boost::string_view aStr)
   {
-    // use platform defs to determine which are the LEDs
-    string io;
-    if (getDef("PLATFORM_RED_LED", io)) {
-      mRedLED = IndicatorOutputPtr(new IndicatorOutput(io.c_str(), false));
-    }
-    if (getDef("PLATFORM_GREEN_LED", io)) {
-      mGreenLED = IndicatorOutputPtr(new IndicatorOutput(io.c_str(), false));
-    }
+    uint32_t offs = (uint32_t)mArena.size();
+    mArena.append(aStr.data(), aStr.size());
+    mArena += '\0';
+    return offs;
   }
 
+  boost::string_view keyAt(size_t aIdx) const { return boost::string_view(mArena.data()+mEntries[aIdx].keyOffs, mEntries[aIdx].keyLen); }
+  boost::string_view valueAt(size_t aIdx) const { return boost::string_view(mArena.data()+mEntries[aIdx].valOffs, mEntries[aIdx].valLen); }
 
-  uint64_t serial()
+  int32_t findEntry(boost::string_view aKey, uint32_t aHash) const
   {
-    uint64_t mac = macAddress();
-    // lower 24bits are 1:1 from MAC
-    uint64_t serial = mac & 0xFFFFFF;
-    // check for plan44-used MAC OUIs
-    if ((mac>>24)==0x00409D) {
-      // Digiboard Inc. aka digi.com
-      serial = serial | (1<<24); // 1 = plan44 serial encoding of Digiboard Inc. OUI
-    }
-    else if ((mac>>24)==0xB827EB) {
-      // Raspberry Pi foundation
-      serial = serial | (2<<24); // 2 = plan44 serial encoding of Raspberry Pi Foundation
-    }
-    else if ((mac>>24)==0x40A36B) {
-      // Onion Corporation (MA-M: C00000-CFFFFF)
-      serial = serial | (3<<24); // 3 = plan44 serial encoding of Onion Corporation first MAC block
+    size_t mask = mSlots.size()-1;
+    for (size_t i = aHash & mask; mSlots[i]>=0; i = (i+1) & mask) {
+      const Entry &e = mEntries[mSlots[i]];
+      if (e.hash==aHash && keyAt(mSlots[i])==aKey) return mSlots[i];
     }
-    else if ((mac>>24)==0x881e59) {
-      // Onion Corporation (MA-L: 000000-FFFFFF)
-      serial = serial | (4<<24); // 4 = plan44 serial encoding of Onion Corporation second MAC block
-    }
-    else {
-      // unknown OUI, UA must do
-      serial = serial | (42<<24);
-    }
-    return serial;
+    return -1;
   }
 
-
-  uint64_t macFromSerial(uint64_t aSerial)
+  void insertSlot(int32_t aIdx)
   {
-    // lower 24bits are 1:1 from serial
-    uint64_t mac = aSerial & 0xFFFFFF;
-    switch (aSerial>>24) {
-      case 1: mac |= (0x00409Dul<<24); break; // Digiboard Inc
-      case 2: mac |= (0xB827EBul<<24); break; // Raspberry Pi Foundation
-      case 3: mac |= (0x40A36Bul<<24); break; // Onion Corporation
-    }
-    return mac;
+    size_t mask = mSlots.size()-1;
+    size_t i = mEntries[aIdx].hash & mask;
+    while (mSlots[i]>=0) i = (i+1) & mask;
+    mSlots[i] = aIdx;
   }
 
-
-  bool readDefsFrom(string aFileName, DefsMap &aDefs)
+  int32_t addEntry(boost::string_view aKey, uint32_t aHash)
   {
-    string line;
-    bool readAnything = false;
-    FILE *file = fopen(aFileName.c_str(), "r");
-    if (file) {
-      // file opened
-      string l, key, value;
-      while (string_fgetline(file, line)) {
-        l = trimWhiteSpace(line, true, false);
-        if (l.size()>0 && l[0]!='#') {
-          // not comment
-          if (keyAndValue(line, key, value, '=')) {
-            // key/value
-            if (value.size()>0 && (value[0]=='"' || value[0]=='\'')) {
-              // consider quoted, means that \ is escape and string ends when quote appears again
-              string dequoted;
-              char quote = value[0];
-              size_t i=1;
-              bool escaped = false;
-              while (i<value.size()) {
-                if (!escaped) {
-                  if (value[i]==quote) break;
-                  if (value[i]=='\\') {
-                    escaped = true;
-                    i++;
-                    continue;
-                  }
-                }
-                dequoted += value[i];
-                escaped = false;
-                i++;
-              }
-              aDefs[key] = dequoted;
-            }
-            else {
-              // use as-is
-              aDefs[key] = value;
-            }
-            readAnything = true;
-          }
-        }
-      }
-      fclose(file);
+    if ((mEntries.size()+1)*2>mSlots.size()) {
+      // keep load factor below 50%
+      mSlots.assign(mSlots.size()*2, -1);
+      for (size_t i=0; i<mEntries.size(); i++) insertSlot((int32_t)i);
     }
-    return readAnything;
+    Entry e;
+    e.hash = aHash;
+    e.keyLen = (uint32_t)aKey.size();
+    e.keyOffs = store(aKey);
+    e.valOffs = noValue;
+    e.valLen = 0;
+    mEntries.push_back(e);
+    insertSlot((int32_t)mEntries.size()-1);
+    return (int32_t)mEntries.size()-1;
   }
 
-
-  bool readDefFromFirstLine(const string aFileName, const char *key)
+  void setValue(size_t aIdx, boost::string_view aValue)
   {
-    string value;
-    if (string_fgetfirstline(aFileName, value)) {
-      mDefs[key] = value;
-      return true;
+    Entry &e = mEntries[aIdx];
+    if (e.valOffs==noValue) {
+      mNumDefined++;
     }
-    return false;
+    else if (aValue.size()<=e.valLen) {
+      // fits into space of previous value
+      memmove(&mArena[e.valOffs], aValue.data(), aValue.size());
+      mArena[e.valOffs+aValue.size()] = 0;
+      e.valLen = (uint32_t)aValue.size();
+      return;
+    }
+    uint32_t offs = store(aValue);
+    mEntries[aIdx].valOffs = offs;
+    mEntries[aIdx].valLen = (uint32_t)aValue.size();
   }
 
+public:
+
+  DefsMap() { clear(); }
 
-  bool getDef(const string aKey, string &aDef, const char *aDefault=NULL, DefsMap *aDefsP = NULL)
+  void clear()
   {
-    DefsMap &myDefs = aDefsP ? *aDefsP : mDefs;
-    DefsMap::iterator pos;
-    pos = myDefs.find(aKey);
-    if (pos!=myDefs.end()) {
-      aDef = pos->second;
-      return true;
+    mArena.clear();
+    mArena.reserve(4096);
+    mEntries.clear();
+    mEntries.reserve(128);
+    mSlots.assign(128, -1);
+    mNumDefined = 0;
+    for (int k=0; k<numWellKnownDefs; k++) {
+      boost::string_view n = wellKnownName(k);
+      addEntry(n, hashKey(n));
     }
-    if (aDefault) {
-      aDef = aDefault;
-    }
-    return false;
   }
 
+  size_t size() const { return mNumDefined; }
 
-  string getDef(const string aKey, DefsMap *aDefsP = NULL)
+  bool get(DefKey aKey, boost::string_view &aValue) const
   {
-    string res;
-    getDef(aKey, res, NULL, aDefsP);
-    return res;
+    if (mEntries[aKey].valOffs==noValue) return false;
+    aValue = valueAt(aKey);
+    return true;
   }
 
-
-  // set value if not already defined
-  bool setDefDefault(const string aKey, const string aValue)
+  bool get(boost::string_view aKey, boost::string_view &aValue) const
   {
-    if (mDefs.find(aKey)!=mDefs.end()) return false;
-    mDefs[aKey] = aValue;
+    int32_t i = findEntry(aKey, hashKey(aKey));
+    if (i<0 || mEntries[i].valOffs==noValue) return false;
+    aValue = valueAt(i);
     return true;
   }
 
+  bool has(DefKey aKey) const { return mEntries[aKey].valOffs!=noValue; }
+  bool has(boost::string_view aKey) const { boost::string_view v; return get(aKey, v); }
 
+  void set(DefKey aKey, boost::string_view aValue) { setValue(aKey, aValue); }
 
-  // "ok", "T", "t", "Y", "y", "1" are all considered true, everything else means false
-  bool isDefTrue(const string aKey)
+  void set(boost::string_view aKey, boost::string_view aValue)
   {
-    string def;
-    if (getDef(aKey, def)) {
-      if (def.size()>0 && (def=="1" || def=="ok" || tolower(def[0])=='t' || tolower(def[0])=='y')) {
-        return true;
+    uint32_t h = hashKey(aKey);
+    int32_t i = findEntry(aKey, h);
+    if (i<0) {
+      const char *arena = mArena.data();
+      if (aValue.data()>=arena && aValue.data()<arena+mArena.size()) {
+        // value is a view into our own arena (e.g. from get()), which storing the key may reallocate
+        size_t valOffs = aValue.data()-arena;
+        i = addEntry(aKey, h);
+        aValue = boost::string_view(mArena.data()+valOffs, aValue.size());
+      }
+      else {
+        i = addEntry(aKey, h);
       }
     }
-    return false;
+    setValue(i, aValue);
   }
 
+  // allows defs[key] = value;
+  class Ref
+  {
+    DefsMap &mMap;
+    boost::string_view mKey;
+  public:
+    Ref(DefsMap &aMap, boost::string_view aKey) : mMap(aMap), mKey(aKey) {};
+    Ref &operator=(boost::string_view aValue) { mMap.set(mKey, aValue); return *this; }
+    operator string() const { boost::string_view v; return mMap.get(mKey, v) ? v.to_string() : string(); }
+  };
+  Ref operator[](boost::string_view aKey) { return Ref(*this, aKey); }
+
+  // iterates the defined entries ordered by key
+  class Iterator
+  {
+    const DefsMap &mMap;
+    vector<uint32_t> mOrder;
+    size_t mPos;
+  public:
+    Iterator(const DefsMap &aMap) : mMap(aMap), mOrder(aMap.keyOrder()), mPos(0) {};
+    bool valid() const { return mPos<mOrder.size(); }
+    void next() { mPos++; }
+    boost::string_view key() const { return mMap.keyAt(mOrder[mPos]); }
+    boost::string_view value() const { return mMap.valueAt(mOrder[mPos]); }
+    const char *keyCStr() const { return mMap.mArena.c_str()+mMap.mEntries[mOrder[mPos]].keyOffs; }
+    const char *valueCStr() const { return mMap.mArena.c_str()+mMap.mEntries[mOrder[mPos]].valOffs; }
+  };
+
+  // MARK: std::map<string,string> compatible (read-only) subset, for code written when DefsMap was one.
+  // Iteration is ordered by key; it sorts the keys, so better use Iterator, get() and has() in new code.
+
+  typedef pair<const string, string> value_type;
+
+  class const_iterator
+  {
+    friend class DefsMap;
+    const DefsMap *mMap;
+    int32_t mIdx; // entry index, -1 at end
+    mutable vector<uint32_t> mOrder; // defined entries ordered by key, built on first increment
+    mutable value_type *mValue; // materialized on dereferencing
+
+    const_iterator(const DefsMap *aMap, int32_t aIdx) : mMap(aMap), mIdx(aIdx), mValue(NULL) {};
+
+    void setValue() const
+    {
+      delete mValue;
+      mValue = new value_type(mMap->keyAt(mIdx).to_string(), mMap->valueAt(mIdx).to_string());
+    }
 
+  public:
+    const_iterator() : mMap(NULL), mIdx(-1), mValue(NULL) {};
+    const_iterator(const const_iterator &aOther) : mMap(aOther.mMap), mIdx(aOther.mIdx), mOrder(aOther.mOrder), mValue(NULL) {};
+    ~const_iterator() { delete mValue; }
+    const_iterator &operator=(const const_iterator &aOther)
+    {
+      mMap = aOther.mMap;
+      mIdx = aOther.mIdx;
+      mOrder = aOther.mOrder;
+      delete mValue;
+      mValue = NULL;
+      return *this;
+    }
 
+    const value_type &operator*() const { if (!mValue) setValue(); return *mValue; }
+    const value_type *operator->() const { return &operator*(); }
+    bool operator==(const const_iterator &aOther) const { return mIdx==aOther.mIdx; }
+    bool operator!=(const const_iterator &aOther) const { return mIdx!=aOther.mIdx; }
+
+    const_iterator &operator++()
+    {
+      if (mIdx<0) return *this;
+      if (mOrder.empty()) mOrder = mMap->keyOrder();
+      vector<uint32_t>::const_iterator pos = upper_bound(mOrder.begin(), mOrder.end(), (uint32_t)mIdx, KeyOrder(*mMap));
+      mIdx = pos==mOrder.end() ? -1 : *pos;
+      delete mValue;
+      mValue = NULL;
+      return *this;
+    }
+    const_iterator operator++(int) { const_iterator i(*this); ++(*this); return i; }
+  };
+  typedef const_iterator iterator; // values cannot be modified via iterators, use set() or operator[]
 
-
-  // MARK: ===== identification of the device
-
-  virtual bool setDefDefaults()
+  const_iterator begin() const
   {
-    // in all cases: current time
-    mDefs["STATUS_TIME"] = string_ftime("%Y-%m-%d %H:%M:%S");
-    #if BUILDENV_XCODE
-    // pseudo-platform has fixed defs, without loading anything
-    // - platform
-    mDefs["PLATFORM_IDENTIFIER"] = "xcode_dummy";
-    mDefs["PLATFORM_NAME"] = "MacOSX";
-    // - product
-    mDefs["PRODUCT_IDENTIFIER"] = "p44-xx-mac-xcode";
-    mDefs["PRODUCT_MODEL"] = "P44-XX-MAC";
-    mDefs["PRODUCT_VARIANT"] = "Apple";
-    mDefs["PRODUCT_HOSTPREFIX"] = "p44_xx_mac";
-    // - firmware
-    mDefs["FIRMWARE_VERSION"] = "0.0.0.42";
-    mDefs["FIRMWARE_FEED"] = "opensource";
-    // - status
-    mDefs["STATUS_USER_LEVEL"] = "0";
-    // skip dynamic platform stuff for XCode builds
-    return false;
-    #elif BUILDENV_GENERIC
-    // pseudo-platform has fixed defs, without loading anything
-    // - platform
-    defs["PLATFORM_IDENTIFIER"] = "generic_dummy";
-    defs["PLATFORM_NAME"] = "Linux";
-    defs["PLATFORM_SERIALDEV"] = "/dev/null";
-    defs["PLATFORM_DALIDEV"] = "/dev/null";
-    // - product
-    defs["PRODUCT_IDENTIFIER"] = "p44-xx-linux-generic";
-    defs["PRODUCT_MODEL"] = "P44-XX-LINUX";
-    defs["PRODUCT_VARIANT"] = "Debian";
-    defs["PRODUCT_HOSTPREFIX"] = "p44_xx_linux";
-    defs["PRODUCT_HAS_TINKER"] = "1";
-    defs["PRODUCT_RESTART_TIME"] = "5";
-    // - producer
-    defs["PRODUCER"] = "plan44";
-    // - firmware
-    defs["FIRMWARE_VERSION"] = "0.0.0.42";
-    defs["FIRMWARE_FEED"] = "devel";
-    // - status
-    defs["STATUS_USER_LEVEL"] = "0";
-    // skip dynamic platform stuff for Generic Linux builds
-    return false;
-    #else
-    // determine platform dynamically
-    return true;
-    #endif
+    const_iterator i(this, -1);
+    i.mOrder = keyOrder();
+    if (!i.mOrder.empty()) i.mIdx = i.mOrder.front();
+    return i;
   }
 
+  const_iterator end() const { return const_iterator(this, -1); }
 
-  // add dynamically obtainable platform identification info
-  virtual void identifyDynamically(SimpleCB aCallback)
+  const_iterator find(boost::string_view aKey) const
   {
-    string def;
-
-    // build defs
-    mDefs.clear();
-    // set defaults
-    if (!setDefDefaults()) {
-      // defaults are already sufficient for platform
-      processProductSpecifics(aCallback);
-    }
-    else {
-      // read defs files to dettermine platform
-      // - platform, possibly is a softlink
-      readDefsFrom(mDefspath+"p44platform.defs", mDefs);
-      // - this might be a generic head definition file in a FW that supports multiple platforms.
-      //   Either it contains a PLATFORM_IDENTIFIER, or it might also contain a PLATFORM_IDENTIFIER_GETTER
-      //   (which can also override a default PLATFORM_IDENTIFIER already present at this point)
-      if (getDef("PLATFORM_IDENTIFIER_GETTER", def)) {
-        MainLoop::currentMainLoop().fork_and_system(
-          boost::bind(&P44maintd::platformidQueryDone, this, aCallback, _1, _2),
-          def.c_str(),
-          true, NULL, // collect stdout into string
-          0 // mute stderr
-        );
-        return;
-      }
-      // if we get here, there is no PLATFORM_IDENTIFIER_GETTER that might provide/override PLATFORM_IDENTIFIER
-      processPlatformSpecifics(aCallback);
-    }
+    int32_t i = findEntry(aKey, hashKey(aKey));
+    return const_iterator(this, i>=0 && mEntries[i].valOffs!=noValue ? i : -1);
   }
 
+  size_t count(boost::string_view aKey) const { return has(aKey) ? 1 : 0; }
+
+private:
 
-  void platformidQueryDone(SimpleCB aCallback, ErrorPtr err, const string &aAnswer)
+  struct KeyOrder {
+    const DefsMap &m;
+    KeyOrder(const DefsMap &aMap) : m(aMap) {};
+    bool operator()(uint32_t aA, uint32_t aB) const { return m.keyAt(aA)<m.keyAt(aB); }
+  };
+
+  // @return indices of the defined entries, ordered by key
+  vector<uint32_t> keyOrder() const
   {
-    string v = trimWhiteSpace(aAnswer);
-    if (v.size()>0) {
-      mDefs["PLATFORM_IDENTIFIER"] = v;
+    vector<uint32_t> order;
+    order.reserve(mNumDefined);
+    for (size_t i=0; i<mEntries.size(); i++) {
+      if (mEntries[i].valOffs!=noValue) order.push_back((uint32_t)i);
     }
-    processPlatformSpecifics(aCallback);
+    sort(order.begin(), order.end(), KeyOrder(*this));
+    return order;
   }
 
+};
 
-  void processPlatformSpecifics(SimpleCB aCallback)
-  {
-    string def;
 
-    // - additional platform definitions that may be included in the common firmware for multiple platforms
-    if (getDef("PLATFORM_IDENTIFIER", def)) {
-      readDefsFrom(mDefspath+"p44platform-" + def + ".defs", mDefs);
+// write aData followed by aTrailer to aFd with a single writev() (repeated only for partial writes)
+static bool writeAll(int aFd, boost::string_view aData, boost::string_view aTrailer = boost::string_view())
+{
+  struct iovec iov[2];
+  iov[0].iov_base = (void *)aData.data();
+  iov[0].iov_len = aData.size();
+  iov[1].iov_base = (void *)aTrailer.data();
+  iov[1].iov_len = aTrailer.size();
+  struct iovec *v = iov;
+  int n = 2;
+  while (n>0) {
+    ssize_t w = writev(aFd, v, n);
+    if (w<0) {
+      if (errno==EINTR) continue;
+      return false;
     }
-    // - set/override runtime detected computing module (Note: usually available only after p44 init script has run)
-    readDefFromFirstLine(COMPUTING_MODULE_FILE, "PLATFORM_COMPUTINGMODULE");
-    // check for dynamic product ID getter
-    //  such as: "/sbin/ubootenv --print 'p44productid' | sed -r -n -e '/^p44productid=/s/p44productid=//p'"
-    if (getDef("PLATFORM_PRODUCT_IDENTIFIER_GETTER", def)) {
-      MainLoop::currentMainLoop().fork_and_system(
-        boost::bind(&P44maintd::productidQueryDone, this, aCallback, _1, _2),
-        def.c_str(),
-        true, NULL, // collect stdout into string
-        0 // mute stderr
-      );
-      return;
+    while (n>0 && (size_t)w>=v->iov_len) { w -= v->iov_len; v++; n--; }
+    if (n>0) {
+      v->iov_base = (char *)v->iov_base + w;
+      v->iov_len -= w;
     }
-    // if we get here, product identifier is already there, so we can continue processing the product specifics
-    processProductSpecifics(aCallback);
   }
+  return true;
+}
+
 
+// Output buffer the writers below format into, to be written out at once
+class OutputBuffer
+{
+protected:
+  string mBuf;
 
-  void productidQueryDone(SimpleCB aCallback, ErrorPtr err, const string &aAnswer)
+  // append aText, with chars for which Escaping::needsEscape() is true replaced by Escaping::escapeChar()
+  template<class Escaping> void appendEscaped(boost::string_view aText)
   {
-    string v = trimWhiteSpace(aAnswer);
-    if (v.size()>0) {
-      mDefs["PRODUCT_IDENTIFIER"] = v;
+    size_t start = 0;
+    for (size_t i=0; i<aText.size(); i++) {
+      char c = aText[i];
+      if (Escaping::needsEscape(c)) {
+        mBuf.append(aText.data()+start, i-start);
+        Escaping::escapeChar(mBuf, c);
+        start = i+1;
+      }
     }
-    processProductSpecifics(aCallback);
+    mBuf.append(aText.data()+start, aText.size()-start);
   }
 
+public:
+
+  OutputBuffer() { mBuf.reserve(4096); }
 
-  void processProductSpecifics(SimpleCB aCallback)
+  const string &data() const { return mBuf; }
+  void clear() { mBuf.clear(); }
+
+  // write out and clear the buffer
+  bool flush(int aFd, boost::string_view aTrailer = boost::string_view())
   {
-    string def;
+    bool ok = writeAll(aFd, mBuf, aTrailer);
+    mBuf.clear();
+    return ok;
+  }
+};
 
-    // - product, possibly is a softlink
-    readDefsFrom(mDefspath+"p44product.defs", mDefs);
+
+// Streaming JSON writer, producing the same compact format as JsonObject::json_c_str(), including
+// json-c's string escaping (which also escapes "/" as "\/", and other control chars as lowercase \u00xx)
+class JsonWriter : public OutputBuffer
+{
+  uint64_t mHasMembers; // bit per nesting level
+  int mDepth;
+  bool mAfterKey;
+
+  void beginValue()
+  {
+    if (mAfterKey) {
+      mAfterKey = false;
+      return;
+    }
+    if (mHasMembers & (1ull<<mDepth)) mBuf += ',';
+    mHasMembers |= (1ull<<mDepth);
+  }
+
+  void appendString(boost::string_view aStr)
+  {
+    mBuf += '"';
+    appendEscaped<JsonWriter>(aStr);
+    mBuf += '"';
+  }
+
+  void open(char aBracket)
+  {
+    beginValue();
+    mBuf += aBracket;
+    mDepth++;
+    mHasMembers &= ~(1ull<<mDepth);
+  }
+
+  void close(char aBracket)
+  {
+    mDepth--;
+    mBuf += aBracket;
+  }
+
+public:
+
+  static bool needsEscape(char aChar) { return (uint8_t)aChar<0x20 || aChar=='"' || aChar=='\\' || aChar=='/'; }
+
+  static void escapeChar(string &aBuf, char aChar)
+  {
+    switch (aChar) {
+      case '"': aBuf += "\\\""; break;
+      case '\\': aBuf += "\\\\"; break;
+      case '/': aBuf += "\\/"; break;
+      case '\n': aBuf += "\\n"; break;
+      case '\r': aBuf += "\\r"; break;
+      case '\t': aBuf += "\\t"; break;
+      case '\b': aBuf += "\\b"; break;
+      case '\f': aBuf += "\\f"; break;
+      default: string_format_append(aBuf, "\\u%04x", (uint8_t)aChar); break;
+    }
+  }
+
+  JsonWriter() : mHasMembers(0), mDepth(0), mAfterKey(false) {};
+
+  void clear() { OutputBuffer::clear(); mHasMembers = 0; mDepth = 0; mAfterKey = false; }
+
+  JsonWriter &beginObject() { open('{'); return *this; }
+  JsonWriter &endObject() { close('}'); return *this; }
+  JsonWriter &beginArray() { open('['); return *this; }
+  JsonWriter &endArray() { close(']'); return *this; }
+
+  JsonWriter &key(boost::string_view aKey)
+  {
+    beginValue();
+    appendString(aKey);
+    mBuf += ':';
+    mAfterKey = true;
+    return *this;
+  }
+
+  JsonWriter &stringValue(boost::string_view aStr) { beginValue(); appendString(aStr); return *this; }
+  JsonWriter &intValue(int64_t aInt) { beginValue(); string_format_append(mBuf, "%lld", (long long)aInt); return *this; }
+  JsonWriter &boolValue(bool aBool) { beginValue(); mBuf += aBool ? "true" : "false"; return *this; }
+  JsonWriter &nullValue() { beginValue(); mBuf += "null"; return *this; }
+  JsonWriter &rawValue(boost::string_view aJson) { beginValue(); mBuf.append(aJson.data(), aJson.size()); return *this; }
+
+  // object members
+  JsonWriter &addString(boost::string_view aKey, boost::string_view aStr) { return key(aKey).stringValue(aStr); }
+  JsonWriter &addInt(boost::string_view aKey, int64_t aInt) { return key(aKey).intValue(aInt); }
+  JsonWriter &addBool(boost::string_view aKey, bool aBool) { return key(aKey).boolValue(aBool); }
+};
+
+
+// Streaming writer for shell variable assignments (one VAR="value" per line, like shellQuote() does)
+class ShellVarWriter : public OutputBuffer
+{
+public:
+
+  static bool needsEscape(char aChar) { return aChar=='"' || aChar=='\\' || aChar=='`' || aChar=='$'; }
+
+  static void escapeChar(string &aBuf, char aChar)
+  {
+    aBuf += '\\';
+    aBuf += aChar;
+  }
+
+  void assignment(boost::string_view aVar, boost::string_view aValue)
+  {
+    mBuf.append(aVar.data(), aVar.size());
+    mBuf += "=\"";
+    appendEscaped<ShellVarWriter>(aValue);
+    mBuf += "\"\n";
+  }
+};
+
+
+// Records the timing of named phases (relative to process start) for --profile
+class PhaseProfiler
+{
+  typedef struct {
+    const char *phase;
+    string detail;
+    MLMicroSeconds start;
+    MLMicroSeconds end; // Never as long as phase is running
+  } Phase;
+  vector<Phase> mPhases;
+  bool mEnabled;
+  MLMicroSeconds mT0;
+
+public:
+
+  static const size_t none = (size_t)-1;
+
+  PhaseProfiler() : mEnabled(false), mT0(MainLoop::now()) {};
+
+  void enable() { mEnabled = true; }
+  bool enabled() const { return mEnabled; }
+
+  // forget phases recorded so far, measure from now on
+  void restart() { mPhases.clear(); mT0 = MainLoop::now(); }
+
+  // @return phase index for end(), none when not profiling
+  size_t begin(const char *aPhase, const string &aDetail = string(), MLMicroSeconds aStart = Never)
+  {
+    if (!mEnabled) return none;
+    Phase p;
+    p.phase = aPhase;
+    p.detail = aDetail;
+    p.start = aStart!=Never ? aStart : MainLoop::now();
+    p.end = Never;
+    mPhases.push_back(p);
+    return mPhases.size()-1;
+  }
+
+  void end(size_t aPhaseIndex)
+  {
+    if (aPhaseIndex<mPhases.size() && mPhases[aPhaseIndex].end==Never) mPhases[aPhaseIndex].end = MainLoop::now();
+  }
+
+  // end all phases still running
+  void endAll()
+  {
+    MLMicroSeconds now = MainLoop::now();
+    for (vector<Phase>::iterator pos = mPhases.begin(); pos!=mPhases.end(); ++pos) {
+      if (pos->end==Never) pos->end = now;
+    }
+  }
+
+  void writeJSON(JsonWriter &aWriter) const
+  {
+    MLMicroSeconds now = MainLoop::now();
+    aWriter.beginObject();
+    aWriter.addInt("total_us", now-mT0);
+    aWriter.key("phases").beginArray();
+    for (vector<Phase>::const_iterator pos = mPhases.begin(); pos!=mPhases.end(); ++pos) {
+      aWriter.beginObject();
+      aWriter.addString("phase", pos->phase);
+      if (!pos->detail.empty()) aWriter.addString("detail", pos->detail);
+      aWriter.addInt("start_us", pos->start-mT0);
+      aWriter.key("duration_us");
+      if (pos->end==Never) aWriter.nullValue(); else aWriter.intValue(pos->end-pos->start);
+      aWriter.endObject();
+    }
+    aWriter.endArray();
+    aWriter.endObject();
+  }
+};
+
+
+// make sure no descriptors besides stdin/out/err get inherited by programs we exec
+static void setCloexecAboveStdErr()
+{
+  #ifdef SYS_close_range
+  if (syscall(SYS_close_range, STDERR_FILENO+1, ~0U, CLOSE_RANGE_CLOEXEC)==0) return;
+  #endif
+  // no close_range: mark the descriptors actually open, rather than trying every possible one
+  #if BUILDENV_XCODE
+  DIR *dir = opendir("/dev/fd");
+  #else
+  DIR *dir = opendir("/proc/self/fd");
+  #endif
+  if (!dir) return;
+  struct dirent *de;
+  while ((de = readdir(dir))!=NULL) {
+    int fd = atoi(de->d_name);
+    if (fd>STDERR_FILENO && fd!=dirfd(dir)) fcntl(fd, F_SETFD, fcntl(fd, F_GETFD) | FD_CLOEXEC);
+  }
+  closedir(dir);
+}
+
+
+// create a pipe with both ends close-on-exec, so other children never inherit them
+// (spawnProcess dup2()s the end a child needs, which clears close-on-exec on the copy)
+static int cloexecPipe(int aFds[2])
+{
+  #if defined(O_CLOEXEC) && !BUILDENV_XCODE
+  return pipe2(aFds, O_CLOEXEC);
+  #else
+  if (pipe(aFds)<0) return -1;
+  fcntl(aFds[0], F_SETFD, FD_CLOEXEC);
+  fcntl(aFds[1], F_SETFD, FD_CLOEXEC);
+  return 0;
+  #endif
+}
+
+
+// start aArgv[0] (searched in PATH unless it contains a slash) with posix_spawn, which does not
+// duplicate our address space (vfork semantics)
+// @param aStdIn, aStdOut descriptors to pass as child's stdin/stdout, -1 to inherit ours
+// @param aMuteStdErr if set, child's stderr goes to /dev/null
+// @return 0 or errno
+static int spawnProcess(pid_t &aPid, const char * const aArgv[], int aStdIn = -1, int aStdOut = -1, bool aMuteStdErr = false)
+{
+  setCloexecAboveStdErr();
+  posix_spawn_file_actions_t fa;
+  posix_spawn_file_actions_init(&fa);
+  if (aStdIn>=0 && aStdIn!=STDIN_FILENO) posix_spawn_file_actions_adddup2(&fa, aStdIn, STDIN_FILENO);
+  if (aStdOut>=0 && aStdOut!=STDOUT_FILENO) posix_spawn_file_actions_adddup2(&fa, aStdOut, STDOUT_FILENO);
+  if (aMuteStdErr) posix_spawn_file_actions_addopen(&fa, STDERR_FILENO, "/dev/null", O_WRONLY, 0);
+  posix_spawnattr_t attr;
+  posix_spawnattr_init(&attr);
+  #ifdef POSIX_SPAWN_USEVFORK
+  posix_spawnattr_setflags(&attr, POSIX_SPAWN_USEVFORK); // older glibc only uses vfork when asked to
+  #endif
+  int ret = posix_spawnp(&aPid, aArgv[0], &fa, &attr, (char * const *)aArgv, environ);
+  posix_spawnattr_destroy(&attr);
+  posix_spawn_file_actions_destroy(&fa);
+  return ret;
+}
+
+
+// read entire file (from the beginning, regardless of current position) with a single read() (where possible)
+static void readFdAtOnce(int aFd, string &aData)
+{
+  struct stat st;
+  size_t sz = fstat(aFd, &st)==0 && st.st_size>0 ? st.st_size : 0;
+  aData.resize(sz+1); // one extra to detect EOF without another read in the common case
+  size_t got = 0;
+  while (true) {
+    ssize_t n = pread(aFd, &aData[got], aData.size()-got, got);
+    if (n<=0) break;
+    got += n;
+    if (got<aData.size()) break; // short read means EOF for regular files
+    aData.resize(aData.size()*2+256); // file grew or has no size (e.g. procfs)
+  }
+  aData.resize(got);
+}
+
+
+static bool readFileAtOnce(const string &aPath, string &aData)
+{
+  int fd = open(aPath.c_str(), O_RDONLY);
+  if (fd<0) return false;
+  readFdAtOnce(fd, aData);
+  close(fd);
+  return true;
+}
+
+
+// @return true if aFd (opened with O_NOFOLLOW in world writable CACHE_DIR) is a regular file of ours
+//   that nobody else can write. Planted files must never be trusted, as we run as root.
+static bool isOwnFile(int aFd, const char *aPath)
+{
+  struct stat st;
+  if (fstat(aFd, &st)==0 && S_ISREG(st.st_mode) && st.st_uid==geteuid() && (st.st_mode & (S_IWGRP|S_IWOTH))==0) return true;
+  LOG(LOG_WARNING, "ignoring file not private to us: %s", aPath);
+  return false;
+}
+
+
+// read a file from CACHE_DIR, only when it is our own (see isOwnFile())
+static bool readOwnFile(const string &aPath, string &aData)
+{
+  int fd = open(aPath.c_str(), O_RDONLY|O_CLOEXEC|O_NOFOLLOW);
+  if (fd<0) return false;
+  if (!isOwnFile(fd, aPath.c_str())) {
+    close(fd);
+    return false;
+  }
+  readFdAtOnce(fd, aData);
+  close(fd);
+  return true;
+}
+
+
+// write file under a temporary name and rename it into place, so readers never see partial content
+// @note the temp file is created exclusively and private (0600), so this is safe in CACHE_DIR
+static ErrorPtr writeFileAtomically(const string aPath, const string &aData)
+{
+  string tmpPath = string_format("%s.%d", aPath.c_str(), getpid());
+  int fd = open(tmpPath.c_str(), O_WRONLY|O_CREAT|O_EXCL|O_NOFOLLOW|O_CLOEXEC, 0600);
+  if (fd<0 && errno==EEXIST) {
+    // left over by an earlier process with our pid, or planted: unlink (never follows a symlink) and retry
+    unlink(tmpPath.c_str());
+    fd = open(tmpPath.c_str(), O_WRONLY|O_CREAT|O_EXCL|O_NOFOLLOW|O_CLOEXEC, 0600);
+  }
+  if (fd<0) return SysError::errNo("cannot create file: ");
+  ErrorPtr err;
+  if (!writeAll(fd, aData)) err = SysError::errNo("cannot write file: ");
+  close(fd);
+  if (Error::isOK(err) && rename(tmpPath.c_str(), aPath.c_str())<0) {
+    err = SysError::errNo("cannot rename file: ");
+  }
+  if (Error::notOK(err)) unlink(tmpPath.c_str());
+  return err;
+}
+
+
+// length prefixed fields ("<len>:<bytes>") for files that must reproduce any content exactly
+static void appendField(string &aData, boost::string_view aField)
+{
+  string_format_append(aData, "%zu:", aField.size());
+  aData.append(aField.data(), aField.size());
+}
+
+
+static bool nextField(const char *&aCursor, const char *aEnd, string &aField)
+{
+  const char *p = aCursor;
+  size_t n = 0;
+  while (p<aEnd && isdigit(*p)) n = n*10 + (*p++ - '0');
+  if (p>=aEnd || *p!=':' || (size_t)(aEnd-p-1)<n) return false;
+  p++;
+  aField.assign(p, n);
+  aCursor = p+n;
+  return true;
+}
+
+
+// CRC-32 with the same result as p44::Crc32, using the ARMv8 CRC32 instructions where the target has them.
+// @note the SSE4.2 crc32 instruction calculates CRC-32C (Castagnoli polynomial), which does not match
+//   Crc32, so x86 targets use Crc32 as well.
+class FastCrc32
+{
+  #if HW_CRC32
+  uint32_t mCrc;
+  #else
+  Crc32 mCrc;
+  #endif
+
+public:
+
+  FastCrc32() { reset(); }
+
+  #if HW_CRC32
+
+  void reset() { mCrc = 0xFFFFFFFF; }
+
+  void addBytes(size_t aNumBytes, const uint8_t *aBytes)
+  {
+    uint32_t crc = mCrc;
+    while (aNumBytes>0 && ((uintptr_t)aBytes & 7)) {
+      crc = __crc32b(crc, *aBytes++);
+      aNumBytes--;
+    }
+    while (aNumBytes>=8) {
+      uint64_t v;
+      memcpy(&v, aBytes, 8);
+      crc = __crc32d(crc, v);
+      aBytes += 8;
+      aNumBytes -= 8;
+    }
+    while (aNumBytes>0) {
+      crc = __crc32b(crc, *aBytes++);
+      aNumBytes--;
+    }
+    mCrc = crc;
+  }
+
+  uint32_t getCRC() const { return ~mCrc; }
+
+  #else
+
+  void reset() { mCrc.reset(); }
+  void addBytes(size_t aNumBytes, const uint8_t *aBytes) { mCrc.addBytes(aNumBytes, aBytes); }
+  uint32_t getCRC() { return mCrc.getCRC(); }
+
+  #endif
+
+};
+
+
+// crc32 and size of the entire contents of aFd, regardless of its current position
+static ErrorPtr fdCrc32(int aFd, uint32_t &aCrc, uint64_t &aSize)
+{
+  FastCrc32 crc;
+  aSize = 0;
+  ErrorPtr err;
+  uint8_t buf[8192];
+  while (true) {
+    ssize_t n = pread(aFd, buf, sizeof(buf), aSize);
+    if (n<0) {
+      if (errno==EINTR) continue;
+      err = SysError::errNo("cannot read file: ");
+      break;
+    }
+    if (n==0) break;
+    crc.addBytes(n, buf);
+    aSize += n;
+  }
+  aCrc = crc.getCRC();
+  return err;
+}
+
+
+static ErrorPtr fileCrc32(const string &aPath, uint32_t &aCrc, uint64_t &aSize)
+{
+  int fd = open(aPath.c_str(), O_RDONLY|O_CLOEXEC);
+  if (fd<0) return SysError::errNo("cannot open file: ");
+  ErrorPtr err = fdCrc32(fd, aCrc, aSize);
+  close(fd);
+  return err;
+}
+
+
+// all writes to persistent storage (flash) go through here, to keep flash wear low and visible:
+// - whole file writes are deferred until flush(), so repeated writes of a file within a request are coalesced
+// - content identical to what is already stored is not written again (file only read when size matches)
+// - files are replaced atomically (temp file + rename), with configurable fsync policy
+// - files and bytes written are accounted per command, in a stats file on tmpfs
+class FlashWriter
+{
+public:
+
+  typedef enum {
+    fsync_none, // rely on the file system's commit interval
+    fsync_file, // fsync file before renaming it into place
+    fsync_full // also fsync the directory after renaming
+  } FsyncPolicy;
+
+  typedef struct {
+    uint64_t files; // number of files written (or appended to)
+    uint64_t bytes; // number of bytes written
+    uint64_t skipped; // number of file writes skipped because content was unchanged
+  } Counters;
+  typedef map<string, Counters> CountersMap; // by command
+
+private:
+
+  typedef map<string, string> PendingMap; // path -> new content
+  PendingMap mPending;
+  FsyncPolicy mFsyncPolicy;
+  string mCommand; // command writes are accounted to
+  Counters mCounters; // not yet recorded in stats file
+
+  FlashWriter() : mFsyncPolicy(fsync_file), mCommand("other") { memset(&mCounters, 0, sizeof(mCounters)); };
+
+public:
+
+  static FlashWriter &writer()
+  {
+    static FlashWriter w;
+    return w;
+  }
+
+  void setFsyncPolicy(FsyncPolicy aPolicy) { mFsyncPolicy = aPolicy; }
+
+  // set the command subsequent writes are accounted to
+  void setCommand(const string &aCommand) { mCommand = aCommand; }
+
+  // write file when flush() is called
+  void write(const string &aPath, const string &aData) { mPending[aPath] = aData; }
+
+  // write file now (for files protected by locks, which must be complete before unlocking)
+  ErrorPtr writeNow(const string &aPath, const string &aData)
+  {
+    mPending.erase(aPath); // superseded
+    return store(aPath, aData);
+  }
+
+  // append to open file now
+  ErrorPtr append(int aFd, boost::string_view aData)
+  {
+    if (!writeAll(aFd, aData)) return SysError::errNo("cannot append: ");
+    if (mFsyncPolicy!=fsync_none) fdatasync(aFd);
+    mCounters.files++;
+    mCounters.bytes += aData.size();
+    return ErrorPtr();
+  }
+
+  // perform all deferred writes
+  ErrorPtr flush()
+  {
+    ErrorPtr err;
+    for (PendingMap::iterator pos = mPending.begin(); pos!=mPending.end(); ++pos) {
+      ErrorPtr e = store(pos->first, pos->second);
+      if (Error::notOK(e)) {
+        LOG(LOG_ERR, "cannot write %s: %s", pos->first.c_str(), e->description().c_str());
+        err = e;
+      }
+    }
+    mPending.clear();
+    return err;
+  }
+
+  // add the counters accumulated so far to the stats file
+  void recordStats()
+  {
+    if (mCounters.files==0 && mCounters.skipped==0) return; // nothing to record
+    int fd = open(FLASH_STATS_FILE, O_RDWR|O_CREAT|O_CLOEXEC|O_NOFOLLOW, 0644);
+    if (fd<0) return;
+    if (!isOwnFile(fd, FLASH_STATS_FILE)) {
+      close(fd);
+      return;
+    }
+    flock(fd, LOCK_EX);
+    CountersMap stats;
+    parseStats(fd, stats);
+    Counters &c = stats[mCommand];
+    c.files += mCounters.files;
+    c.bytes += mCounters.bytes;
+    c.skipped += mCounters.skipped;
+    string text;
+    for (CountersMap::const_iterator pos = stats.begin(); pos!=stats.end(); ++pos) {
+      string_format_append(text, "%s %llu %llu %llu\n", pos->first.c_str(),
+        (unsigned long long)pos->second.files, (unsigned long long)pos->second.bytes, (unsigned long long)pos->second.skipped
+      );
+    }
+    if (pwrite(fd, text.data(), text.size(), 0)==(ssize_t)text.size()) ftruncate(fd, text.size());
+    close(fd); // also releases lock
+    memset(&mCounters, 0, sizeof(mCounters));
+  }
+
+  // read the stats recorded since boot (or last reset)
+  static void readStats(CountersMap &aStats, bool aReset)
+  {
+    int fd = open(FLASH_STATS_FILE, O_RDWR|O_CLOEXEC|O_NOFOLLOW);
+    if (fd<0) return;
+    if (!isOwnFile(fd, FLASH_STATS_FILE)) {
+      close(fd);
+      return;
+    }
+    flock(fd, LOCK_EX);
+    parseStats(fd, aStats);
+    if (aReset) ftruncate(fd, 0);
+    close(fd);
+  }
+
+private:
+
+  static void parseStats(int aFd, CountersMap &aStats)
+  {
+    string text;
+    readFdAtOnce(aFd, text);
+    const char *p = text.c_str();
+    char cmd[64];
+    unsigned long long files, bytes, skipped;
+    int n;
+    while (sscanf(p, "%63s %llu %llu %llu\n%n", cmd, &files, &bytes, &skipped, &n)==4) {
+      Counters &c = aStats[cmd];
+      c.files = files;
+      c.bytes = bytes;
+      c.skipped = skipped;
+      p += n;
+    }
+  }
+
+
+  ErrorPtr store(const string &aPath, const string &aData)
+  {
+    // skip if unchanged
+    struct stat orig;
+    bool exists = false;
+    int ofd = open(aPath.c_str(), O_RDONLY|O_CLOEXEC);
+    if (ofd>=0) {
+      bool same = false;
+      exists = fstat(ofd, &orig)==0;
+      if (exists && (uint64_t)orig.st_size==aData.size()) {
+        string old;
+        readFdAtOnce(ofd, old);
+        same = old==aData;
+      }
+      close(ofd);
+      if (same) {
+        mCounters.skipped++;
+        return ErrorPtr();
+      }
+    }
+    // write to temp file, created exclusively and private until it has the original's owner and mode
+    string tmpPath = string_format("%s.%d", aPath.c_str(), getpid());
+    const int flags = O_WRONLY|O_CREAT|O_EXCL|O_NOFOLLOW|O_CLOEXEC;
+    int fd = open(tmpPath.c_str(), flags, exists ? 0600 : 0644);
+    if (fd<0 && errno==EEXIST) {
+      unlink(tmpPath.c_str()); // left over by an earlier process with our pid
+      fd = open(tmpPath.c_str(), flags, exists ? 0600 : 0644);
+    }
+    if (fd<0) return SysError::errNo("cannot create file: ");
+    ErrorPtr err;
+    if (exists) {
+      // replaced files keep their owner and mode (e.g. UCI wireless config, which holds the wifi key, is 0600)
+      if (
+        ((orig.st_uid!=geteuid() || orig.st_gid!=getegid()) && fchown(fd, orig.st_uid, orig.st_gid)<0) ||
+        fchmod(fd, orig.st_mode & 07777)<0
+      ) {
+        err = SysError::errNo("cannot set owner/mode of file: ");
+      }
+    }
+    if (Error::isOK(err) && !(writeAll(fd, aData) && (mFsyncPolicy==fsync_none || fsync(fd)==0))) {
+      err = SysError::errNo("cannot write file: ");
+    }
+    close(fd);
+    // replace original
+    if (Error::isOK(err) && rename(tmpPath.c_str(), aPath.c_str())<0) err = SysError::errNo("cannot rename file: ");
+    if (Error::notOK(err)) {
+      unlink(tmpPath.c_str());
+      return err;
+    }
+    if (mFsyncPolicy==fsync_full) {
+      // make the rename durable
+      size_t sl = aPath.rfind('/');
+      int dfd = open(sl==string::npos ? "." : aPath.substr(0, sl+1).c_str(), O_RDONLY|O_DIRECTORY|O_CLOEXEC);
+      if (dfd>=0) {
+        fsync(dfd);
+        close(dfd);
+      }
+    }
+    mCounters.files++;
+    mCounters.bytes += aData.size();
+    return err;
+  }
+
+};
+
+// cache for the answers of read-only queries the web UI polls, shared by all processes in a single file on tmpfs.
+// File format: magic and generation on the first line, then entries "<expiry> <key>\t<answer>\n", with expiry
+// in seconds of the monotonic clock, key being the request parameters as JSON text and answer the JSON answer.
+// The file is mode 0600, because answers may contain secrets.
+// Readers hold a shared, writers an exclusive flock() on the file, so every process sees complete entries only.
+// invalidate() drops all entries and bumps the generation, so a query which started before a change cannot
+// store its (then outdated) answer afterwards.
+class ResultCache
+{
+  // @return generation, 0 for missing or unknown file; aEntries is set to the entry lines
+  static uint32_t readCache(int aFd, string &aEntries)
+  {
+    string text;
+    readFdAtOnce(aFd, text);
+    unsigned int gen = 0;
+    int n = 0;
+    if (sscanf(text.c_str(), RESULT_CACHE_MAGIC " %u\n%n", &gen, &n)<1 || n==0) return 0;
+    aEntries.assign(text, n, string::npos);
+    return gen;
+  }
+
+  static ErrorPtr writeCache(int aFd, uint32_t aGeneration, const string &aEntries)
+  {
+    string text = string_format(RESULT_CACHE_MAGIC " %u\n", aGeneration) + aEntries;
+    if (pwrite(aFd, text.data(), text.size(), 0)!=(ssize_t)text.size() || ftruncate(aFd, text.size())<0) {
+      return SysError::errNo("cannot write result cache: ");
+    }
+    return ErrorPtr();
+  }
+
+  static long long nowSeconds() { return MainLoop::now()/Second; }
+
+  // open cache file for updating. Cached answers can contain secrets (e.g. the wifi key in wificonfig),
+  // so the file must only be accessible by the owner, also when it was created by an older version.
+  // A file not created by us is removed rather than used (others might still have it open).
+  static int openForUpdate()
+  {
+    int fd = open(RESULT_CACHE_FILE, O_RDWR|O_CREAT|O_CLOEXEC|O_NOFOLLOW, 0600);
+    if (fd<0) return -1;
+    if (!isOwnFile(fd, RESULT_CACHE_FILE)) {
+      close(fd);
+      unlink(RESULT_CACHE_FILE);
+      return -1;
+    }
+    if (fchmod(fd, 0600)<0) {
+      close(fd);
+      return -1;
+    }
+    return fd;
+  }
+
+  // split next entry line off aEntries
+  // @return false when no more (complete) entries
+  static bool nextEntry(boost::string_view &aEntries, boost::string_view &aLine, long long &aExpiry, boost::string_view &aKey, boost::string_view &aAnswer)
+  {
+    while (true) {
+      size_t e = aEntries.find('\n');
+      if (e==boost::string_view::npos) return false;
+      aLine = aEntries.substr(0, e+1);
+      aEntries.remove_prefix(e+1);
+      size_t sp = aLine.find(' ');
+      size_t tab = aLine.find('\t');
+      if (sp==boost::string_view::npos || tab==boost::string_view::npos || tab<sp) continue; // skip malformed
+      aExpiry = atoll(aLine.data());
+      aKey = aLine.substr(sp+1, tab-sp-1);
+      aAnswer = aLine.substr(tab+1, e-tab-1);
+      return true;
+    }
+  }
+
+public:
+
+  // look up answer for aKey
+  // @param aGeneration set to the current generation in any case, to be passed to store() on a miss
+  // @return true if there is an unexpired answer
+  static bool lookup(const string &aKey, string &aAnswer, uint32_t &aGeneration)
+  {
+    aGeneration = 0;
+    int fd = open(RESULT_CACHE_FILE, O_RDONLY|O_CLOEXEC|O_NOFOLLOW);
+    if (fd<0) return false;
+    if (!isOwnFile(fd, RESULT_CACHE_FILE)) {
+      close(fd);
+      return false;
+    }
+    flock(fd, LOCK_SH);
+    string entries;
+    aGeneration = readCache(fd, entries);
+    close(fd); // also releases lock
+    long long now = nowSeconds();
+    boost::string_view rest = entries, line, key, answer;
+    long long expiry;
+    while (nextEntry(rest, line, expiry, key, answer)) {
+      if (key==aKey && expiry>now) {
+        aAnswer.assign(answer.data(), answer.size());
+        return true;
+      }
+    }
+    return false;
+  }
+
+  // store answer for aKey, unless the cache was invalidated after the lookup that returned aGeneration
+  static void store(const string &aKey, boost::string_view aAnswer, int aTTL, uint32_t aGeneration)
+  {
+    int fd = openForUpdate();
+    if (fd<0) return;
+    flock(fd, LOCK_EX);
+    string entries;
+    if (readCache(fd, entries)==aGeneration) {
+      // keep other unexpired entries
+      long long now = nowSeconds();
+      string text;
+      boost::string_view rest = entries, line, key, answer;
+      long long expiry;
+      while (nextEntry(rest, line, expiry, key, answer)) {
+        if (expiry>now && key!=aKey) text.append(line.data(), line.size());
+      }
+      string_format_append(text, "%lld %s\t", now+aTTL, aKey.c_str());
+      text.append(aAnswer.data(), aAnswer.size());
+      text += '\n';
+      ErrorPtr err = writeCache(fd, aGeneration, text);
+      if (Error::notOK(err)) LOG(LOG_WARNING, "%s", err->description().c_str());
+    }
+    close(fd); // also releases lock
+  }
+
+  // drop all cached answers, to be called after changing anything a cached query might report
+  static void invalidate()
+  {
+    int fd = openForUpdate();
+    if (fd<0) return;
+    flock(fd, LOCK_EX);
+    string entries;
+    ErrorPtr err = writeCache(fd, readCache(fd, entries)+1, "");
+    if (Error::notOK(err)) LOG(LOG_WARNING, "%s", err->description().c_str());
+    close(fd); // also releases lock
+  }
+
+};
+
+// persistent key/value store for the JSON `property` command: an append-only log of checksummed
+// records in a single file, so reading any number of properties costs one open and one read.
+// Log format: magic line, then records "CCCCCCCC<len>:<key><len>:<value>\n", with CCCCCCCC being
+// the hex crc32 of the two fields, and value being JSON text (empty value = key deleted).
+// Replaying the log builds the key index; a damaged tail (e.g. interrupted append) is ignored
+// and dropped by rewriting the log at the next update. The log is compacted when it has grown
+// to more than twice the size of the live records.
+class PropertyStore
+{
+public:
+
+  typedef map<string, string> ValueMap; // key -> value as JSON text
+  typedef vector< pair<string, string> > Changes; // key -> new value as JSON text, empty to delete
+
+private:
+
+  string mDir;
+  ValueMap mValues;
+  size_t mLogSize; // size of the valid part of the log
+  size_t mLiveSize; // size a compacted log would have
+  bool mNeedsRewrite; // log is damaged, does not exist yet or legacy files need to be merged into it
+  vector<string> mLegacyFiles; // imported one-file-per-property files, to delete once the log is written
+
+public:
+
+  // @param aDir directory of the store, with trailing slash
+  PropertyStore(const string &aDir) : mDir(aDir), mLogSize(0), mLiveSize(0), mNeedsRewrite(false) {};
+
+  // all properties, sorted by key
+  const ValueMap &values() const { return mValues; }
+
+  bool get(const string &aKey, string &aJson) const
+  {
+    ValueMap::const_iterator pos = mValues.find(aKey);
+    if (pos==mValues.end()) return false;
+    aJson = pos->second;
+    return true;
+  }
+
+  // load all properties (read only, never writes to flash)
+  ErrorPtr load()
+  {
+    string log;
+    int fd = open(logPath().c_str(), O_RDONLY|O_CLOEXEC);
+    if (fd<0) {
+      if (errno!=ENOENT) return SysError::errNo("cannot open property store: ");
+      // first use: no log yet, per-file properties are migrated at the first update
+      return replay(log);
+    }
+    flock(fd, LOCK_SH);
+    readFdAtOnce(fd, log);
+    close(fd); // also releases lock
+    return replay(log);
+  }
+
+  // apply changes with a single append (or by rewriting the log, if it is due for compaction)
+  ErrorPtr update(const Changes &aChanges)
+  {
+    int fd;
+    ErrorPtr err = lockForUpdate(fd);
+    if (Error::notOK(err)) return err;
+    string log;
+    readFdAtOnce(fd, log);
+    err = replay(log); // current state, including changes by other processes
+    if (Error::isOK(err)) {
+      string records;
+      for (Changes::const_iterator pos = aChanges.begin(); pos!=aChanges.end(); ++pos) {
+        apply(pos->first, pos->second);
+        appendRecord(records, pos->first, pos->second);
+      }
+      mLogSize += records.size();
+      if (mNeedsRewrite || mLogSize>2*mLiveSize+PROPERTY_COMPACT_MINSIZE) {
+        err = compact();
+      }
+      else {
+        err = FlashWriter::writer().append(fd, records);
+      }
+    }
+    close(fd); // also releases lock
+    return err;
+  }
+
+private:
+
+  string logPath() const { return mDir + PROPERTY_STORE_FILE; }
+
+  static size_t recordSize(const string &aKey, const string &aValue)
+  {
+    return 8 + string_format("%zu:%zu:", aKey.size(), aValue.size()).size() + aKey.size() + aValue.size() + 1;
+  }
+
+
+  static void appendRecord(string &aLog, const string &aKey, const string &aValue)
+  {
+    size_t start = aLog.size();
+    aLog.append(8, '0'); // placeholder for crc
+    appendField(aLog, aKey);
+    appendField(aLog, aValue);
+    Crc32 crc;
+    crc.addBytes(aLog.size()-start-8, (const uint8_t *)aLog.data()+start+8);
+    memcpy(&aLog[start], string_format("%08X", crc.getCRC()).c_str(), 8);
+    aLog += '\n';
+  }
+
+
+  void apply(const string &aKey, const string &aValue)
+  {
+    ValueMap::iterator pos = mValues.find(aKey);
+    if (pos!=mValues.end()) {
+      mLiveSize -= recordSize(aKey, pos->second);
+      if (aValue.empty()) { mValues.erase(pos); return; }
+      pos->second = aValue;
+    }
+    else {
+      if (aValue.empty()) return;
+      mValues[aKey] = aValue;
+    }
+    mLiveSize += recordSize(aKey, aValue);
+  }
+
+
+  // open and exclusively lock the log, making sure it was not replaced by a compaction meanwhile
+  ErrorPtr lockForUpdate(int &aFd)
+  {
+    while (true) {
+      aFd = open(logPath().c_str(), O_RDWR|O_APPEND|O_CREAT|O_CLOEXEC, 0644);
+      if (aFd<0) return SysError::errNo("cannot open property store: ");
+      if (flock(aFd, LOCK_EX)<0) {
+        ErrorPtr err = SysError::errNo("cannot lock property store: ");
+        close(aFd);
+        return err;
+      }
+      struct stat fst, pst;
+      if (fstat(aFd, &fst)==0 && stat(logPath().c_str(), &pst)==0 && fst.st_ino==pst.st_ino) return ErrorPtr();
+      close(aFd); // replaced, try again with new file
+    }
+  }
+
+
+  // rebuild the in-memory state from the log contents, plus legacy files still present
+  ErrorPtr replay(const string &aLog)
+  {
+    mValues.clear();
+    mLegacyFiles.clear();
+    mLiveSize = strlen(PROPERTY_STORE_MAGIC);
+    mNeedsRewrite = false;
+    if (aLog.empty()) {
+      // new log
+      mLogSize = 0;
+      mNeedsRewrite = true;
+      importLegacyFiles();
+      return ErrorPtr();
+    }
+    if (aLog.compare(0, mLiveSize, PROPERTY_STORE_MAGIC)!=0) {
+      return ErrorPtr(new Error(1, "property store has unknown format"));
+    }
+    const char *p = aLog.data()+mLiveSize;
+    const char *e = aLog.data()+aLog.size();
+    string key, value;
+    while (p<e) {
+      const char *r = p+8;
+      uint32_t crc;
+      if (r>=e || sscanf(p, "%8X", &crc)!=1 || !nextField(r, e, key) || !nextField(r, e, value) || r>=e || *r!='\n') break;
+      Crc32 c;
+      c.addBytes(r-p-8, (const uint8_t *)p+8);
+      if (c.getCRC()!=crc) break;
+      apply(key, value);
+      p = r+1;
+    }
+    mLogSize = p-aLog.data();
+    if (p<e) {
+      LOG(LOG_WARNING, "property store damaged at offset %zu, ignoring %zu bytes", mLogSize, (size_t)(e-p));
+      mNeedsRewrite = true;
+    }
+    // per-file properties showing up after the log was created (e.g. restored from an old backup)
+    // are newer than the log and override it, until the next update merges them in
+    importLegacyFiles();
+    if (!mLegacyFiles.empty()) mNeedsRewrite = true;
+    return ErrorPtr();
+  }
+
+
+  // import the former layout with one FLASH_PATH/p44_property_<key> file per property
+  void importLegacyFiles()
+  {
+    DIR *dir = opendir(mDir.c_str());
+    if (!dir) return;
+    const size_t pfxLen = strlen(PROPERTY_LEGACY_PREFIX);
+    struct dirent *de;
+    string value;
+    while ((de = readdir(dir))!=NULL) {
+      if (strncmp(de->d_name, PROPERTY_LEGACY_PREFIX, pfxLen)!=0 || de->d_name[pfxLen]==0) continue;
+      if (!readFileAtOnce(mDir+de->d_name, value)) continue;
+      value = trimWhiteSpace(value);
+      if (!value.empty()) apply(de->d_name+pfxLen, value);
+      mLegacyFiles.push_back(de->d_name);
+    }
+    closedir(dir);
+  }
+
+
+  // rewrite the log with live records only
+  ErrorPtr compact()
+  {
+    string log = PROPERTY_STORE_MAGIC;
+    log.reserve(mLiveSize);
+    for (ValueMap::const_iterator pos = mValues.begin(); pos!=mValues.end(); ++pos) {
+      appendRecord(log, pos->first, pos->second);
+    }
+    ErrorPtr err = FlashWriter::writer().writeNow(logPath(), log);
+    if (Error::isOK(err)) {
+      mLogSize = log.size();
+      mNeedsRewrite = false;
+      // now contained in log
+      for (size_t i=0; i<mLegacyFiles.size(); i++) unlink((mDir+mLegacyFiles[i]).c_str());
+      mLegacyFiles.clear();
+    }
+    return err;
+  }
+
+};
+
+
+// queue of persistent alerts: one JSON file per alert, plus an index file holding the queue
+// order (higher priority first, then oldest first) and the headers of all pending alerts,
+// so counting, paging and confirming needs neither directory scans nor parsing alert files.
+// Alerts are deduplicated by a hash of their contents (without id): repeated alerts only count
+// occurrences in the index, at most once per rate limit interval, also shortly after confirmation.
+// Index format: "P44ALERTS2 <nextseq>" line, then one "<seq> <created> <priority> <hash> <count> <lastseen> <id>"
+// line per alert, and "- <hash> <lastseen>" lines for recently confirmed alerts still subject to rate limiting.
+// A "P44ALERTS1 <nextseq>" index with "<seq> <created> <priority> <id>" lines is upgraded, keeping its counter.
+// The alert directory is flock()ed while the queue is in use, and the index is replaced atomically.
+class AlertQueue
+{
+public:
+
+  typedef struct {
+    uint64_t seq; // creation sequence number, unique and monotonic
+    MLMicroSeconds created; // unix time
+    int priority; // higher comes first
+    uint64_t hash; // FNV64 of alert contents without id
+    int count; // number of occurrences
+    MLMicroSeconds lastSeen; // unix time of last recorded occurrence
+    string id;
+  } Header;
+  typedef vector<Header> HeaderVector; // in queue order
+
+private:
+
+  typedef map<uint64_t, MLMicroSeconds> RecentMap; // hash -> last seen, for confirmed alerts
+
+  string mDir;
+  MLMicroSeconds mRateLimit;
+  size_t mMaxPending;
+  int mDirFd; // open and locked alert directory, -1 if not locked
+  uint64_t mNextSeq;
+  HeaderVector mHeaders;
+  RecentMap mRecent;
+  bool mChanged; // index needs to be written
+
+  // queue order
+  class HeaderBefore
+  {
+  public:
+    bool operator()(const Header &aA, const Header &aB) const
+    {
+      if (aA.priority!=aB.priority) return aA.priority>aB.priority;
+      return aA.seq<aB.seq;
+    }
+  };
+
+public:
+
+  // @param aDir alert directory, with trailing slash
+  // @param aRateLimit min interval between two recorded occurrences of the same alert
+  // @param aMaxPending max number of pending alerts
+  AlertQueue(const string &aDir, MLMicroSeconds aRateLimit, size_t aMaxPending) :
+    mDir(aDir), mRateLimit(aRateLimit), mMaxPending(aMaxPending), mDirFd(-1), mNextSeq(1), mChanged(false) {};
+  ~AlertQueue() { unlock(); }
+
+  static bool validId(const string &aId)
+  {
+    return !aId.empty() && aId.find_first_of("/.\n")==string::npos;
+  }
+
+  // lock the queue and load the index (rebuilding it from the alert files if missing)
+  ErrorPtr lock()
+  {
+    if (mDirFd>=0) return ErrorPtr();
+    mkdir(mDir.c_str(), S_IRWXU | S_IRWXG | S_IROTH | S_IXOTH);
+    mDirFd = open(mDir.c_str(), O_RDONLY|O_DIRECTORY|O_CLOEXEC);
+    if (mDirFd<0) return SysError::errNo("cannot open alert directory: ");
+    if (flock(mDirFd, LOCK_EX)<0) {
+      ErrorPtr err = SysError::errNo("cannot lock alert directory: ");
+      close(mDirFd);
+      mDirFd = -1;
+      return err;
+    }
+    if (!loadIndex()) rebuildIndex();
+    return ErrorPtr();
+  }
+
+  // write back the index (if changed) and unlock the queue
+  ErrorPtr unlock()
+  {
+    ErrorPtr err;
+    if (mDirFd<0) return err;
+    if (mChanged) {
+      string index = string_format(ALERT_INDEX_MAGIC " %llu\n", (unsigned long long)mNextSeq);
+      for (HeaderVector::const_iterator pos = mHeaders.begin(); pos!=mHeaders.end(); ++pos) {
+        string_format_append(index, "%llu %lld %d %016llX %d %lld %s\n",
+          (unsigned long long)pos->seq, (long long)pos->created, pos->priority,
+          (unsigned long long)pos->hash, pos->count, (long long)pos->lastSeen, pos->id.c_str()
+        );
+      }
+      MLMicroSeconds now = MainLoop::unixtime();
+      for (RecentMap::const_iterator pos = mRecent.begin(); pos!=mRecent.end(); ++pos) {
+        if (now-pos->second<mRateLimit) string_format_append(index, "- %016llX %lld\n", (unsigned long long)pos->first, (long long)pos->second);
+      }
+      err = FlashWriter::writer().writeNow(mDir+ALERT_INDEX_FILE, index);
+      mChanged = false;
+    }
+    close(mDirFd); // also releases lock
+    mDirFd = -1;
+    return err;
+  }
+
+  const HeaderVector &headers() const { return mHeaders; }
+
+  // @return alert with "occurrences" and "lastseen" added, NULL if its file has gone missing
+  JsonObjectPtr alert(const Header &aHeader) const
+  {
+    JsonObjectPtr alert = JsonObject::objFromFile(alertPath(aHeader.id).c_str());
+    if (alert) {
+      alert->add("occurrences", JsonObject::newInt32(aHeader.count));
+      alert->add("lastseen", JsonObject::newInt64(aHeader.lastSeen/Second));
+    }
+    return alert;
+  }
+
+  // add new alert (or replace the alert with the same id)
+  // @param aAlert the alert, will get an "id" field if it has none
+  // @param aId set to id of the new alert, or of the pending identical alert, empty if alert was suppressed
+  ErrorPtr add(JsonObjectPtr aAlert, string &aId)
+  {
+    Header h;
+    h.created = MainLoop::unixtime();
+    h.lastSeen = h.created;
+    h.count = 1;
+    h.hash = contentHash(aAlert);
+    aId.clear();
+    // identical alert pending?
+    for (HeaderVector::iterator pos = mHeaders.begin(); pos!=mHeaders.end(); ++pos) {
+      if (pos->hash==h.hash) {
+        aId = pos->id;
+        if (h.created-pos->lastSeen>=mRateLimit) {
+          // record occurrence
+          pos->count++;
+          pos->lastSeen = h.created;
+          mChanged = true;
+        }
+        return ErrorPtr();
+      }
+    }
+    // identical alert confirmed only recently?
+    RecentMap::iterator r = mRecent.find(h.hash);
+    if (r!=mRecent.end() && h.created-r->second<mRateLimit) return ErrorPtr(); // suppressed
+    JsonObjectPtr o;
+    h.priority = aAlert->get("priority", o) ? o->int32Value() : 0;
+    if (aAlert->get("id", o)) {
+      // id defined in the alert already -> use it, replacing previous alert with same id
+      h.id = o->stringValue();
+      if (!validId(h.id)) return ErrorPtr(new Error(415, "invalid alert id"));
+      remove(h.id);
+    }
+    if (mHeaders.size()>=mMaxPending) {
+      // full: make room only for alerts of higher priority than the last one in the queue
+      if (mHeaders.empty() || h.priority<=mHeaders.back().priority) return ErrorPtr(new Error(507, "too many pending alerts"));
+      LOG(LOG_WARNING, "too many pending alerts, dropping alert '%s'", mHeaders.back().id.c_str());
+      remove(mHeaders.back().id);
+    }
+    h.seq = mNextSeq++;
+    if (h.id.empty()) {
+      // generate unique id from sequence number
+      while (find(h.id = string_format("%llu", (unsigned long long)h.seq))!=mHeaders.end()) h.seq = mNextSeq++;
+      aAlert->add("id", JsonObject::newString(h.id));
+    }
+    mChanged = true; // sequence number is used up in any case
+    ErrorPtr err = FlashWriter::writer().writeNow(alertPath(h.id), aAlert->json_str());
+    if (Error::notOK(err)) return err;
+    mHeaders.insert(upper_bound(mHeaders.begin(), mHeaders.end(), h, HeaderBefore()), h);
+    aId = h.id;
+    return err;
+  }
+
+  // remove alert
+  // @return true if alert existed
+  bool remove(const string &aId)
+  {
+    HeaderVector::iterator pos = find(aId);
+    if (pos==mHeaders.end()) return false;
+    unlink(alertPath(aId).c_str());
+    mRecent[pos->hash] = pos->lastSeen;
+    mHeaders.erase(pos);
+    mChanged = true;
+    return true;
+  }
+
+  void removeAll()
+  {
+    for (HeaderVector::const_iterator pos = mHeaders.begin(); pos!=mHeaders.end(); ++pos) {
+      unlink(alertPath(pos->id).c_str());
+      mRecent[pos->hash] = pos->lastSeen;
+    }
+    mHeaders.clear();
+    mChanged = true;
+  }
+
+private:
+
+  string alertPath(const string &aId) const { return mDir + ALERT_FILE_PREFIX + aId; }
+
+  static uint64_t contentHash(JsonObjectPtr aAlert)
+  {
+    JsonObjectPtr id = aAlert->get("id");
+    if (id) aAlert->del("id");
+    Fnv64 h;
+    h.addString(aAlert->json_str());
+    if (id) aAlert->add("id", id);
+    return h.getHash();
+  }
+
+  HeaderVector::iterator find(const string &aId)
+  {
+    HeaderVector::iterator pos = mHeaders.begin();
+    while (pos!=mHeaders.end() && pos->id!=aId) ++pos;
+    return pos;
+  }
+
+
+  bool loadIndex()
+  {
+    string index;
+    if (!readFileAtOnce(mDir+ALERT_INDEX_FILE, index)) return false;
+    const char *p = index.c_str();
+    unsigned long long ns;
+    int n;
+    bool v1 = false;
+    if (sscanf(p, ALERT_INDEX_MAGIC " %llu%n", &ns, &n)!=1) {
+      if (sscanf(p, ALERT_INDEX_MAGIC_V1 " %llu%n", &ns, &n)!=1) return false;
+      v1 = true;
+    }
+    mNextSeq = ns;
+    mHeaders.clear();
+    mRecent.clear();
+    p += n;
+    while (*p=='\n') {
+      p++;
+      Header h;
+      unsigned long long seq, hash = 0;
+      long long created, lastSeen;
+      if (v1) {
+        if (sscanf(p, "%llu %lld %d %n", &seq, &created, &h.priority, &n)!=3) break;
+        h.count = 1;
+        lastSeen = created;
+      }
+      else {
+        if (sscanf(p, "- %llX %lld%n", &hash, &lastSeen, &n)==2) {
+          // recently confirmed
+          mRecent[hash] = lastSeen;
+          p += n;
+          continue;
+        }
+        if (sscanf(p, "%llu %lld %d %llX %d %lld %n", &seq, &created, &h.priority, &hash, &h.count, &lastSeen, &n)!=6) break;
+      }
+      p += n;
+      const char *e = strchr(p, '\n');
+      if (!e) return false; // truncated
+      h.seq = seq;
+      h.created = created;
+      h.hash = hash;
+      h.lastSeen = lastSeen;
+      h.id.assign(p, e-p);
+      p = e;
+      if (v1) {
+        // no content hash in the former index yet
+        JsonObjectPtr alert = JsonObject::objFromFile(alertPath(h.id).c_str());
+        if (!alert) continue; // alert file is gone
+        h.hash = contentHash(alert);
+      }
+      mHeaders.push_back(h);
+    }
+    if (*p!=0) return false;
+    if (v1) {
+      stable_sort(mHeaders.begin(), mHeaders.end(), HeaderBefore());
+      mChanged = true;
+      LOG(LOG_NOTICE, "upgraded alert index, %zu pending alerts", mHeaders.size());
+    }
+    return true;
+  }
+
+
+  // recreate index from the alert files (index missing, or alerts from before the index existed)
+  void rebuildIndex()
+  {
+    mHeaders.clear();
+    DIR *dir = fdopendir(dup(mDirFd));
+    if (dir) {
+      const size_t pfxLen = strlen(ALERT_FILE_PREFIX);
+      struct dirent *de;
+      while ((de = readdir(dir))!=NULL) {
+        if (strncmp(de->d_name, ALERT_FILE_PREFIX, pfxLen)!=0) continue;
+        Header h;
+        h.id = de->d_name+pfxLen;
+        if (!validId(h.id)) continue;
+        struct stat st;
+        JsonObjectPtr alert = JsonObject::objFromFile((mDir+de->d_name).c_str());
+        if (!alert || stat((mDir+de->d_name).c_str(), &st)<0) continue;
+        JsonObjectPtr o;
+        h.priority = alert->get("priority", o) ? o->int32Value() : 0;
+        h.created = (MLMicroSeconds)st.st_mtime*Second;
+        h.hash = contentHash(alert);
+        h.count = 1;
+        h.lastSeen = h.created;
+        mHeaders.push_back(h);
+        // numeric ids are former sequence numbers, new ones must not restart below them
+        if (h.id.size()<=19 && h.id.find_first_not_of("0123456789")==string::npos) {
+          uint64_t seq = strtoull(h.id.c_str(), NULL, 10);
+          if (seq>=mNextSeq) mNextSeq = seq+1;
+        }
+      }
+      closedir(dir);
+    }
+    // assign sequence numbers in order of creation
+    sort(mHeaders.begin(), mHeaders.end(), CreatedBefore());
+    for (HeaderVector::iterator pos = mHeaders.begin(); pos!=mHeaders.end(); ++pos) pos->seq = mNextSeq++;
+    stable_sort(mHeaders.begin(), mHeaders.end(), HeaderBefore());
+    mChanged = true;
+    LOG(LOG_NOTICE, "rebuilt alert index, %zu pending alerts", mHeaders.size());
+  }
+
+  class CreatedBefore
+  {
+  public:
+    bool operator()(const Header &aA, const Header &aB) const { return aA.created<aB.created || (aA.created==aB.created && aA.id<aB.id); }
+  };
+
+};
+
+
+#if !BUILDENV_DIGIESP
+
+// UCI config read directly, and written via FlashWriter
+class FlashUciConfig : public UciConfig
+{
+public:
+
+  FlashUciConfig(const string &aDir) : UciConfig(aDir) {};
+
+protected:
+
+  virtual bool readPackage(const string &aPath, string &aText)
+  {
+    return readFileAtOnce(aPath, aText);
+  }
+
+  virtual ErrorPtr writePackage(const string &aPath, const string &aText)
+  {
+    return FlashWriter::writer().writeNow(aPath, aText);
+  }
+
+};
+
+#endif // !BUILDENV_DIGIESP
+
+
+#if !BUILDENV_XCODE
+
+// live network status of the primary interface, read directly from the kernel via rtnetlink
+class NetStatus
+{
+public:
+
+  int mIfIndex; // interface carrying the default route (or first with an IPv4 address), 0 if none
+  uint32_t mIPv4; // current IPv4 address, host byte order, 0 if none
+  uint32_t mNetmask; // netmask of the current IPv4 address, host byte order
+  uint32_t mGateway; // default gateway, host byte order, 0 if none
+  bool mDhcpLease; // current IPv4 address has a limited lifetime, i.e. is a (DHCP) lease
+  string mIPv6Link; // link local IPv6 address
+  string mIPv6Global; // global IPv6 address
+
+  NetStatus() : mIfIndex(0), mIPv4(0), mNetmask(0), mGateway(0), mDhcpLease(false) {};
+
+  // read the status with two dumps (routes, addresses) on a single netlink socket
+  ErrorPtr read()
+  {
+    int sock = socket(AF_NETLINK, SOCK_RAW|SOCK_CLOEXEC, NETLINK_ROUTE);
+    if (sock<0) return SysError::errNo("netlink socket: ");
+    struct timeval tv = { 2, 0 }; // kernel answers immediately, just prevent hanging forever
+    setsockopt(sock, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+    string msgs;
+    ErrorPtr err = dump(sock, RTM_GETROUTE, AF_INET, 1, msgs);
+    if (Error::isOK(err)) {
+      scanRoutes(msgs);
+      err = dump(sock, RTM_GETADDR, AF_UNSPEC, 2, msgs);
+      if (Error::isOK(err)) scanAddresses(msgs);
+    }
+    close(sock);
+    return err;
+  }
+
+  static string ipv4String(uint32_t aIp)
+  {
+    return string_format("%d.%d.%d.%d", (aIp>>24)&0xFF, (aIp>>16)&0xFF, (aIp>>8)&0xFF, aIp&0xFF);
+  }
+
+private:
+
+  // request a dump and collect all of its messages (without the terminating NLMSG_DONE)
+  static ErrorPtr dump(int aSock, uint16_t aType, uint8_t aFamily, uint32_t aSeq, string &aMsgs)
+  {
+    struct {
+      struct nlmsghdr nh;
+      union { struct rtmsg rt; struct ifaddrmsg ifa; } u;
+    } req;
+    memset(&req, 0, sizeof(req));
+    req.nh.nlmsg_len = NLMSG_LENGTH(aType==RTM_GETROUTE ? sizeof(struct rtmsg) : sizeof(struct ifaddrmsg));
+    req.nh.nlmsg_type = aType;
+    req.nh.nlmsg_flags = NLM_F_REQUEST|NLM_F_DUMP;
+    req.nh.nlmsg_seq = aSeq;
+    if (aType==RTM_GETROUTE) req.u.rt.rtm_family = aFamily; else req.u.ifa.ifa_family = aFamily;
+    if (send(aSock, &req, req.nh.nlmsg_len, 0)<0) return SysError::errNo("netlink send: ");
+    aMsgs.clear();
+    char buf[8192] __attribute__((aligned(NLMSG_ALIGNTO)));
+    while (true) {
+      ssize_t n = recv(aSock, buf, sizeof(buf), 0);
+      if (n<0) {
+        if (errno==EINTR) continue;
+        return SysError::errNo("netlink recv: ");
+      }
+      if (n==0) return ErrorPtr(new Error(1, "netlink socket closed"));
+      int len = (int)n;
+      for (struct nlmsghdr *nh = (struct nlmsghdr *)buf; NLMSG_OK(nh, len); nh = NLMSG_NEXT(nh, len)) {
+        if (nh->nlmsg_seq!=aSeq) continue; // not ours
+        if (nh->nlmsg_type==NLMSG_DONE) return ErrorPtr();
+        if (nh->nlmsg_type==NLMSG_ERROR) {
+          const struct nlmsgerr *e = (const struct nlmsgerr *)NLMSG_DATA(nh);
+          return ErrorPtr(new Error(1, string_format("netlink error %d", -e->error)));
+        }
+        aMsgs.append((const char *)nh, NLMSG_ALIGN(nh->nlmsg_len));
+      }
+    }
+  }
+
+  static uint32_t attrIPv4(const struct rtattr *aAttr)
+  {
+    uint32_t a;
+    memcpy(&a, RTA_DATA(aAttr), sizeof(a));
+    return ntohl(a);
+  }
+
+  // find default route with the lowest metric in the main table
+  void scanRoutes(const string &aMsgs)
+  {
+    uint32_t bestPrio = 0;
+    bool found = false;
+    int len = (int)aMsgs.size();
+    for (const struct nlmsghdr *nh = (const struct nlmsghdr *)aMsgs.data(); NLMSG_OK(nh, len); nh = NLMSG_NEXT(nh, len)) {
+      if (nh->nlmsg_type!=RTM_NEWROUTE) continue;
+      const struct rtmsg *rt = (const struct rtmsg *)NLMSG_DATA(nh);
+      if (rt->rtm_dst_len!=0 || rt->rtm_type!=RTN_UNICAST) continue; // not a default route
+      uint32_t table = rt->rtm_table;
+      uint32_t prio = 0;
+      uint32_t gw = 0;
+      int oif = 0;
+      int alen = RTM_PAYLOAD(nh);
+      for (const struct rtattr *a = RTM_RTA(rt); RTA_OK(a, alen); a = RTA_NEXT(a, alen)) {
+        switch (a->rta_type) {
+          case RTA_TABLE: table = *(const uint32_t *)RTA_DATA(a); break;
+          case RTA_PRIORITY: prio = *(const uint32_t *)RTA_DATA(a); break;
+          case RTA_OIF: oif = *(const int *)RTA_DATA(a); break;
+          case RTA_GATEWAY: gw = attrIPv4(a); break;
+        }
+      }
+      if (table!=RT_TABLE_MAIN) continue;
+      if (!found || prio<bestPrio) {
+        found = true;
+        bestPrio = prio;
+        mGateway = gw;
+        mIfIndex = oif;
+      }
+    }
+  }
+
+  // pick addresses of the default route's interface (or the first interface with a non-host-scope IPv4 address)
+  void scanAddresses(const string &aMsgs)
+  {
+    // pass 1: IPv4, which also determines the interface when there is no default route
+    // pass 2: IPv6 of that interface
+    for (int pass=1; pass<=2; pass++) {
+      int len = (int)aMsgs.size();
+      for (const struct nlmsghdr *nh = (const struct nlmsghdr *)aMsgs.data(); NLMSG_OK(nh, len); nh = NLMSG_NEXT(nh, len)) {
+        if (nh->nlmsg_type!=RTM_NEWADDR) continue;
+        const struct ifaddrmsg *ifa = (const struct ifaddrmsg *)NLMSG_DATA(nh);
+        if (ifa->ifa_family!=(pass==1 ? AF_INET : AF_INET6)) continue;
+        if (ifa->ifa_scope==RT_SCOPE_HOST) continue; // loopback
+        if (mIfIndex!=0 && (int)ifa->ifa_index!=mIfIndex) continue; // other interface
+        const struct rtattr *addr = NULL;
+        const struct rtattr *local = NULL;
+        const struct ifa_cacheinfo *ci = NULL;
+        uint32_t flags = ifa->ifa_flags;
+        int alen = IFA_PAYLOAD(nh);
+        for (const struct rtattr *a = IFA_RTA(ifa); RTA_OK(a, alen); a = RTA_NEXT(a, alen)) {
+          switch (a->rta_type) {
+            case IFA_ADDRESS: addr = a; break;
+            case IFA_LOCAL: local = a; break;
+            case IFA_CACHEINFO: ci = (const struct ifa_cacheinfo *)RTA_DATA(a); break;
+            #ifdef IFA_FLAGS
+            case IFA_FLAGS: flags = *(const uint32_t *)RTA_DATA(a); break;
+            #endif
+          }
+        }
+        if (local) addr = local; // on point-to-point links, IFA_ADDRESS is the peer
+        if (!addr) continue;
+        if (pass==1) {
+          if (mIPv4) continue; // already have one
+          mIfIndex = ifa->ifa_index;
+          mIPv4 = attrIPv4(addr);
+          mNetmask = ifa->ifa_prefixlen==0 ? 0 : 0xFFFFFFFFu<<(32-ifa->ifa_prefixlen);
+          mDhcpLease = ci && ci->ifa_valid!=0xFFFFFFFFu; // infinite lifetime means statically configured
+        }
+        else {
+          if (flags & (IFA_F_TENTATIVE|IFA_F_DEPRECATED)) continue; // not usable
+          string &target = ifa->ifa_scope==RT_SCOPE_LINK ? mIPv6Link : mIPv6Global;
+          if (!target.empty() || (flags & IFA_F_TEMPORARY)) continue; // first stable address only
+          char buf[INET6_ADDRSTRLEN];
+          if (inet_ntop(AF_INET6, RTA_DATA(addr), buf, sizeof(buf))) target = buf;
+        }
+      }
+    }
+  }
+
+};
+
+#endif // !BUILDENV_XCODE
+
+
+// Streams a ustar archive to a file descriptor (pipe or socket) without buffering file contents:
+// file data is moved with sendfile() or splice() where the kernel supports it for the given
+// descriptors, falling back to read()/write() through a small buffer otherwise.
+// Only regular files, directories and symlinks are archived; ownership is stored as root.
+class TarWriter
+{
+  int mFd;
+  uint64_t mBytes; // total bytes written, including headers and padding
+  size_t mFiles;
+  enum {
+    copy_sendfile,
+    copy_splice,
+    copy_readwrite
+  } mCopyMode;
+
+public:
+
+  TarWriter(int aFd) : mFd(aFd), mBytes(0), mFiles(0),
+    #if BUILDENV_XCODE
+    mCopyMode(copy_readwrite)
+    #else
+    mCopyMode(copy_sendfile)
+    #endif
+  {}
+
+  uint64_t bytes() const { return mBytes; }
+  size_t files() const { return mFiles; }
+
+  // add a member with in-memory contents
+  ErrorPtr addData(const string &aName, boost::string_view aData, time_t aMTime, mode_t aMode = 0644)
+  {
+    ErrorPtr err = header(aName, '0', aMode, aData.size(), aMTime);
+    if (Error::isOK(err)) err = write(aData.data(), aData.size());
+    if (Error::isOK(err)) err = pad(aData.size());
+    if (Error::isOK(err)) mFiles++;
+    return err;
+  }
+
+  // add a file, directory (entry only) or symlink, stored under its path without leading slash
+  // @param aType if set, aPath must still be of this type ('f' file, 'l' symlink, 'd' directory) and,
+  //   for files and symlinks, have crc32 aCrc and size aSize as archived (i.e. as listed in a manifest
+  //   written before). Otherwise, an error is returned because the archive would be inconsistent.
+  // @note paths that do not exist are skipped, as are device files, fifos and sockets
+  ErrorPtr addPath(const string &aPath, char aType = 0, uint32_t aCrc = 0, uint64_t aSize = 0)
+  {
+    struct stat st;
+    if (lstat(aPath.c_str(), &st)<0) {
+      if (errno==ENOENT) return aType ? changedError(aPath) : ErrorPtr();
+      return SysError::errNo("cannot stat backup path: ");
+    }
+    if (aType) {
+      char type = S_ISREG(st.st_mode) ? 'f' : (S_ISLNK(st.st_mode) ? 'l' : (S_ISDIR(st.st_mode) ? 'd' : 0));
+      if (type!=aType || (type!='d' && (uint64_t)st.st_size!=aSize)) return changedError(aPath);
+    }
+    size_t s = aPath.find_first_not_of('/');
+    string name = s==string::npos ? string() : aPath.substr(s);
+    if (name.empty()) return ErrorPtr(new Error(1, "cannot backup root directory"));
+    if (S_ISDIR(st.st_mode) && *name.rbegin()!='/') name += '/';
+    if (splitPos(name)==string::npos) {
+      LOG(LOG_WARNING, "backup: path '%s' too long for archive, skipped", aPath.c_str());
+      return ErrorPtr();
+    }
+    if (S_ISREG(st.st_mode)) return addFile(aPath, name, st, aType ? &aCrc : NULL);
+    if (S_ISLNK(st.st_mode)) {
+      char target[PATH_MAX];
+      ssize_t n = readlink(aPath.c_str(), target, sizeof(target)-1);
+      if (n<0) return SysError::errNo("cannot read symlink: ");
+      target[n] = 0;
+      if (n>100) {
+        LOG(LOG_WARNING, "backup: symlink target of '%s' too long, skipped", aPath.c_str());
+        return ErrorPtr();
+      }
+      if (aType) {
+        FastCrc32 crc;
+        crc.addBytes(n, (const uint8_t *)target);
+        if (crc.getCRC()!=aCrc || (uint64_t)n!=aSize) return changedError(aPath);
+      }
+      return header(name, '2', st.st_mode, 0, st.st_mtime, target);
+    }
+    if (S_ISDIR(st.st_mode)) return header(name, '5', st.st_mode, 0, st.st_mtime);
+    LOG(LOG_INFO, "backup: '%s' is not a file, directory or symlink, skipped", aPath.c_str());
+    return ErrorPtr();
+  }
+
+  // add a member header, to be followed by aSize bytes of addContent() and endContent()
+  ErrorPtr addHeader(const string &aName, char aType, mode_t aMode, uint64_t aSize, time_t aMTime, const char *aLinkTarget = "")
+  {
+    return header(aName, aType, aMode, aSize, aMTime, aLinkTarget);
+  }
+
+  ErrorPtr addContent(const char *aData, size_t aSize) { return write(aData, aSize); }
+
+  ErrorPtr endContent(uint64_t aSize)
+  {
+    ErrorPtr err = pad(aSize);
+    if (Error::isOK(err)) mFiles++;
+    return err;
+  }
+
+  // write end of archive marker
+  ErrorPtr finish()
+  {
+    char zeroes[1024];
+    memset(zeroes, 0, sizeof(zeroes));
+    return write(zeroes, sizeof(zeroes));
+  }
+
+  // ustar stores names longer than 100 chars split at a slash into prefix (max 155) and name (max 100)
+  // @return 0 when no split is needed, position of the separating slash otherwise, npos when name does not fit
+  static size_t splitPos(const string &aName)
+  {
+    if (aName.size()<=100) return 0;
+    size_t s = aName.find('/', aName.size()-101);
+    if (s==string::npos || s==0 || s>155 || s==aName.size()-1) return string::npos;
+    return s;
+  }
+
+private:
+
+  static ErrorPtr changedError(const string &aPath)
+  {
+    return ErrorPtr(new Error(409, "backup path changed while archiving, retry backup: " + aPath));
+  }
+
+  // @param aVerifyCrc if set, the file must have this crc32 after copying (data is moved by the kernel,
+  //   so it is re-read from the page cache for checking)
+  ErrorPtr addFile(const string &aPath, const string &aName, const struct stat &aStat, const uint32_t *aVerifyCrc)
+  {
+    int fd = open(aPath.c_str(), O_RDONLY|O_CLOEXEC);
+    if (fd<0) return SysError::errNo("cannot open file for backup: ");
+    ErrorPtr err = header(aName, '0', aStat.st_mode, aStat.st_size, aStat.st_mtime);
+    if (Error::isOK(err)) err = copyData(fd, aStat.st_size);
+    if (Error::isOK(err)) err = pad(aStat.st_size);
+    if (Error::isOK(err) && aVerifyCrc) {
+      uint32_t crc;
+      uint64_t size;
+      err = fdCrc32(fd, crc, size);
+      if (Error::isOK(err) && (crc!=*aVerifyCrc || size!=(uint64_t)aStat.st_size)) err = changedError(aPath);
+    }
+    close(fd);
+    if (Error::isOK(err)) mFiles++;
+    return err;
+  }
+
+  // copy exactly aSize bytes (as announced in the header) from aFd
+  ErrorPtr copyData(int aFd, uint64_t aSize)
+  {
+    uint64_t remaining = aSize;
+    #if !BUILDENV_XCODE
+    while (remaining>0 && mCopyMode!=copy_readwrite) {
+      ssize_t n;
+      if (mCopyMode==copy_sendfile)
+        n = sendfile(mFd, aFd, NULL, remaining);
+      else
+        n = splice(aFd, NULL, mFd, NULL, remaining, SPLICE_F_MOVE);
+      if (n<0) {
+        if (errno==EINTR) continue;
+        if (errno==EINVAL || errno==ENOSYS) {
+          // not supported for this pair of descriptors, try next method
+          mCopyMode = mCopyMode==copy_sendfile ? copy_splice : copy_readwrite;
+          continue;
+        }
+        return SysError::errNo("backup data transfer failed: ");
+      }
+      if (n==0) break; // file shrunk
+      remaining -= n;
+      mBytes += n;
+    }
+    #endif
+    char buf[8192];
+    while (remaining>0) {
+      ssize_t n = read(aFd, buf, remaining<sizeof(buf) ? (size_t)remaining : sizeof(buf));
+      if (n<0) {
+        if (errno==EINTR) continue;
+        return SysError::errNo("cannot read file for backup: ");
+      }
+      if (n==0) break;
+      ErrorPtr err = write(buf, n);
+      if (Error::notOK(err)) return err;
+      remaining -= n;
+    }
+    if (remaining>0) {
+      // file was truncated while archiving: fill up to the size announced in the header
+      memset(buf, 0, sizeof(buf));
+      while (remaining>0) {
+        size_t n = remaining<sizeof(buf) ? (size_t)remaining : sizeof(buf);
+        ErrorPtr err = write(buf, n);
+        if (Error::notOK(err)) return err;
+        remaining -= n;
+      }
+    }
+    return ErrorPtr();
+  }
+
+  ErrorPtr header(const string &aName, char aType, mode_t aMode, uint64_t aSize, time_t aMTime, const char *aLinkTarget = "")
+  {
+    char h[512];
+    memset(h, 0, sizeof(h));
+    size_t s = splitPos(aName);
+    if (s==string::npos) return ErrorPtr(new Error(1, "path too long for archive: " + aName));
+    if (s==0) {
+      memcpy(h, aName.data(), aName.size());
+    }
+    else {
+      memcpy(h+345, aName.data(), s);
+      memcpy(h, aName.data()+s+1, aName.size()-s-1);
+    }
+    snprintf(h+100, 8, "%07o", (unsigned)(aMode & 07777));
+    snprintf(h+108, 8, "%07o", 0); // uid
+    snprintf(h+116, 8, "%07o", 0); // gid
+    snprintf(h+124, 12, "%011llo", (unsigned long long)aSize);
+    snprintf(h+136, 12, "%011llo", (unsigned long long)aMTime);
+    memset(h+148, ' ', 8); // checksum is calculated with checksum field set to spaces
+    h[156] = aType;
+    strncpy(h+157, aLinkTarget, 100);
+    memcpy(h+257, "ustar", 6);
+    memcpy(h+263, "00", 2);
+    memcpy(h+265, "root", 4);
+    memcpy(h+297, "root", 4);
+    unsigned sum = 0;
+    for (size_t i=0; i<sizeof(h); i++) sum += (uint8_t)h[i];
+    snprintf(h+148, 7, "%06o", sum);
+    return write(h, sizeof(h));
+  }
+
+  ErrorPtr pad(uint64_t aSize)
+  {
+    size_t n = (512-aSize%512)%512;
+    if (n==0) return ErrorPtr();
+    char zeroes[512];
+    memset(zeroes, 0, n);
+    return write(zeroes, n);
+  }
+
+  ErrorPtr write(const char *aData, size_t aSize)
+  {
+    while (aSize>0) {
+      ssize_t n = ::write(mFd, aData, aSize);
+      if (n<0) {
+        if (errno==EINTR) continue;
+        return SysError::errNo("cannot write backup archive: ");
+      }
+      aData += n;
+      aSize -= n;
+      mBytes += n;
+    }
+    return ErrorPtr();
+  }
+
+};
+
+
+// Content manifest of a config backup, listing type ('f' file, 'l' symlink, 'd' directory), crc32 and
+// size of every archived path, keyed by archive member name. Symlinks are described by their target.
+// Text format, one "<type> <crc32> <size> <name>" line per entry. Comparing with the manifest of an
+// earlier backup yields what an incremental backup needs to contain.
+class BackupManifest
+{
+public:
+
+  typedef struct {
+    char type;
+    uint32_t crc;
+    uint64_t size;
+  } Entry;
+  typedef map<string, Entry> EntryMap;
+
+private:
+
+  EntryMap mEntries;
+
+public:
+
+  const EntryMap &entries() const { return mEntries; }
+
+  // add absolute path aPath, directories recursively
+  // @note paths that do not exist are skipped, as well as anything TarWriter cannot archive
+  ErrorPtr scan(const string &aPath)
+  {
+    if (aPath.empty() || aPath[0]!='/') {
+      LOG(LOG_WARNING, "backup: '%s' is not an absolute path, skipped", aPath.c_str());
+      return ErrorPtr();
+    }
+    struct stat st;
+    if (lstat(aPath.c_str(), &st)<0) {
+      if (errno==ENOENT) return ErrorPtr();
+      return SysError::errNo("cannot stat backup path: ");
+    }
+    size_t s = aPath.find_first_not_of('/');
+    if (s==string::npos) return ErrorPtr(new Error(1, "cannot backup root directory"));
+    string name = aPath.substr(s);
+    if (S_ISDIR(st.st_mode) && *name.rbegin()!='/') name += '/';
+    if (TarWriter::splitPos(name)==string::npos || name.find('\n')!=string::npos) {
+      LOG(LOG_WARNING, "backup: path '%s' cannot be archived, skipped", aPath.c_str());
+      return ErrorPtr();
+    }
+    Entry e;
+    e.crc = 0;
+    e.size = 0;
+    if (S_ISREG(st.st_mode)) {
+      e.type = 'f';
+      ErrorPtr err = fileCrc32(aPath, e.crc, e.size);
+      if (Error::notOK(err)) return err;
+    }
+    else if (S_ISLNK(st.st_mode)) {
+      char target[PATH_MAX];
+      ssize_t n = readlink(aPath.c_str(), target, sizeof(target));
+      if (n<0) return SysError::errNo("cannot read symlink: ");
+      if (n>100) {
+        LOG(LOG_WARNING, "backup: symlink target of '%s' too long, skipped", aPath.c_str());
+        return ErrorPtr();
+      }
+      e.type = 'l';
+      e.size = n;
+      FastCrc32 crc;
+      crc.addBytes(n, (const uint8_t *)target);
+      e.crc = crc.getCRC();
+    }
+    else if (S_ISDIR(st.st_mode)) {
+      e.type = 'd';
+    }
+    else {
+      return ErrorPtr();
+    }
+    mEntries[name] = e;
+    if (e.type!='d') return ErrorPtr();
+    DIR *dir = opendir(aPath.c_str());
+    if (!dir) return SysError::errNo("cannot open backup directory: ");
+    string base = aPath;
+    if (*base.rbegin()!='/') base += '/';
+    ErrorPtr err;
+    struct dirent *de;
+    while (Error::isOK(err) && (de = readdir(dir))!=NULL) {
+      if (strcmp(de->d_name, ".")==0 || strcmp(de->d_name, "..")==0) continue;
+      err = scan(base + de->d_name);
+    }
+    closedir(dir);
+    return err;
+  }
+
+  // @return true when aName is not in this manifest, or with different type or content
+  bool differs(const string &aName, const Entry &aEntry) const
+  {
+    EntryMap::const_iterator pos = mEntries.find(aName);
+    if (pos==mEntries.end()) return true;
+    return pos->second.type!=aEntry.type || pos->second.crc!=aEntry.crc || pos->second.size!=aEntry.size;
+  }
+
+  const Entry *find(const string &aName) const
+  {
+    EntryMap::const_iterator pos = mEntries.find(aName);
+    return pos==mEntries.end() ? NULL : &pos->second;
+  }
+
+  string text() const
+  {
+    string t;
+    for (EntryMap::const_iterator pos = mEntries.begin(); pos!=mEntries.end(); ++pos) {
+      string_format_append(t, "%c %08X %llu ", pos->second.type, pos->second.crc, (unsigned long long)pos->second.size);
+      t += pos->first;
+      t += '\n';
+    }
+    return t;
+  }
+
+  // @return false if aText is not a valid manifest
+  bool parse(const string &aText)
+  {
+    mEntries.clear();
+    const char *p = aText.c_str();
+    string line;
+    while (nextPart(p, line, '\n')) {
+      if (line.empty()) continue;
+      Entry e;
+      unsigned crc;
+      unsigned long long size;
+      int n = 0;
+      if (sscanf(line.c_str(), "%c %8X %llu %n", &e.type, &crc, &size, &n)<3 || n==0 || (size_t)n>=line.size()) return false;
+      if (e.type!='f' && e.type!='l' && e.type!='d') return false;
+      e.crc = crc;
+      e.size = size;
+      mEntries[line.substr(n)] = e;
+    }
+    return true;
+  }
+
+  // @return identification of a manifest (its crc32), used to chain incremental backups
+  static uint32_t id(const string &aText)
+  {
+    FastCrc32 crc;
+    crc.addBytes(aText.size(), (const uint8_t *)aText.data());
+    return crc.getCRC();
+  }
+
+};
+
+
+// Reads a tar archive sequentially, member by member. gzip and xz compressed archives are
+// decompressed by the external tool through a pipe. Data of members not asked for is skipped
+// (by seeking for uncompressed archives), so nothing gets extracted to the file system.
+class TarReader
+{
+  int mFd;
+  pid_t mDecompressor;
+  bool mSeekable;
+  uint64_t mDataSize; // data size of the current member
+  uint64_t mDataUnread; // data of the current member not yet consumed
+  size_t mPadding; // padding following the current member's data
+  mode_t mMode;
+  time_t mMTime;
+  string mLinkTarget;
+
+public:
+
+  TarReader() : mFd(-1), mDecompressor(-1), mSeekable(false), mDataSize(0), mDataUnread(0), mPadding(0), mMode(0), mMTime(0) {}
+  ~TarReader() { close(); }
+
+  // attributes of the current member
+  mode_t mode() const { return mMode; }
+  time_t mtime() const { return mMTime; }
+  const string &linkTarget() const { return mLinkTarget; }
+
+  ErrorPtr open(const string &aPath)
+  {
+    close();
+    int fd = ::open(aPath.c_str(), O_RDONLY|O_CLOEXEC);
+    if (fd<0) return SysError::errNo("cannot open archive: ");
+    uint8_t magic[6];
+    ssize_t n = pread(fd, magic, sizeof(magic), 0);
+    const char *tool = NULL;
+    if (n>=2 && magic[0]==0x1F && magic[1]==0x8B) tool = "gzip";
+    else if (n==6 && memcmp(magic, "\xFD" "7zXZ\0", 6)==0) tool = "xz";
+    if (!tool) {
+      mFd = fd;
+      mSeekable = true;
+      return ErrorPtr();
+    }
+    int p[2];
+    if (cloexecPipe(p)<0) {
+      ErrorPtr err = SysError::errNo("cannot create decompressor pipe: ");
+      ::close(fd);
+      return err;
+    }
+    // decompress from archive file to pipe
+    const char *argv[] = { tool, "-dc", NULL };
+    int ret = spawnProcess(mDecompressor, argv, fd, p[1]);
+    ::close(fd);
+    ::close(p[1]);
+    if (ret!=0) {
+      ::close(p[0]);
+      mDecompressor = -1;
+      return SysError::err(ret, "cannot start decompressor: ");
+    }
+    mFd = p[0];
+    mSeekable = false;
+    return ErrorPtr();
+  }
+
+  // advance to the next member
+  // @return false at end of archive or on error (aErr set)
+  bool nextMember(string &aName, char &aType, uint64_t &aSize, ErrorPtr &aErr)
+  {
+    string longName;
+    while (true) {
+      aErr = skip(mDataUnread+mPadding);
+      if (Error::notOK(aErr)) return false;
+      mDataUnread = 0;
+      mPadding = 0;
+      char h[512];
+      ssize_t n = readFull(h, sizeof(h));
+      if (n<0) { aErr = SysError::errNo("cannot read archive: "); return false; }
+      if (n==0) return false; // EOF without end marker, accept like tar does
+      if (n<(ssize_t)sizeof(h)) { aErr = ErrorPtr(new Error(1, "truncated archive")); return false; }
+      if (h[0]==0) return false; // end of archive marker
+      unsigned sum = 0;
+      for (size_t i=0; i<sizeof(h); i++) sum += (i>=148 && i<156) ? ' ' : (uint8_t)h[i];
+      if (octal(h+148, 8)!=sum) { aErr = ErrorPtr(new Error(1, "not a tar archive")); return false; }
+      aType = h[156] ? h[156] : '0';
+      aSize = octal(h+124, 12);
+      mDataSize = aSize;
+      mDataUnread = aSize;
+      mPadding = (512-aSize%512)%512;
+      mMode = (mode_t)octal(h+100, 8);
+      mMTime = (time_t)octal(h+136, 12);
+      mLinkTarget.assign(h+157, strnlen(h+157, 100));
+      if (aType=='L') {
+        // GNU long name for the next member
+        if (Error::notOK(aErr = readData(longName))) return false;
+        if (!longName.empty() && *longName.rbegin()==0) longName.erase(longName.find('\0'));
+        continue;
+      }
+      if (!longName.empty()) {
+        aName = longName;
+      }
+      else {
+        aName.assign(h, strnlen(h, 100));
+        if (memcmp(h+257, "ustar", 5)==0 && h[345]) {
+          aName.insert(0, string(h+345, strnlen(h+345, 155)) + "/");
+        }
+      }
+      return true;
+    }
+  }
+
+  // read the data of the current member
+  ErrorPtr readData(string &aData)
+  {
+    if (mDataUnread<mDataSize) return ErrorPtr(new Error(1, "member data already consumed"));
+    aData.resize(mDataSize);
+    size_t got;
+    return mDataSize>0 ? readChunk(&aData[0], mDataSize, got) : ErrorPtr();
+  }
+
+  // read next chunk of the current member's data
+  // @param aGot set to number of bytes read, 0 when all data of the member has been read
+  ErrorPtr readChunk(char *aBuf, size_t aMax, size_t &aGot)
+  {
+    aGot = 0;
+    if (mDataUnread<aMax) aMax = (size_t)mDataUnread;
+    if (aMax==0) return ErrorPtr();
+    ssize_t n = readFull(aBuf, aMax);
+    if (n<0) return SysError::errNo("cannot read archive: ");
+    if ((size_t)n<aMax) return ErrorPtr(new Error(1, "truncated archive"));
+    aGot = n;
+    mDataUnread -= n;
+    return ErrorPtr();
+  }
+
+  // stop reading, terminates decompressor if one is still running
+  void close()
+  {
+    if (mFd>=0) ::close(mFd);
+    mFd = -1;
+    if (mDecompressor>0) {
+      kill(mDecompressor, SIGTERM);
+      while (waitpid(mDecompressor, NULL, 0)<0 && errno==EINTR);
+    }
+    mDecompressor = -1;
+  }
+
+private:
+
+  static uint64_t octal(const char *aField, size_t aLen)
+  {
+    uint64_t v = 0;
+    size_t i = 0;
+    while (i<aLen && aField[i]==' ') i++;
+    for (; i<aLen && aField[i]>='0' && aField[i]<='7'; i++) v = (v<<3) + (aField[i]-'0');
+    return v;
+  }
+
+  ssize_t readFull(char *aBuf, size_t aSize)
+  {
+    size_t got = 0;
+    while (got<aSize) {
+      ssize_t n = read(mFd, aBuf+got, aSize-got);
+      if (n<0) {
+        if (errno==EINTR) continue;
+        return -1;
+      }
+      if (n==0) break;
+      got += n;
+    }
+    return got;
+  }
+
+  ErrorPtr skip(uint64_t aBytes)
+  {
+    if (aBytes==0) return ErrorPtr();
+    if (mSeekable) {
+      if (lseek(mFd, aBytes, SEEK_CUR)<0) return SysError::errNo("cannot seek in archive: ");
+      return ErrorPtr();
+    }
+    char buf[8192];
+    while (aBytes>0) {
+      ssize_t n = readFull(buf, aBytes<sizeof(buf) ? (size_t)aBytes : sizeof(buf));
+      if (n<0) return SysError::errNo("cannot read archive: ");
+      if (n==0) return ErrorPtr(new Error(1, "truncated archive"));
+      aBytes -= n;
+    }
+    return ErrorPtr();
+  }
+
+};
+
+
+// plan44 unit serial numbers: the lower 24 bits are the lower 24 bits of the unit's MAC address,
+// the bits above encode the MAC's OUI (upper 24 bits) according to this table
+typedef struct {
+  uint32_t oui;
+  uint8_t code;
+} SerialOUI;
+
+static constexpr SerialOUI serialOUIs[] = {
+  { 0x00409D, 1 }, // Digiboard Inc. aka digi.com
+  { 0xB827EB, 2 }, // Raspberry Pi Foundation
+  { 0x40A36B, 3 }, // Onion Corporation (MA-M: C00000-CFFFFF)
+  { 0x881E59, 4 }, // Onion Corporation (MA-L: 000000-FFFFFF)
+};
+static constexpr size_t numSerialOUIs = sizeof(serialOUIs)/sizeof(SerialOUI);
+static constexpr uint8_t unknownOUICode = 42; // MAC with an OUI not in the table, UA must do
+
+static constexpr uint64_t serialFromMac(uint64_t aMac, size_t aIdx = 0)
+{
+  return
+    aIdx>=numSerialOUIs ? (aMac & 0xFFFFFF) | ((uint64_t)unknownOUICode<<24) :
+    serialOUIs[aIdx].oui==(aMac>>24) ? (aMac & 0xFFFFFF) | ((uint64_t)serialOUIs[aIdx].code<<24) :
+    serialFromMac(aMac, aIdx+1);
+}
+
+// @return MAC address, 0 if the serial does not encode a known OUI
+static constexpr uint64_t macFromSerial(uint64_t aSerial, size_t aIdx = 0)
+{
+  return
+    aIdx>=numSerialOUIs ? 0 :
+    serialOUIs[aIdx].code==(aSerial>>24) ? (aSerial & 0xFFFFFF) | ((uint64_t)serialOUIs[aIdx].oui<<24) :
+    macFromSerial(aSerial, aIdx+1);
+}
+
+// every table entry must convert back and forth in both directions
+static constexpr bool serialOUIsConsistent(size_t aIdx = 0)
+{
+  return
+    aIdx>=numSerialOUIs ||
+    (macFromSerial(serialFromMac((uint64_t)serialOUIs[aIdx].oui<<24 | 0xABCDEF))==((uint64_t)serialOUIs[aIdx].oui<<24 | 0xABCDEF) &&
+     serialFromMac(macFromSerial((uint64_t)serialOUIs[aIdx].code<<24 | 0xABCDEF))==((uint64_t)serialOUIs[aIdx].code<<24 | 0xABCDEF) &&
+     serialOUIs[aIdx].code!=unknownOUICode && serialOUIsConsistent(aIdx+1));
+}
+static_assert(serialOUIsConsistent(), "serialOUIs must have unique OUIs and codes");
+
+
+// parse MAC address with or without ':' or '-' separators
+// @return false if not a MAC address
+static bool parseMac(boost::string_view aText, uint64_t &aMac)
+{
+  aMac = 0;
+  int digits = 0;
+  for (size_t i=0; i<aText.size(); i++) {
+    char c = aText[i];
+    if (c==':' || c=='-') {
+      if (digits%2!=0 || digits==0 || !isxdigit((unsigned char)aText[i-1])) return false; // single separators between bytes only
+      continue;
+    }
+    if (!isxdigit((unsigned char)c) || ++digits>12) return false;
+    aMac = (aMac<<4) | (isdigit((unsigned char)c) ? c-'0' : (tolower(c)-'a'+10));
+  }
+  return digits==12 && isxdigit((unsigned char)aText.back());
+}
+
+
+// parse decimal serial number
+// @return false if not a serial number
+static bool parseSerial(boost::string_view aText, uint64_t &aSerial)
+{
+  aSerial = 0;
+  if (aText.empty() || aText.size()>19) return false;
+  for (size_t i=0; i<aText.size(); i++) {
+    if (!isdigit((unsigned char)aText[i])) return false;
+    aSerial = aSerial*10 + (aText[i]-'0');
+  }
+  return true;
+}
+
+
+// append MAC address as XX:XX:XX:XX:XX:XX
+static void appendMac(string &aStr, uint64_t aMac)
+{
+  static const char hexDigits[] = "0123456789ABCDEF";
+  for (int i=0; i<6; ++i) {
+    if (i>0) aStr += ':';
+    unsigned int b = (aMac>>((5-i)*8)) & 0xFF;
+    aStr += hexDigits[b>>4];
+    aStr += hexDigits[b&0xF];
+  }
+}
+
+
+static const CmdLineOptionDescriptor options[] = {
+  #ifdef ADDITIONAL_OPTIONS
+  ADDITIONAL_OPTIONS
+  #endif
+  { 0  , "json",            true,  "jsonquery;process JSON config/maintainance command" },
+  { 0  , "factoryreset",    true,  "mode;factory reset, mode: 1=reset dS settings, 2=reset network settings, 3=reset both" },
+  { 0  , "defs",            false, "output all platform, product and unit defs as shell var assignments" },
+  { 0  , "defsdir",         true,  "dir;directory where to read .defs files and pubkey from, defaults to " DEFAULT_DEFS_PATH },
+  { 0  , "nodefscache",     false, "do not use or update the snapshot of resolved defs from previous runs" },
+  { 0  , "flushcaches",     false, "discard cached getter results, query results and defs snapshot before identifying platform" },
+  { 0  , "server",          true,  "socketpath;run as daemon, serving JSON commands on unix socket (SIGHUP re-identifies platform)" },
+  { 0  , "serverworkers",   true,  "count;max number of requests processed concurrently in server mode" },
+  { 0  , "via",             true,  "socketpath;pass --json command to server on socketpath, falls back to local processing if none" },
+  #if !BUILDENV_DIGIESP
+  { 0  , "ucidir",          true,  "dir;directory of UCI config files to read and modify in-process (empty: use external tools), defaults to '" DEFAULT_UCI_PATH "'" },
+  #endif
+  { 0  , "alertratelimit",  true,  "seconds;min interval between recording occurrences of the same alert" },
+  { 0  , "maxalerts",       true,  "count;max number of pending alerts" },
+  { 0  , "fsync",           true,  "policy;when to fsync flash writes: none, file (default) or full (including directory)" },
+  { 0  , "profile",         true,  "where;record timing of startup and command phases, output as JSON to 'stderr' or into the 'answer' (as \"_profile\")" },
+  { 'i', "deviceinfo",      false, "human readable device info" },
+  { 0  , "serialconvert",   false, "convert serial numbers to MAC addresses and vice versa, reading one per line from stdin" },
+  { 'l', "loglevel",        true,  "level;set max level of log message detail to show on stderr" },
+  { 0  , "deltatstamps",    false, "show timestamp delta between log lines" },
+  { 'V', "version",         false, "show version" },
+  { 'h', "help",            false, "show this text" },
+  { 0, NULL } // list terminator
+};
+
+
+class P44maintd : public CmdLineApp
+{
+  typedef CmdLineApp inherited;
+
+protected:
+
+  // Indicator
+  IndicatorOutputPtr mRedLED;
+  IndicatorOutputPtr mGreenLED;
+
+  // system config
+  string mDefspath;
+  string mUciPath; // UCI config directory, empty if config is accessed via external tools
+  DefsMap mDefs;
+
+  // snapshot of resolved defs
+  typedef struct {
+    string path;
+    int64_t mtime; // in nS, -1 if file does not exist
+    int64_t size;
+    int64_t inode;
+    uint64_t hash; // FNV64 of contents
+  } DefsSource;
+  typedef vector<DefsSource> DefsSourcesVector;
+  string mBootId; // kernel boot id, used to key cached getter results
+  bool mUseDefsSnapshot;
+  string mDefsFileBuffer; // reused for reading all .defs files
+  bool mRecordDefsSources; // set while identification records the files it reads
+  DefsSourcesVector mDefsSources;
+
+  // profiling
+  PhaseProfiler mProfiler;
+  bool mProfileInAnswer; // embed profile into JSON answer rather than writing it to stderr
+  size_t mIdentPhase;
+  size_t mGetterWaitPhase;
+
+  // identification
+  typedef struct GetterRun {
+    bool done;
+    string result; // trimmed output
+    GetterRun() : done(false) {};
+  } GetterRun;
+  typedef map<string, GetterRun> GetterRunsMap; // by getter command
+  GetterRunsMap mGetterRuns;
+  bool mIdentDynamicPlatform;
+  IdentStage mIdentUpTo; // last stage to run
+  size_t mIdentStep; // index of next identification step to apply
+  string mIdentWaitingFor; // getter command the current step is waiting for
+  SimpleCB mIdentDoneCB;
+  bool mUnitLookupDone;
+  uint64_t mUnitMac;
+  uint64_t mUnitSerial; // derived from mUnitMac
+  uint32_t mUnitIPv4;
+
+  // helper processes
+  typedef vector<string> HelperArgs; // argv of a helper, [0] is the program
+  typedef vector<HelperArgs> HelperSequence;
+  typedef struct {
+    ExecCB callback;
+    string output; // collected stdout
+    int outFd; // -1 when output is complete (or not collected)
+    bool exited;
+    int status;
+    bool collectOutput;
+    bool muteStdErr;
+    HelperSequence next; // helpers still to run after this one
+  } HelperRun;
+  typedef map<pid_t, HelperRun> HelperRunsMap; // by pid
+  HelperRunsMap mHelperRuns;
+
+  // server mode
+  string mServerSocketPath;
+  int mServerFd; // listening socket, -1 if not in server mode (or in a worker child process)
+  int mMaxWorkers;
+  int mNumWorkers;
+  bool mAccepting; // set when listening socket is being polled for connections
+  typedef map<pid_t, int> StatusFdMap;
+  StatusFdMap mWorkerStatusFds; // per worker: connection to send the worker's exit status to
+
+  // JSON command registry
+  typedef ErrorPtr (P44maintd::*JSONCmdHandler)(JsonObjectPtr aParams, JsonObjectPtr aCmdObj, JsonObjectPtr &aAnswer);
+  enum {
+    cmd_readonly = 0x01, // command does not change any state
+    cmd_needsIdentification = 0x02, // command needs the defs from full platform identification
+    cmd_async = 0x04, // command delivers its answer itself, possibly later (or never, when replacing the process)
+    cmd_readonlyQuery = 0x08, // command is read-only when called without any parameters besides "cmd"
+    cmd_rawOutput = 0x10, // command outputs something other than a JSON answer (cannot be part of a batch)
+  };
+  typedef struct {
+    const char *name;
+    uint32_t hash; // jsonCmdHash(name)
+    JSONCmdHandler handler;
+    int flags;
+    const DefKey *needsDefs; // with cmd_needsIdentification: defs the command uses (noDefKey terminated), NULL for all
+    int cacheTTL; // seconds to answer the read-only form of the command from the result cache, 0 = never
+  } JSONCmdDesc;
+  vector<JSONCmdDesc> mJSONCmds;
+  vector<int16_t> mJSONCmdSlots; // hash table of mJSONCmds indices, -1 = empty
+  JsonObjectPtr mJSONRequest; // command line JSON request
+
+  // result cache
+  string mResultKey; // set when the answer of the current query is to be cached
+  int mResultTTL;
+  uint32_t mResultGeneration; // of the cache at the time of the lookup
+  bool mResultsChanged; // set when the current request changed something cached queries might report
+
+  // batch processing
+  typedef struct {
+    JsonObjectPtr params;
+    bool readonly;
+    pid_t pid;
+    int fd; // pipe receiving the command's output, -1 if not running
+    string output;
+    JsonObjectPtr answer;
+    size_t phase; // profiler phase
+  } BatchItem;
+  typedef vector<BatchItem> BatchItemsVector;
+  BatchItemsVector mBatch;
+  JsonObjectPtr mBatchCmdObj;
+  size_t mBatchNext; // index of next batch item to start
+  int mBatchRunning; // number of batch items running
+  bool mBatchExclusive; // set while a mutating batch item is running
+
+public:
+
+  P44maintd() :
+    mUseDefsSnapshot(true),
+    mRecordDefsSources(false),
+    mProfileInAnswer(false),
+    mIdentPhase(PhaseProfiler::none),
+    mGetterWaitPhase(PhaseProfiler::none),
+    mIdentDynamicPlatform(false),
+    mIdentUpTo(identStage_full),
+    mIdentStep(0),
+    mUnitLookupDone(false),
+    mUnitMac(0),
+    mUnitSerial(0),
+    mUnitIPv4(0),
+    mServerFd(-1),
+    mMaxWorkers(DEFAULT_SERVER_WORKERS),
+    mNumWorkers(0),
+    mAccepting(false),
+    mResultTTL(0),
+    mResultGeneration(0),
+    mResultsChanged(false),
+    mBatchNext(0),
+    mBatchRunning(0),
+    mBatchExclusive(false)
+  {
+    mDefspath = DEFAULT_DEFS_PATH;
+    mUciPath = DEFAULT_UCI_PATH;
+    // built-in JSON commands
+    mJSONCmdSlots.assign(64, -1);
+    for (const JSONCmdDesc *c = jsonCmds(); c->name; c++) registerJSONCmd(*c);
+    // set dummy LEDs
+    mRedLED = IndicatorOutputPtr (new IndicatorOutput("missing", false));
+    mGreenLED = IndicatorOutputPtr (new IndicatorOutput("missing", false));
+  }
+
+
+  virtual int main(int argc, char **argv)
+  {
+    const char *usageText = "Usage: %1$s [options]\n";
+
+    // parse the command line, exits when syntax errors occur
+    MLMicroSeconds parseStart = MainLoop::now();
+    setCommandDescriptors(usageText, options);
+    if (parseCommandLine(argc, argv)) {
+      const char *profileTo;
+      if (getStringOption("profile", profileTo)) {
+        mProfiler.enable();
+        mProfileInAnswer = strcmp(profileTo, "answer")==0;
+        mProfiler.end(mProfiler.begin("cmdline", "", parseStart));
+      }
+      if (numOptions()<1) {
+        // show usage
+        showUsage();
+        terminateApp(EXIT_SUCCESS);
+      }
+      else {
+        // different defs dir?
+        getStringOption("defsdir", mDefspath);
+        if (mDefspath.size()>0 && mDefspath[mDefspath.size()-1]!='/')
+          mDefspath += '/';
+        // different UCI config dir?
+        #if !BUILDENV_DIGIESP
+        getStringOption("ucidir", mUciPath);
+        if (mUciPath.size()>0 && mUciPath[mUciPath.size()-1]!='/')
+          mUciPath += '/';
+        #endif
+        // flash write durability
+        const char *fsyncPolicy;
+        if (getStringOption("fsync", fsyncPolicy)) {
+          if (strcmp(fsyncPolicy, "none")==0) FlashWriter::writer().setFsyncPolicy(FlashWriter::fsync_none);
+          else if (strcmp(fsyncPolicy, "full")==0) FlashWriter::writer().setFsyncPolicy(FlashWriter::fsync_full);
+          else FlashWriter::writer().setFsyncPolicy(FlashWriter::fsync_file);
+        }
+
+        // log level?
+        int loglevel = DEFAULT_LOGLEVEL;
+        getIntOption("loglevel", loglevel);
+        SETLOGLEVEL(loglevel);
+        SETERRLEVEL(loglevel, false); // all diagnostics go to stderr
+        SETDELTATIME(getOption("deltatstamps"));
+        // defs snapshot
+        mUseDefsSnapshot = !getOption("nodefscache");
+        // forward to a running server?
+        const char *jsonCommand;
+        const char *socketPath;
+        if (getStringOption("via", socketPath) && getStringOption("json", jsonCommand)) {
+          int status;
+          if (forwardToServer(socketPath, jsonCommand, status)) {
+            // server has processed the command, no need to start up
+            return status;
+          }
+          // no server reachable, process locally
+        }
+      }
+    }
+
+    // app now ready to run
+    return run();
+  }
+
+
+  void enableLEDs()
+  {
+    // use platform defs to determine which are the LEDs
+    string io;
+    if (getDef(def_PLATFORM_RED_LED, io)) {
+      mRedLED = IndicatorOutputPtr(new IndicatorOutput(io.c_str(), false));
+    }
+    if (getDef(def_PLATFORM_GREEN_LED, io)) {
+      mGreenLED = IndicatorOutputPtr(new IndicatorOutput(io.c_str(), false));
+    }
+  }
+
+
+  uint64_t serial()
+  {
+    lookupUnitIdentity();
+    return mUnitSerial;
+  }
+
+
+  bool readDefsFrom(string aFileName, DefsMap &aDefs)
+  {
+    bool readAnything = false;
+    size_t ph = mProfiler.begin("readDefsFrom", aFileName);
+    if (&aDefs==&mDefs) recordDefsSource(aFileName);
+    if (readFileAtOnce(aFileName, mDefsFileBuffer)) {
+      readAnything = parseDefs(mDefsFileBuffer, aDefs);
+    }
+    mProfiler.end(ph);
+    return readAnything;
+  }
+
+
+  bool parseDefs(boost::string_view aText, DefsMap &aDefs)
+  {
+    bool readAnything = false;
+    DefsParser parser(aText.data(), aText.size());
+    boost::string_view key, value;
+    while (parser.next(key, value)) {
+      aDefs.set(key, value);
+      readAnything = true;
+    }
+    return readAnything;
+  }
+
+
+  template<typename KeyType> bool readDefFromFirstLine(const string aFileName, KeyType aKey)
+  {
+    string value;
+    recordDefsSource(aFileName);
+    if (string_fgetfirstline(aFileName, value)) {
+      mDefs.set(aKey, value);
+      return true;
+    }
+    return false;
+  }
+
+
+  // Note: def access functions take a DefKey for well-known defs, or any string (view) as key
+
+  template<typename KeyType> bool getDef(KeyType aKey, string &aDef, const char *aDefault=NULL, DefsMap *aDefsP = NULL)
+  {
+    DefsMap &myDefs = aDefsP ? *aDefsP : mDefs;
+    boost::string_view v;
+    if (myDefs.get(aKey, v)) {
+      aDef.assign(v.data(), v.size());
+      return true;
+    }
+    if (aDefault) {
+      aDef = aDefault;
+    }
+    return false;
+  }
+
+
+  template<typename KeyType> string getDef(KeyType aKey, DefsMap *aDefsP = NULL)
+  {
+    string res;
+    getDef(aKey, res, NULL, aDefsP);
+    return res;
+  }
+
+
+  template<typename KeyType> void setDef(KeyType aKey, boost::string_view aValue)
+  {
+    mDefs.set(aKey, aValue);
+  }
+
+
+  // set value if not already defined
+  template<typename KeyType> bool setDefDefault(KeyType aKey, boost::string_view aValue)
+  {
+    if (mDefs.has(aKey)) return false;
+    mDefs.set(aKey, aValue);
+    return true;
+  }
+
+
+
+  // "ok", "T", "t", "Y", "y", "1" are all considered true, everything else means false
+  template<typename KeyType> bool isDefTrue(KeyType aKey)
+  {
+    boost::string_view def;
+    if (mDefs.get(aKey, def)) {
+      if (def.size()>0 && (def=="1" || def=="ok" || tolower(def[0])=='t' || tolower(def[0])=='y')) {
+        return true;
+      }
+    }
+    return false;
+  }
+
+
+
+
+
+  // MARK: ===== identification of the device
+
+  virtual bool setDefDefaults()
+  {
+    // in all cases: current time
+    setDef(def_STATUS_TIME, string_ftime("%Y-%m-%d %H:%M:%S"));
+    #if BUILDENV_XCODE
+    // pseudo-platform has fixed defs, without loading anything
+    // - platform
+    setDef(def_PLATFORM_IDENTIFIER, "xcode_dummy");
+    setDef(def_PLATFORM_NAME, "MacOSX");
+    // - product
+    setDef(def_PRODUCT_IDENTIFIER, "p44-xx-mac-xcode");
+    setDef(def_PRODUCT_MODEL, "P44-XX-MAC");
+    setDef(def_PRODUCT_VARIANT, "Apple");
+    setDef(def_PRODUCT_HOSTPREFIX, "p44_xx_mac");
+    // - firmware
+    setDef(def_FIRMWARE_VERSION, "0.0.0.42");
+    setDef(def_FIRMWARE_FEED, "opensource");
+    // - status
+    setDef(def_STATUS_USER_LEVEL, "0");
+    // skip dynamic platform stuff for XCode builds
+    return false;
+    #elif BUILDENV_GENERIC
+    // pseudo-platform has fixed defs, without loading anything
+    // - platform
+    setDef(def_PLATFORM_IDENTIFIER, "generic_dummy");
+    setDef(def_PLATFORM_NAME, "Linux");
+    setDef(def_PLATFORM_SERIALDEV, "/dev/null");
+    setDef(def_PLATFORM_DALIDEV, "/dev/null");
+    // - product
+    setDef(def_PRODUCT_IDENTIFIER, "p44-xx-linux-generic");
+    setDef(def_PRODUCT_MODEL, "P44-XX-LINUX");
+    setDef(def_PRODUCT_VARIANT, "Debian");
+    setDef(def_PRODUCT_HOSTPREFIX, "p44_xx_linux");
+    setDef(def_PRODUCT_HAS_TINKER, "1");
+    setDef(def_PRODUCT_RESTART_TIME, "5");
+    // - producer
+    setDef(def_PRODUCER, "plan44");
+    // - firmware
+    setDef(def_FIRMWARE_VERSION, "0.0.0.42");
+    setDef(def_FIRMWARE_FEED, "devel");
+    // - status
+    setDef(def_STATUS_USER_LEVEL, "0");
+    // skip dynamic platform stuff for Generic Linux builds
+    return false;
+    #else
+    // determine platform dynamically
+    return true;
+    #endif
+  }
+
+
+  // Identification steps are applied to mDefs strictly in the order of this table, because
+  // later steps override earlier ones. Some steps need the output of a getter, which is a shell command
+  // specified in a def. Every getter is started as soon as its command is known, so getters run in
+  // parallel to each other and to the steps not depending on them (such as the unit's network lookups).
+  // When a step is applied, its getter's result is only used if the getter command def has not
+  // changed in between, so the resulting defs are the same as with strictly sequential processing.
+
+  typedef void (P44maintd::*IdentStepFn)(bool aHasGetter, const string &aGetterResult);
+  typedef struct {
+    DefKey getterDef; // def containing the getter command the step needs, noDefKey if none
+    bool platformOnly; // step only needed when platform is determined dynamically
+    IdentStage stage; // stage the step belongs to
+    IdentStepFn apply;
+  } IdentStep;
+
+  static const IdentStep *identSteps()
+  {
+    static const IdentStep steps[] = {
+      { noDefKey, true, identStage_platform, &P44maintd::identPlatformDefs },
+      { def_PLATFORM_IDENTIFIER_GETTER, true, identStage_platform, &P44maintd::identPlatformId },
+      { noDefKey, true, identStage_platform, &P44maintd::identPlatformSpecifics },
+      { def_PLATFORM_PRODUCT_IDENTIFIER_GETTER, true, identStage_defs, &P44maintd::identProductId },
+      { noDefKey, false, identStage_defs, &P44maintd::identProductSpecifics },
+      { def_PRODUCER_GETTER, false, identStage_defs, &P44maintd::identProducer },
+      { noDefKey, false, identStage_defs, &P44maintd::identFirmwareAndUserLevel },
+      { def_PLATFORM_VARIANT_GETTER, false, identStage_defs, &P44maintd::identVariant },
+      { noDefKey, false, identStage_defs, &P44maintd::identVariantSpecifics },
+      { noDefKey, false, identStage_full, &P44maintd::identUnit },
+      { noDefKey, false, identStage_none, NULL } // terminator
+    };
+    return steps;
+  }
+
+
+  // add dynamically obtainable platform identification info
+  virtual void identifyDynamically(SimpleCB aCallback)
+  {
+    identifyUpTo(aCallback, identStage_full);
+  }
+
+
+  // partial identification, only running the identification steps needed to get the defs of stage aUpTo
+  // @note for identStage_full, use identifyDynamically(), which derived classes might extend
+  void identifyUpTo(SimpleCB aCallback, IdentStage aUpTo)
+  {
+    // build defs
+    mDefs.clear();
+    mIdentPhase = mProfiler.begin("identification");
+    // use snapshot from previous identification if none of its sources has changed
+    size_t ph = mProfiler.begin("loadDefsSnapshot");
+    bool snapshotLoaded = aUpTo>=identStage_platform && mUseDefsSnapshot && loadDefsSnapshot();
+    mProfiler.end(ph);
+    if (snapshotLoaded) {
+      refreshVolatileDefs();
+      setDerivedDefs();
+      mProfiler.end(mIdentPhase);
+      aCallback();
+      return;
+    }
+    mDefsSources.clear();
+    mRecordDefsSources = mUseDefsSnapshot && aUpTo==identStage_full; // snapshot must be complete
+    // set defaults, determine if platform must be identified dynamically
+    mIdentDynamicPlatform = setDefDefaults();
+    // run the steps
+    LOG(LOG_INFO, "identifying platform up to stage %d", aUpTo);
+    mIdentUpTo = aUpTo;
+    mIdentDoneCB = aCallback;
+    mIdentStep = 0;
+    mIdentWaitingFor.clear();
+    mGetterRuns.clear();
+    mUnitLookupDone = false; // IPv4 might have changed since last identification
+    continueIdentification();
+  }
+
+
+  void continueIdentification()
+  {
+    const IdentStep *steps = identSteps();
+    while (steps[mIdentStep].apply && steps[mIdentStep].stage<=mIdentUpTo) {
+      const IdentStep &step = steps[mIdentStep];
+      if (!step.platformOnly || mIdentDynamicPlatform) {
+        string cmd;
+        if (step.getterDef!=noDefKey && getDef(step.getterDef, cmd)) {
+          GetterRun &run = startGetter(cmd);
+          if (!run.done) {
+            // must wait for getter, meanwhile do the lookups that do not depend on defs at all
+            mIdentWaitingFor = cmd;
+            mGetterWaitPhase = mProfiler.begin("waitForGetter", cmd);
+            if (mIdentUpTo==identStage_full) lookupUnitIdentity();
+            return;
+          }
+          (this->*step.apply)(true, run.result);
+        }
+        else {
+          (this->*step.apply)(false, "");
+        }
+        // getters of later steps might be known now
+        startKnownGetters();
+      }
+      mIdentStep++;
+    }
+    // all steps done
+    if (mIdentUpTo<identStage_full) {
+      // identUnit did not set the IPv4 status
+      refreshVolatileDefs();
+    }
+    setDerivedDefs();
+    mProfiler.end(mIdentPhase);
+    SimpleCB cb = mIdentDoneCB;
+    mIdentDoneCB = NULL;
+    if (cb) cb();
+  }
+
+
+  GetterRun &startGetter(const string &aCmd)
+  {
+    GetterRunsMap::iterator pos = mGetterRuns.find(aCmd);
+    if (pos==mGetterRuns.end()) {
+      pos = mGetterRuns.insert(make_pair(aCmd, GetterRun())).first;
+      // Note: when result is cached, identGetterDone is called right away
+      runGetter(aCmd, boost::bind(&P44maintd::identGetterDone, this, aCmd, _1, _2));
+    }
+    return pos->second;
+  }
+
+
+  void startKnownGetters()
+  {
+    const IdentStep *steps = identSteps();
+    string cmd;
+    for (size_t i = mIdentStep+1; steps[i].apply && steps[i].stage<=mIdentUpTo; i++) {
+      if (steps[i].getterDef!=noDefKey && getDef(steps[i].getterDef, cmd)) {
+        startGetter(cmd);
+      }
+    }
+  }
+
+
+  void identGetterDone(string aCmd, ErrorPtr aErr, const string &aAnswer)
+  {
+    GetterRun &run = mGetterRuns[aCmd];
+    run.done = true;
+    run.result = trimWhiteSpace(aAnswer);
+    if (!mIdentWaitingFor.empty() && aCmd==mIdentWaitingFor) {
+      mIdentWaitingFor.clear();
+      mProfiler.end(mGetterWaitPhase);
+      continueIdentification();
+    }
+  }
+
+
+  void identPlatformDefs(bool aHasGetter, const string &aGetterResult)
+  {
+    // read defs files to determine platform
+    // - platform, possibly is a softlink
+    // - this might be a generic head definition file in a FW that supports multiple platforms.
+    //   Either it contains a PLATFORM_IDENTIFIER, or it might also contain a PLATFORM_IDENTIFIER_GETTER
+    //   (which can also override a default PLATFORM_IDENTIFIER already present at this point)
+    readDefsFrom(mDefspath+"p44platform.defs", mDefs);
+  }
+
+
+  void identPlatformId(bool aHasGetter, const string &aGetterResult)
+  {
+    if (aHasGetter && aGetterResult.size()>0) {
+      setDef(def_PLATFORM_IDENTIFIER, aGetterResult);
+    }
+  }
+
+
+  void identPlatformSpecifics(bool aHasGetter, const string &aGetterResult)
+  {
+    string def;
+
+    // - additional platform definitions that may be included in the common firmware for multiple platforms
+    if (getDef(def_PLATFORM_IDENTIFIER, def)) {
+      readDefsFrom(mDefspath+"p44platform-" + def + ".defs", mDefs);
+    }
+    // - set/override runtime detected computing module (Note: usually available only after p44 init script has run)
+    readDefFromFirstLine(COMPUTING_MODULE_FILE, def_PLATFORM_COMPUTINGMODULE);
+  }
+
+
+  void identProductId(bool aHasGetter, const string &aGetterResult)
+  {
+    // dynamic product ID getter
+    //  such as: "/sbin/ubootenv --print 'p44productid' | sed -r -n -e '/^p44productid=/s/p44productid=//p'"
+    if (aHasGetter && aGetterResult.size()>0) {
+      setDef(def_PRODUCT_IDENTIFIER, aGetterResult);
+    }
+  }
+
+
+  void identProductSpecifics(bool aHasGetter, const string &aGetterResult)
+  {
+    string def;
+
+    // - product, possibly is a softlink
+    readDefsFrom(mDefspath+"p44product.defs", mDefs);
     // - if neither PLATFORM_PRODUCT_IDENTIFIER_GETTER nor p44product.defs did  deliver a product identifier, try to load default
-    if (!getDef("PRODUCT_IDENTIFIER", def)) {
-      if (getDef("PLATFORM_IDENTIFIER", def)) {
+    if (!getDef(def_PRODUCT_IDENTIFIER, def)) {
+      if (getDef(def_PLATFORM_IDENTIFIER, def)) {
         // platform specific
         readDefsFrom(mDefspath+"p44product-default_" + def + ".defs", mDefs);
       }
     }
-    if (!getDef("PRODUCT_IDENTIFIER", def)) {
-      // still none - try generic defaults
-      readDefsFrom(mDefspath+"p44product-default.defs", mDefs);
+    if (!getDef(def_PRODUCT_IDENTIFIER, def)) {
+      // still none - try generic defaults
+      readDefsFrom(mDefspath+"p44product-default.defs", mDefs);
+    }
+    // - additional product definitions that may included in the common firmware for multiple products
+    if (getDef(def_PRODUCT_IDENTIFIER, def)) {
+      readDefsFrom(mDefspath+"p44product-" + def + ".defs", mDefs);
+    }
+  }
+
+
+  void identProducer(bool aHasGetter, const string &aGetterResult)
+  {
+    // dynamic producer
+    //  such as: "fw_printenv p44producer | sed -r -n -e '/^p44producer=/s/.*=//p'"
+    if (aHasGetter) {
+      if (aGetterResult.size()>0) {
+        setDef(def_PRODUCER, aGetterResult);
+      }
+    }
+    else {
+      // assume static producer
+      // - check separate file first
+      readDefFromFirstLine(mDefspath+"p44producer", def_PRODUCER);
+    }
+  }
+
+
+  void identFirmwareAndUserLevel(bool aHasGetter, const string &aGetterResult)
+  {
+    // - make sure we have at least a "unknown" producer
+    setDefDefault(def_PRODUCER, "unknown");
+    // - feed
+    readDefFromFirstLine(mDefspath+"p44feed", def_FIRMWARE_FEED);
+    // - version
+    readDefFromFirstLine(mDefspath+"p44version", def_FIRMWARE_VERSION);
+    // - user level
+    setUserLevelDef();
+  }
+
+
+  void identVariant(bool aHasGetter, const string &aGetterResult)
+  {
+    // dynamic variant getter
+    //  such as: "/sbin/ubootenv --print 'p44variant' | sed -r -n -e '/^p44variant=/s/p44variant=//p'"
+    //  or: "cat /boot/p44variant"
+    if (aHasGetter) {
+      if (aGetterResult.size()>0) {
+        setDef(def_PRODUCT_VARIANT, aGetterResult);
+      }
+      else {
+        // assume variant 0 if not set
+        setDef(def_PRODUCT_VARIANT, "0"); // e.g. DEH v3
+      }
+    }
+  }
+
+
+  void identVariantSpecifics(bool aHasGetter, const string &aGetterResult)
+  {
+    string def;
+
+    // try to load product variant specific settings
+    if (getDef(def_PRODUCT_VARIANT, def)) {
+      readDefsFrom(mDefspath+"p44variant-" + getDef(def_PRODUCT_IDENTIFIER) + "-" + def + ".defs", mDefs);
+    }
+    // overrides from individual configuration
+    readDefsFrom(FLASH_PATH "/p44custom.defs", mDefs);
+  }
+
+
+  // network lookups for unit identity, independent of any defs
+  void lookupUnitIdentity()
+  {
+    if (mUnitLookupDone) return;
+    size_t ph = mProfiler.begin("unitLookups");
+    mUnitMac = macAddress();
+    mUnitSerial = serialFromMac(mUnitMac);
+    mUnitIPv4 = ipv4Address();
+    mUnitLookupDone = true;
+    mProfiler.end(ph);
+  }
+
+
+  void identUnit(bool aHasGetter, const string &aGetterResult)
+  {
+    string def;
+
+    lookupUnitIdentity();
+    // get unit variables
+    // - serial
+    setDef(def_UNIT_SERIALNO, string_format("%lld", mUnitSerial));
+    // - MAC address
+    string macStr;
+    setDef(def_UNIT_MAC_DECIMAL, string_format("%lld", mUnitMac));
+    appendMac(macStr, mUnitMac);
+    setDef(def_UNIT_MACADDRESS, macStr);
+    // - IPv4
+    setIPv4Def(mUnitIPv4);
+    // - host name
+    getDef(def_PRODUCT_HOSTPREFIX, def, "unknown");
+    setDef(def_UNIT_HOSTNAME, string_format("%s_%lld",def.c_str(), mUnitSerial));
+    // save for next time, unless a getter had no output (snapshot would keep that for the entire boot)
+    if (mRecordDefsSources) {
+      mRecordDefsSources = false;
+      bool emptyGetter = false;
+      for (GetterRunsMap::const_iterator pos = mGetterRuns.begin(); pos!=mGetterRuns.end(); ++pos) {
+        if (pos->second.done && pos->second.result.empty()) emptyGetter = true;
+      }
+      if (!emptyGetter) saveDefsSnapshot();
+    }
+  }
+
+
+  void setUserLevelDef()
+  {
+    string def;
+    if (!readDefFromFirstLine("/tmp/p44userlevel", def_STATUS_USER_LEVEL)) {
+      if (!readDefFromFirstLine(FLASH_PATH "p44userlevel", def_STATUS_USER_LEVEL)) {
+        if (getDef(def_PRODUCT_DEFAULT_USER_LEVEL, def)) {
+          // use product specific default user level
+          setDef(def_STATUS_USER_LEVEL, def);
+        }
+        else {
+          // production default is 0, testing/beta/development default is 1
+          setDef(def_STATUS_USER_LEVEL, getDef(def_FIRMWARE_FEED)=="prod" ? "0" : "1");
+        }
+      }
+    }
+  }
+
+
+  static string dottedIPv4(uint32_t ipv4)
+  {
+    return string_format("%d.%d.%d.%d", (ipv4>>24) & 0xFF, (ipv4>>16) & 0xFF, (ipv4>>8) & 0xFF, ipv4 & 0xFF);
+  }
+
+
+  void setIPv4Def(uint32_t ipv4)
+  {
+    setDef(def_STATUS_IPV4, dottedIPv4(ipv4));
+  }
+
+
+  // update the defs that may change while identification is kept (snapshot, server mode)
+  virtual void refreshVolatileDefs()
+  {
+    setDef(def_STATUS_TIME, string_ftime("%Y-%m-%d %H:%M:%S"));
+    setIPv4Def(ipv4Address());
+  }
+
+
+  // defs that are not saved in the snapshot, but recalculated by refreshVolatileDefs()
+  virtual bool isVolatileDef(boost::string_view aKey)
+  {
+    return aKey=="STATUS_TIME" || aKey=="STATUS_IPV4";
+  }
+
+
+  virtual void setDerivedDefs()
+  {
+    // - copyright range
+    struct timeval t;
+    gettimeofday(&t, NULL);
+    struct tm *tim = localtime(&t.tv_sec);
+    setDefDefault(def_PRODUCT_COPYRIGHT_YEARS, string_format("2013-%04d", tim->tm_year+1900));
+    // - copyright holder
+    setDefDefault(def_PRODUCT_COPYRIGHT_HOLDER, "plan44.ch");
+  }
+
+  // MARK: ===== helper processes
+
+  // Helpers are started with posix_spawn (vfork semantics), and without a shell unless a command line needs one.
+
+  // run a helper program
+  // @param aCallback gets the exit status (as ExecError) and, if aCollectOutput, the helper's stdout
+  //   (otherwise stdout is inherited)
+  void runHelper(ExecCB aCallback, const HelperArgs &aArgs, bool aCollectOutput = true, bool aMuteStdErr = true)
+  {
+    runHelpers(aCallback, HelperSequence(1, aArgs), aCollectOutput, aMuteStdErr);
+  }
+
+
+  // run a shell command line (only for command lines that are configured or need shell features)
+  void runShell(ExecCB aCallback, const string &aCommandLine, bool aCollectOutput = true, bool aMuteStdErr = true)
+  {
+    HelperArgs args;
+    args.push_back("/bin/sh");
+    args.push_back("-c");
+    args.push_back(aCommandLine);
+    runHelper(aCallback, args, aCollectOutput, aMuteStdErr);
+  }
+
+
+  // run helpers one after the other, like a shell command list separated by ';'
+  // @note aCallback gets the output of all helpers, and the exit status of the last one
+  void runHelpers(ExecCB aCallback, const HelperSequence &aSequence, bool aCollectOutput = true, bool aMuteStdErr = true, const string &aOutputSoFar = "")
+  {
+    if (aSequence.empty()) {
+      aCallback(ErrorPtr(), aOutputSoFar);
+      return;
+    }
+    const HelperArgs &args = aSequence.front();
+    vector<const char *> argv;
+    for (HelperArgs::const_iterator pos = args.begin(); pos!=args.end(); ++pos) argv.push_back(pos->c_str());
+    argv.push_back(NULL);
+    int p[2] = { -1, -1 };
+    if (aCollectOutput && cloexecPipe(p)<0) {
+      aCallback(SysError::errNo("cannot create helper pipe: "), aOutputSoFar);
+      return;
+    }
+    pid_t pid;
+    int ret = spawnProcess(pid, &argv[0], -1, p[1], aMuteStdErr);
+    if (p[1]>=0) close(p[1]);
+    if (ret!=0) {
+      if (p[0]>=0) close(p[0]);
+      LOG(LOG_ERR, "cannot start helper '%s': %s", args[0].c_str(), strerror(ret));
+      if (aSequence.size()>1) {
+        // like a shell, go on with the next command
+        runHelpers(aCallback, HelperSequence(aSequence.begin()+1, aSequence.end()), aCollectOutput, aMuteStdErr, aOutputSoFar);
+        return;
+      }
+      aCallback(SysError::err(ret, "cannot start helper: "), aOutputSoFar);
+      return;
+    }
+    if (LOGENABLED(LOG_DEBUG)) {
+      string cmd;
+      for (HelperArgs::const_iterator pos = args.begin(); pos!=args.end(); ++pos) cmd += " " + shellQuote(*pos);
+      LOG(LOG_DEBUG, "started helper pid %d:%s", pid, cmd.c_str());
+    }
+    HelperRun &run = mHelperRuns[pid];
+    run.callback = aCallback;
+    run.output = aOutputSoFar;
+    run.outFd = p[0];
+    run.exited = false;
+    run.status = 0;
+    run.collectOutput = aCollectOutput;
+    run.muteStdErr = aMuteStdErr;
+    run.next.assign(aSequence.begin()+1, aSequence.end());
+    if (run.outFd>=0) {
+      MainLoop::currentMainLoop().registerPollHandler(run.outFd, POLLIN, boost::bind(&P44maintd::helperOutput, this, pid, _1, _2));
+    }
+    MainLoop::currentMainLoop().waitForPid(boost::bind(&P44maintd::helperExited, this, _1, _2), pid);
+  }
+
+
+  bool helperOutput(pid_t aPid, int aFd, int aPollFlags)
+  {
+    HelperRunsMap::iterator pos = mHelperRuns.find(aPid);
+    if (pos==mHelperRuns.end()) return false;
+    char buf[1024];
+    ssize_t n = read(aFd, buf, sizeof(buf));
+    if (n>0) {
+      pos->second.output.append(buf, n);
+      return true;
+    }
+    if (n<0 && (errno==EINTR || errno==EAGAIN)) return true;
+    // EOF or error: output is complete
+    MainLoop::currentMainLoop().unregisterPollHandler(aFd);
+    close(aFd);
+    pos->second.outFd = -1;
+    helperCheckDone(aPid);
+    return true;
+  }
+
+
+  void helperExited(pid_t aPid, int aStatus)
+  {
+    HelperRunsMap::iterator pos = mHelperRuns.find(aPid);
+    if (pos==mHelperRuns.end()) return;
+    pos->second.exited = true;
+    pos->second.status = aStatus;
+    helperCheckDone(aPid);
+  }
+
+
+  void helperCheckDone(pid_t aPid)
+  {
+    HelperRunsMap::iterator pos = mHelperRuns.find(aPid);
+    if (pos==mHelperRuns.end() || !pos->second.exited || pos->second.outFd>=0) return;
+    HelperRun run = pos->second;
+    mHelperRuns.erase(pos);
+    if (!run.next.empty()) {
+      runHelpers(run.callback, run.next, run.collectOutput, run.muteStdErr, run.output);
+      return;
+    }
+    run.callback(ExecError::exitStatus(WIFEXITED(run.status) ? WEXITSTATUS(run.status) : -1), run.output);
+  }
+
+
+  // MARK: ===== cached getter results
+
+  // Getters (PLATFORM_IDENTIFIER_GETTER etc.) query the boot loader environment and similar things
+  // that cannot change without a reboot. So their (trimmed) output is cached per getter command and boot.
+  // Empty output is not cached, as it usually means the source was not ready yet (e.g. early at boot).
+
+  const string &bootId()
+  {
+    if (mBootId.empty()) {
+      string_fgetfirstline(BOOT_ID_FILE, mBootId);
+    }
+    return mBootId;
+  }
+
+
+  string getterCachePath(const string &aGetterCmd)
+  {
+    Fnv32 h;
+    h.addString(aGetterCmd);
+    return string_format(CACHE_DIR GETTER_CACHE_PREFIX "%08X", h.getHash());
+  }
+
+
+  void runGetter(const string &aGetterCmd, ExecCB aCallback)
+  {
+    if (!bootId().empty()) {
+      // cache contains boot id and getter command as header lines, followed by the result
+      string cached;
+      string hdr = bootId() + "\n" + aGetterCmd + "\n";
+      if (readOwnFile(getterCachePath(aGetterCmd), cached) && cached.size()>hdr.size() && cached.compare(0, hdr.size(), hdr)==0) {
+        LOG(LOG_INFO, "using cached result for getter: %s", aGetterCmd.c_str());
+        mProfiler.end(mProfiler.begin("getterCached", aGetterCmd));
+        aCallback(ErrorPtr(), cached.substr(hdr.size()));
+        return;
+      }
+    }
+    size_t ph = mProfiler.begin("getter", aGetterCmd); // from spawn to exit
+    runShell(boost::bind(&P44maintd::getterDone, this, aGetterCmd, aCallback, ph, _1, _2), aGetterCmd);
+  }
+
+
+  void getterDone(string aGetterCmd, ExecCB aCallback, size_t aPhase, ErrorPtr aErr, const string &aAnswer)
+  {
+    mProfiler.end(aPhase);
+    string v = trimWhiteSpace(aAnswer);
+    if (Error::isOK(aErr) && !v.empty() && !bootId().empty()) {
+      ErrorPtr err = writeFileAtomically(getterCachePath(aGetterCmd), bootId() + "\n" + aGetterCmd + "\n" + v);
+      if (Error::notOK(err)) {
+        LOG(LOG_WARNING, "cannot cache getter result: %s", err->description().c_str());
+      }
+    }
+    aCallback(aErr, v);
+  }
+
+
+  // remove cached getter results, query results and defs snapshot
+  void flushCaches()
+  {
+    DIR *dir = opendir(CACHE_DIR);
+    if (!dir) return;
+    struct dirent *ent;
+    while ((ent = readdir(dir))!=NULL) {
+      if (strncmp(ent->d_name, CACHE_FILE_PREFIX, strlen(CACHE_FILE_PREFIX))==0) {
+        unlink((string(CACHE_DIR) + ent->d_name).c_str());
+      }
+    }
+    closedir(dir);
+    LOG(LOG_NOTICE, "caches flushed");
+  }
+
+
+  // MARK: ===== snapshot of resolved defs
+
+  // The fully resolved defs are saved into a snapshot file in /tmp, together with fingerprints of all files
+  // read during identification (including those that did not exist). As long as none of these has changed,
+  // the next identification just loads the snapshot.
+
+  static void statDefsSource(DefsSource &aSource)
+  {
+    struct stat st;
+    if (stat(aSource.path.c_str(), &st)<0) {
+      aSource.mtime = -1;
+      aSource.size = 0;
+      aSource.inode = 0;
+      return;
+    }
+    #if BUILDENV_XCODE
+    aSource.mtime = (int64_t)st.st_mtimespec.tv_sec*1000000000+st.st_mtimespec.tv_nsec;
+    #else
+    aSource.mtime = (int64_t)st.st_mtim.tv_sec*1000000000+st.st_mtim.tv_nsec;
+    #endif
+    aSource.size = st.st_size;
+    aSource.inode = st.st_ino;
+  }
+
+
+  static uint64_t fileHash(const string aPath)
+  {
+    string data;
+    Fnv64 h;
+    if (Error::isOK(string_fromfile(aPath, data))) h.addString(data);
+    return h.getHash();
+  }
+
+
+  void recordDefsSource(const string aPath)
+  {
+    if (!mRecordDefsSources) return;
+    DefsSource src;
+    src.path = aPath;
+    statDefsSource(src);
+    src.hash = src.mtime<0 ? 0 : fileHash(aPath);
+    mDefsSources.push_back(src);
+  }
+
+
+  string defsSnapshotPath()
+  {
+    Fnv32 h;
+    h.addString(mDefspath);
+    return string_format(CACHE_DIR DEFS_SNAPSHOT_PREFIX "%08X", h.getHash());
+  }
+
+
+  static bool nextNumField(const char *&aCursor, const char *aEnd, int64_t &aNum)
+  {
+    string f;
+    if (!nextField(aCursor, aEnd, f)) return false;
+    aNum = strtoll(f.c_str(), NULL, 10);
+    return true;
+  }
+
+
+  void saveDefsSnapshot()
+  {
+    string data;
+    // getter results are part of the defs, so snapshot is only valid for this boot
+    appendField(data, bootId());
+    appendField(data, string_format("%zu", mDefsSources.size()));
+    for (DefsSourcesVector::iterator pos = mDefsSources.begin(); pos!=mDefsSources.end(); ++pos) {
+      appendField(data, pos->path);
+      appendField(data, string_format("%lld", (long long)pos->mtime));
+      appendField(data, string_format("%lld", (long long)pos->size));
+      appendField(data, string_format("%lld", (long long)pos->inode));
+      appendField(data, string_format("%016llX", (unsigned long long)pos->hash));
+    }
+    for (DefsMap::Iterator i(mDefs); i.valid(); i.next()) {
+      if (isVolatileDef(i.key())) continue;
+      appendField(data, i.key());
+      appendField(data, i.value());
+    }
+    Fnv32 h;
+    h.addString(data);
+    ErrorPtr err = writeFileAtomically(defsSnapshotPath(), string_format(DEFS_SNAPSHOT_MAGIC "%08X\n", h.getHash()) + data);
+    if (Error::notOK(err)) {
+      LOG(LOG_WARNING, "cannot save defs snapshot: %s", err->description().c_str());
+    }
+  }
+
+
+  bool loadDefsSnapshot()
+  {
+    // read entire snapshot at once
+    string data;
+    if (!readOwnFile(defsSnapshotPath(), data)) return false;
+    // check integrity
+    const size_t hdrsz = strlen(DEFS_SNAPSHOT_MAGIC)+9;
+    if (data.size()<hdrsz || data.compare(0, strlen(DEFS_SNAPSHOT_MAGIC), DEFS_SNAPSHOT_MAGIC)!=0) return false;
+    Fnv32 h;
+    h.addBytes(data.size()-hdrsz, (const uint8_t *)data.c_str()+hdrsz);
+    if (strtoul(data.c_str()+strlen(DEFS_SNAPSHOT_MAGIC), NULL, 16)!=h.getHash()) {
+      LOG(LOG_WARNING, "defs snapshot is corrupted");
+      return false;
+    }
+    const char *p = data.c_str()+hdrsz;
+    const char *e = data.c_str()+data.size();
+    // check sources
+    int64_t n;
+    string hash;
+    bool touched = false;
+    mDefsSources.clear();
+    if (!nextField(p, e, hash) || hash!=bootId()) return false; // from previous boot
+    if (!nextNumField(p, e, n)) return false;
+    while (n-->0) {
+      DefsSource src, cur;
+      if (
+        !nextField(p, e, src.path) ||
+        !nextNumField(p, e, src.mtime) ||
+        !nextNumField(p, e, src.size) ||
+        !nextNumField(p, e, src.inode) ||
+        !nextField(p, e, hash)
+      ) return false;
+      src.hash = strtoull(hash.c_str(), NULL, 16);
+      cur.path = src.path;
+      statDefsSource(cur);
+      cur.hash = src.hash;
+      if (!(cur.mtime==src.mtime && cur.size==src.size && cur.inode==src.inode)) {
+        if (cur.mtime>=0 && src.mtime>=0 && cur.size==src.size && fileHash(cur.path)==src.hash) {
+          // touched, but same contents
+          touched = true;
+        }
+        else {
+          LOG(LOG_INFO, "defs source '%s' has changed, snapshot is stale", src.path.c_str());
+          return false;
+        }
+      }
+      mDefsSources.push_back(cur);
+    }
+    // all sources unchanged: use defs
+    string key, value;
+    while (p<e) {
+      if (!nextField(p, e, key) || !nextField(p, e, value)) {
+        mDefs.clear();
+        return false;
+      }
+      mDefs.set(key, value);
+    }
+    LOG(LOG_INFO, "defs loaded from snapshot");
+    // update fingerprints of touched files to avoid hashing them again next time
+    if (touched) saveDefsSnapshot();
+    return true;
+  }
+
+
+  int userlevel()
+  {
+    string def;
+    int userlevel = 0;
+    if (getDef(def_STATUS_USER_LEVEL, def)) {
+      sscanf(def.c_str(), "%d", &userlevel);
+    }
+    return userlevel;
+  }
+
+
+  // MARK: ===== command line actions
+
+  virtual void initialize()
+  {
+    if (getOption("serialconvert")) {
+      // bulk conversion, does not need any identification
+      serialConvertLines();
+      return;
+    }
+    if (getOption("flushcaches")) {
+      // make sure identification is done from scratch
+      flushCaches();
+    }
+    IdentStage stage = identStage_full;
+    const char *jsonCommand;
+    if (!getOption("server") && !getOption("flushcaches") && getStringOption("json", jsonCommand)) {
+      LOG(LOG_DEBUG, "Received command line JSON call: '%s'", jsonCommand);
+      mJSONRequest = JsonObject::objFromText(jsonCommand);
+      if (mJSONRequest && answerFromCache(requestParams(mJSONRequest))) {
+        // polled query, answered without identification
+        return;
+      }
+      // only identify as far as needed for the defs the command(s) use
+      stage = requestIdentStage(mJSONRequest);
+      if (stage==identStage_none) {
+        // command does not need any defs, skip identification
+        platformCommands();
+        return;
+      }
+    }
+    // need platform identification first
+    if (stage==identStage_full) {
+      identifyDynamically(boost::bind(&P44maintd::platformCommands, this));
+    }
+    else {
+      identifyUpTo(boost::bind(&P44maintd::platformCommands, this), stage);
+    }
+  }
+
+
+  // check commands that need full platform identification before being run
+  virtual void platformCommands()
+  {
+    // check operation to perform
+    const char *jsonCommand;
+    int intOpt;
+    if (getStringOption("server", mServerSocketPath)) {
+      // run as persistent server
+      getIntOption("serverworkers", mMaxWorkers);
+      startServer();
+    }
+    else if (getStringOption("json", jsonCommand)) {
+      // process JSON command line call
+      processJSONRequest(mJSONRequest);
+    }
+    else if (getOption("deviceinfo")) {
+      // show device info
+      showDeviceInfo();
+    }
+    else if (getOption("defs")) {
+      // show device info
+      showDefs();
+    }
+    else if (getIntOption("factoryreset", intOpt)) {
+      // factory reset
+      factoryReset(intOpt);
+    }
+    else if (getOption("flushcaches")) {
+      // caches were flushed and are now rebuilt by identification
+      terminateApp(EXIT_SUCCESS);
+    }
+    else {
+      // no operation
+      terminateApp(EXIT_FAILURE);
+    }
+  }
+
+
+  // MARK: ===== server mode
+
+  // In server mode, platform identification is done once. Every connection is then handled by a forked
+  // worker process that inherits the identification, reads one JSON request from the connection and
+  // processes it exactly like a --json command line call, with stdout being the connection.
+  // When the worker has exited, the server appends a status trailer (SERVER_STATUS_TRAILER) with the
+  // worker's exit status to the connection, so clients can tell a complete answer from a crashed worker.
+  // The number of concurrently running workers is limited, further connections wait in the listen backlog.
+
+  void startServer()
+  {
+    ErrorPtr err;
+    struct sockaddr_un sa;
+    memset(&sa, 0, sizeof(sa));
+    sa.sun_family = AF_LOCAL;
+    if (mServerSocketPath.size()>=sizeof(sa.sun_path)) {
+      err = ErrorPtr(new Error(1, "socket path too long"));
+    }
+    else {
+      strcpy(sa.sun_path, mServerSocketPath.c_str());
+      unlink(mServerSocketPath.c_str()); // remove leftover from previous run
+      mServerFd = socket(PF_LOCAL, SOCK_STREAM, 0);
+      if (
+        mServerFd<0 ||
+        fcntl(mServerFd, F_SETFD, FD_CLOEXEC)<0 ||
+        ::bind(mServerFd, (struct sockaddr *)&sa, sizeof(sa))<0 ||
+        listen(mServerFd, 16)<0
+      ) {
+        err = SysError::errNo("cannot create server socket: ");
+      }
+    }
+    if (Error::notOK(err)) {
+      LOG(LOG_ERR, "server mode failed: %s", err->description().c_str());
+      if (mServerFd>=0) close(mServerFd);
+      mServerFd = -1;
+      terminateApp(EXIT_FAILURE);
+      return;
+    }
+    LOG(LOG_NOTICE, "serving JSON commands on %s with max %d workers", mServerSocketPath.c_str(), mMaxWorkers);
+    acceptConnections(true);
+  }
+
+
+  void acceptConnections(bool aAccept)
+  {
+    if (aAccept==mAccepting || mServerFd<0) return;
+    mAccepting = aAccept;
+    if (aAccept) {
+      MainLoop::currentMainLoop().registerPollHandler(mServerFd, POLLIN, boost::bind(&P44maintd::serverConnectionReady, this, _1, _2));
+    }
+    else {
+      MainLoop::currentMainLoop().unregisterPollHandler(mServerFd);
+    }
+  }
+
+
+  bool serverConnectionReady(int aFd, int aPollFlags)
+  {
+    if (aPollFlags & POLLIN) {
+      int connFd = accept(aFd, NULL, NULL);
+      if (connFd<0) {
+        LOG(LOG_WARNING, "accept failed: %s", strerror(errno));
+      }
+      else {
+        startWorker(connFd);
+      }
+    }
+    return true;
+  }
+
+
+  void startWorker(int aConnFd)
+  {
+    fflush(stdout); // make sure worker does not inherit pending output
+    pid_t pid = fork();
+    if (pid<0) {
+      LOG(LOG_ERR, "cannot fork worker: %s", strerror(errno));
+      close(aConnFd);
+      return;
+    }
+    if (pid==0) {
+      // worker child process: no server any more, just process the request
+      acceptConnections(false);
+      close(mServerFd);
+      mServerFd = -1;
+      for (StatusFdMap::iterator pos = mWorkerStatusFds.begin(); pos!=mWorkerStatusFds.end(); ++pos) {
+        close(pos->second); // other workers' connections
+      }
+      mWorkerStatusFds.clear();
+      serveRequest(aConnFd);
+      return;
+    }
+    // server: keep connection open to report the worker's exit status after all of its output
+    int statusFd = fcntl(aConnFd, F_DUPFD_CLOEXEC, 0);
+    if (statusFd>=0) mWorkerStatusFds[pid] = statusFd;
+    close(aConnFd);
+    mNumWorkers++;
+    LOG(LOG_INFO, "started worker pid %d, %d workers now running", pid, mNumWorkers);
+    MainLoop::currentMainLoop().waitForPid(boost::bind(&P44maintd::workerExited, this, _1, _2), pid);
+    if (mNumWorkers>=mMaxWorkers) {
+      LOG(LOG_INFO, "all workers busy, further connections must wait");
+      acceptConnections(false);
+    }
+  }
+
+
+  void workerExited(pid_t aPid, int aStatus)
+  {
+    if (mServerFd<0) return; // not the server (but a worker that inherited the wait handler)
+    StatusFdMap::iterator pos = mWorkerStatusFds.find(aPid);
+    if (pos!=mWorkerStatusFds.end()) {
+      int code = WIFEXITED(aStatus) ? WEXITSTATUS(aStatus) : (WIFSIGNALED(aStatus) ? 128+WTERMSIG(aStatus) : EXIT_FAILURE);
+      string trailer = string_format(SERVER_STATUS_TRAILER, code);
+      // never block or get SIGPIPE'd by a client which does not read any more
+      #ifdef MSG_NOSIGNAL
+      send(pos->second, trailer.data(), trailer.size(), MSG_DONTWAIT|MSG_NOSIGNAL);
+      #else
+      int on = 1;
+      setsockopt(pos->second, SOL_SOCKET, SO_NOSIGPIPE, &on, sizeof(on));
+      send(pos->second, trailer.data(), trailer.size(), MSG_DONTWAIT);
+      #endif
+      close(pos->second);
+      mWorkerStatusFds.erase(pos);
+    }
+    mNumWorkers--;
+    LOG(LOG_INFO, "worker pid %d exited with status %d, %d workers still running", aPid, aStatus, mNumWorkers);
+    if (mNumWorkers<mMaxWorkers) acceptConnections(true);
+  }
+
+
+  void serveRequest(int aConnFd)
+  {
+    resetAllocations(); // count for this request only
+    mProfiler.restart();
+    // read request: JSON text terminated by newline or EOF
+    struct timeval tv;
+    tv.tv_sec = SERVER_REQUEST_TIMEOUT;
+    tv.tv_usec = 0;
+    setsockopt(aConnFd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+    string request;
+    char buf[512];
+    bool timedOut = false;
+    while (true) {
+      ssize_t n = read(aConnFd, buf, sizeof(buf));
+      if (n<0 && errno==EINTR) continue;
+      if (n<0 && (errno==EAGAIN || errno==EWOULDBLOCK)) timedOut = true;
+      if (n<=0) break;
+      request.append(buf, n);
+      if (memchr(buf, '\n', n)) break;
+    }
+    // answer (and any other command output) goes to the connection
+    dup2(aConnFd, STDOUT_FILENO);
+    close(aConnFd);
+    if (timedOut) {
+      // do not process a possibly truncated request
+      LOG(LOG_WARNING, "timeout reading request, got %zu bytes", request.size());
+      answer(makeErrorAnswer(ErrorPtr(new Error(408, "Timeout reading request"))));
+      terminateApp(EXIT_FAILURE);
+      return;
+    }
+    LOG(LOG_DEBUG, "Received server JSON call: '%s'", request.c_str());
+    JsonObjectPtr cmdObj = JsonObject::objFromText(request.c_str());
+    if (jsonCmdFlags(cmdObj) & cmd_needsIdentification) {
+      // identification might be some time ago, user level might have been changed by a previous request
+      refreshVolatileDefs();
+      setUserLevelDef();
+    }
+    processJSONRequest(cmdObj);
+  }
+
+
+  virtual void signalOccurred(int aSignal, siginfo_t *aSiginfo)
+  {
+    if (aSignal==SIGHUP && mServerFd>=0) {
+      // server: redo identification, e.g. after configuration change
+      LOG(LOG_NOTICE, "SIGHUP: re-identifying platform");
+      acceptConnections(false);
+      identifyDynamically(boost::bind(&P44maintd::acceptConnections, this, true));
+      return;
+    }
+    inherited::signalOccurred(aSignal, aSiginfo);
+  }
+
+
+  // pass JSON command to a running server and copy its answer to stdout
+  // @param aExitStatus set to the exit status of the worker that processed the command, or EXIT_FAILURE
+  //   if there was no answer or no status (e.g. the worker or the server crashed)
+  // @return false if no server could be reached (the command was not passed)
+  bool forwardToServer(const char *aSocketPath, const char *aJSONCommand, int &aExitStatus)
+  {
+    struct sockaddr_un sa;
+    memset(&sa, 0, sizeof(sa));
+    sa.sun_family = AF_LOCAL;
+    if (strlen(aSocketPath)>=sizeof(sa.sun_path)) return false;
+    strcpy(sa.sun_path, aSocketPath);
+    int fd = socket(PF_LOCAL, SOCK_STREAM, 0);
+    if (fd<0) return false;
+    if (connect(fd, (struct sockaddr *)&sa, sizeof(sa))<0) {
+      LOG(LOG_INFO, "no server at %s: %s", aSocketPath, strerror(errno));
+      close(fd);
+      return false;
+    }
+    string request = aJSONCommand;
+    request += '\n';
+    if (write(fd, request.c_str(), request.size())!=(ssize_t)request.size()) {
+      close(fd);
+      return false;
+    }
+    shutdown(fd, SHUT_WR);
+    // copy everything the worker outputs (might be binary, e.g. config backup),
+    // except for the last bytes which should be the status trailer
+    aExitStatus = EXIT_FAILURE;
+    string tail;
+    size_t answerBytes = 0;
+    char buf[4096];
+    while (true) {
+      ssize_t n = read(fd, buf, sizeof(buf));
+      if (n<0 && errno==EINTR) continue;
+      if (n<=0) break;
+      tail.append(buf, n);
+      if (tail.size()>SERVER_STATUS_TRAILER_LEN) {
+        size_t out = tail.size()-SERVER_STATUS_TRAILER_LEN;
+        if (!writeAll(STDOUT_FILENO, boost::string_view(tail.data(), out))) break;
+        answerBytes += out;
+        tail.erase(0, out);
+      }
+    }
+    close(fd);
+    int code;
+    if (
+      tail.size()==SERVER_STATUS_TRAILER_LEN && tail.compare(0, strlen(SERVER_STATUS_PREFIX), SERVER_STATUS_PREFIX)==0 &&
+      sscanf(tail.c_str()+strlen(SERVER_STATUS_PREFIX), "%3d", &code)==1
+    ) {
+      if (answerBytes>0) aExitStatus = code;
+      else LOG(LOG_ERR, "server did not answer (worker exit status %d)", code);
+    }
+    else {
+      // no trailer: output is incomplete
+      writeAll(STDOUT_FILENO, tail);
+      LOG(LOG_ERR, "server closed connection without reporting status");
+    }
+    return true;
+  }
+
+
+  // MARK: ===== reboot
+
+
+  virtual void watchdog_arm(int aTimeoutSeconds)
+  {
+    // not implemented
+  }
+
+
+  void system_reboot(bool aHardReset, bool aPowerOff)
+  {
+    // signal "busy"
+    enableLEDs();
+    mRedLED->steadyOn();
+    mGreenLED->steadyOn();
+    // Now reboot
+    if (aHardReset) {
+      #if !BUILDENV_XCODE && !BUILDENV_GENERIC
+      // use the watchdog as a fallback
+      watchdog_arm(10); // ten seconds later, watchdog should hit anyway
+      // but issue hard Linux system reset / power off right now
+      reboot(aPowerOff ? RB_POWER_OFF : RB_AUTOBOOT);
+      #endif
+    }
+    else {
+      // reboot
+      watchdog_arm(3*60); // as a fallback, trigger watchdog 3 minutes later
+      // Note: must be a single shell command line, as we answer and terminate right away,
+      //   so a helper sequence would not get past its first step.
+      //   The shell detaches from our stdio, so neither mg44 nor a --via client waits for it, and nothing
+      //   gets SIGPIPE from an output pipe nobody reads any more.
+      string sdcmd = string_format("exec </dev/null >/dev/null 2>&1; sv stop p44mbrd vdcd mg44; sync; %s", aPowerOff ? "poweroff" : "reboot");
+      runShell(
+        NoOP,
+        #if !BUILDENV_XCODE && !BUILDENV_GENERIC
+        sdcmd
+        #else
+        "exec >/dev/null; echo dummy call simulating restart or shutdown"
+        #endif
+        , false
+      );
+    }
+  }
+
+
+  // MARK: ===== JSON interface for web
+
+
+  JsonObjectPtr makeAnswer(JsonObjectPtr aResultObj)
+  {
+    // create answer
+    JsonObjectPtr answer = JsonObject::newObj();
+    if (!aResultObj) aResultObj = JsonObject::newNull();
+    answer->add("result", aResultObj);
+    return answer;
+  }
+
+
+  JsonObjectPtr makeErrorAnswer(ErrorPtr aError)
+  {
+    // create error answer
+    mResultKey.clear(); // never cached
+    JsonObjectPtr answer = JsonObject::newObj();
+    JsonObjectPtr e = JsonObject::newObj();
+    e->add("code", JsonObject::newInt32((int)aError->getErrorCode()));
+    e->add("message", JsonObject::newString(aError->getErrorMessage()));
+    answer->add("error", e);
+    return answer;
+  }
+
+
+  JsonObjectPtr emptyAnswer()
+  {
+    // create null answer
+    return makeAnswer(JsonObject::newNull());
+  }
+
+
+  JsonObjectPtr statusAnswer(ErrorPtr aError, JsonObjectPtr aResultObj = JsonObjectPtr())
+  {
+    if (Error::isOK(aError)) {
+      return makeAnswer(aResultObj);
+    }
+    else {
+      return makeErrorAnswer(aError);
+    }
+  }
+
+
+  void answer(JsonObjectPtr aJSONAnswer)
+  {
+    if (aJSONAnswer) {
+      size_t ph = mProfiler.begin("serializeAnswer");
+      const char *json = aJSONAnswer->json_c_str();
+      mProfiler.end(ph);
+      answerText(json);
+    }
+  }
+
+
+  void answerText(boost::string_view aJSONAnswer)
+  {
+    // request is complete, perform deferred flash writes before confirming it
+    ErrorPtr err = FlashWriter::writer().flush();
+    FlashWriter::writer().recordStats();
+    string errAnswer;
+    if (Error::notOK(err)) {
+      errAnswer = makeErrorAnswer(err)->json_str();
+      aJSONAnswer = errAnswer;
+    }
+    updateResultCache(aJSONAnswer);
+    LOG(LOG_DEBUG, "Replying with JSON answer: '%.*s'", (int)aJSONAnswer.size(), aJSONAnswer.data());
+    fflush(stdout); // in case something was output via stdio before
+    if (mProfiler.enabled()) {
+      mProfiler.endAll(); // answer is complete, so are all phases leading to it
+      if (mProfileInAnswer && aJSONAnswer.size()>0 && aJSONAnswer.back()=='}') {
+        // embed as "_profile" into the answer object
+        JsonWriter w;
+        mProfiler.writeJSON(w);
+        boost::string_view head = aJSONAnswer.substr(0, aJSONAnswer.size()-1);
+        writeAll(STDOUT_FILENO, head.to_string() + (head.size()>1 ? ",\"_profile\":" : "\"_profile\":") + w.data() + "}", "\n");
+        logAllocations("answer");
+        return;
+      }
+    }
+    writeAll(STDOUT_FILENO, aJSONAnswer, "\n");
+    logAllocations("answer");
+    profileToStderr();
+  }
+
+
+  void profileToStderr()
+  {
+    if (mProfiler.enabled() && !mProfileInAnswer) {
+      JsonWriter w;
+      mProfiler.writeJSON(w);
+      w.flush(STDERR_FILENO, "\n");
+    }
+  }
+
+
+  void answerAndTerminate(JsonObjectPtr aJSONAnswer)
+  {
+    answer(aJSONAnswer);
+    terminateApp(EXIT_SUCCESS);
+  }
+
+
+  // answer with JSON directly written by a JsonWriter
+  void answerAndTerminate(JsonWriter &aJSONAnswer)
+  {
+    answerText(aJSONAnswer.data());
+    terminateApp(EXIT_SUCCESS);
+  }
+
+
+  // MARK: ===== JSON command registry
+
+  static const JSONCmdDesc *jsonCmds()
+  {
+    static const DefKey ledDefs[] = { def_PLATFORM_RED_LED, def_PLATFORM_GREEN_LED, noDefKey };
+    static const DefKey passwordDefs[] = { def_PRODUCT_WEBADMIN_USER, def_PRODUCT_MODEL, noDefKey };
+    static const DefKey userLevelDefs[] = { def_STATUS_USER_LEVEL, noDefKey };
+    static const DefKey ipconfigDefs[] = { def_PRODUCT_UCI_NETWORK_INTERFACE, noDefKey };
+    static const JSONCmdDesc cmds[] = {
+      { JSON_CMD("restart"), &P44maintd::cmd_restart, cmd_needsIdentification, ledDefs, 0 },
+      { JSON_CMD("poweroff"), &P44maintd::cmd_poweroff, cmd_needsIdentification, ledDefs, 0 },
+      { JSON_CMD("configbackup"), &P44maintd::cmd_configbackup, cmd_needsIdentification|cmd_async|cmd_rawOutput, NULL, 0 },
+      { JSON_CMD("configrestoreprep"), &P44maintd::cmd_configrestoreprep, cmd_needsIdentification|cmd_async, NULL, 0 },
+      { JSON_CMD("configrestoreapply"), &P44maintd::cmd_configrestoreapply, cmd_async, NULL, 0 },
+      #if !BUILDENV_DIGIESP
+      { JSON_CMD("tzconfig"), &P44maintd::cmd_tzconfig, cmd_async|cmd_readonlyQuery, NULL, CONFIG_CACHE_TTL },
+      { JSON_CMD("wificonfig"), &P44maintd::cmd_wificonfig, cmd_async|cmd_readonlyQuery, NULL, CONFIG_CACHE_TTL },
+      #endif // !BUILDENV_DIGIESP
+      { JSON_CMD("ipconfig"), &P44maintd::cmd_ipconfig, cmd_needsIdentification|cmd_async|cmd_readonlyQuery, ipconfigDefs, CONFIG_CACHE_TTL },
+      { JSON_CMD("setpassword"), &P44maintd::cmd_setpassword, cmd_needsIdentification|cmd_async, passwordDefs, 0 },
+      { JSON_CMD("factoryreset"), &P44maintd::cmd_factoryreset, cmd_needsIdentification|cmd_async, ledDefs, 0 },
+      { JSON_CMD("devinfo"), &P44maintd::cmd_devinfo, cmd_readonly|cmd_needsIdentification|cmd_async, NULL, DEVINFO_CACHE_TTL },
+      { JSON_CMD("userlevel"), &P44maintd::cmd_userlevel, cmd_needsIdentification|cmd_readonlyQuery, userLevelDefs, 0 },
+      { JSON_CMD("property"), &P44maintd::cmd_property, 0, NULL, 0 },
+      { JSON_CMD("alert"), &P44maintd::cmd_alert, cmd_readonlyQuery, NULL, 0 },
+      { JSON_CMD("flushcaches"), &P44maintd::cmd_flushcaches, 0, NULL, 0 },
+      { JSON_CMD("flashstats"), &P44maintd::cmd_flashstats, cmd_async|cmd_readonlyQuery, NULL, 0 },
+      { JSON_CMD("verify"), &P44maintd::cmd_verify, cmd_readonlyQuery, NULL, 0 },
+      { JSON_CMD("serialconvert"), &P44maintd::cmd_serialconvert, cmd_readonly|cmd_async, NULL, 0 },
+      { NULL, 0, NULL, 0, NULL, 0 } // terminator
+    };
+    return cmds;
+  }
+
+
+  // register a JSON command. Derived classes can add their own commands from their constructor,
+  // or replace a built-in command by registering one with the same name.
+  void registerJSONCmd(const JSONCmdDesc &aCmd)
+  {
+    size_t mask = mJSONCmdSlots.size()-1;
+    size_t i;
+    for (i = aCmd.hash & mask; mJSONCmdSlots[i]>=0; i = (i+1) & mask) {
+      JSONCmdDesc &c = mJSONCmds[mJSONCmdSlots[i]];
+      if (c.hash==aCmd.hash && strcmp(c.name, aCmd.name)==0) {
+        c = aCmd; // replace
+        return;
+      }
+    }
+    if ((mJSONCmds.size()+1)*2>mJSONCmdSlots.size()) {
+      // keep load factor below 50%
+      mJSONCmdSlots.assign(mJSONCmdSlots.size()*2, -1);
+      mJSONCmds.push_back(aCmd);
+      mask = mJSONCmdSlots.size()-1;
+      for (size_t n=0; n<mJSONCmds.size(); n++) {
+        for (i = mJSONCmds[n].hash & mask; mJSONCmdSlots[i]>=0; i = (i+1) & mask);
+        mJSONCmdSlots[i] = (int16_t)n;
+      }
+      return;
     }
-    // - additional product definitions that may included in the common firmware for multiple products
-    if (getDef("PRODUCT_IDENTIFIER", def)) {
-      readDefsFrom(mDefspath+"p44product-" + def + ".defs", mDefs);
+    mJSONCmds.push_back(aCmd);
+    mJSONCmdSlots[i] = (int16_t)(mJSONCmds.size()-1);
+  }
+
+
+  void registerJSONCmd(const char *aName, JSONCmdHandler aHandler, int aFlags, const DefKey *aNeedsDefs = NULL, int aCacheTTL = 0)
+  {
+    JSONCmdDesc c = { aName, jsonCmdHash(aName), aHandler, aFlags, aNeedsDefs, aCacheTTL };
+    registerJSONCmd(c);
+  }
+
+
+  const JSONCmdDesc *findJSONCmd(const string &aCmd)
+  {
+    uint32_t h = jsonCmdHash(aCmd.c_str());
+    size_t mask = mJSONCmdSlots.size()-1;
+    for (size_t i = h & mask; mJSONCmdSlots[i]>=0; i = (i+1) & mask) {
+      const JSONCmdDesc &c = mJSONCmds[mJSONCmdSlots[i]];
+      if (c.hash==h && aCmd==c.name) return &c;
     }
-    // check for dynamic producer
-    //  such as: "fw_printenv p44producer | sed -r -n -e '/^p44producer=/s/.*=//p'"
-    if (getDef("PRODUCER_GETTER", def)) {
-      // obtain producer
-      MainLoop::currentMainLoop().fork_and_system(
-        boost::bind(&P44maintd::producerQueryDone, this, aCallback, _1, _2),
-        def.c_str(),
-        true, NULL, // collect stdout into string
-        0 // mute stderr
-      );
-      return;
+    return NULL;
+  }
+
+
+  // extract actual request data (command and its parameters) from a JSON request
+  JsonObjectPtr requestParams(JsonObjectPtr aCmdObj)
+  {
+    // { "method":"GET", "uri":"aga", "uri_params": {"cmd": "ipconfig", "ipaddr": "1.2.3.4", "netmask": "255.255.255.0", "dhcp": 0, "gw":"1.2.3.1" } }
+    // { "method":"POST", "uri":"aga", "data": {"cmd": "ipconfig", "ipaddr": "1.2.3.4", "netmask": "255.255.255.0", "dhcp": 0, "gw":"1.2.3.1" } }
+    // { "method":"POST", "uri":"aga", "data": {"batch": [ {"cmd": "devinfo"}, {"cmd": "ipconfig"} ] } }
+    // - try POST data first
+    JsonObjectPtr params = aCmdObj->get("data");
+    if (!params) {
+      // no POST data, try uri_params
+      params = aCmdObj->get("uri_params");
     }
-    else {
-      // assume static producer
-      // - check separate file first
-      readDefFromFirstLine(mDefspath+"p44producer", "PRODUCER");
-      checkProducer(aCallback);
+    return params;
+  }
+
+
+  // flags of the command to be run with aParams
+  int cmdFlags(JsonObjectPtr aParams)
+  {
+    string cmd;
+    if (!checkStringParam(aParams, "cmd", cmd)) return 0; // will only produce an error answer
+    const JSONCmdDesc *c = findJSONCmd(cmd);
+    if (!c) return cmd_needsIdentification; // not registered, might be handled by a derived handleJSONCmd()
+    int flags = c->flags;
+    if ((flags & cmd_readonlyQuery) && aParams->numKeys()==1) flags |= cmd_readonly;
+    return flags;
+  }
+
+
+  // combined flags of all commands a JSON request will run
+  int jsonCmdFlags(JsonObjectPtr aCmdObj)
+  {
+    if (!aCmdObj) return 0; // will only produce an error answer
+    JsonObjectPtr params = requestParams(aCmdObj);
+    JsonObjectPtr batch;
+    if (params && params->get("batch", batch) && batch->isType(json_type_array)) {
+      int flags = 0;
+      for (int i=0; i<batch->arrayLength(); i++) flags |= cmdFlags(batch->arrayGet(i));
+      return flags;
     }
+    return cmdFlags(params);
   }
 
 
-  void producerQueryDone(SimpleCB aCallback, ErrorPtr err, const string &aAnswer)
+  // identification stage needed for the command to be run with aParams
+  IdentStage cmdIdentStage(JsonObjectPtr aParams)
   {
-    string v = trimWhiteSpace(aAnswer);
-    if (v.size()>0) {
-      mDefs["PRODUCER"] = v;
+    string cmd;
+    if (!checkStringParam(aParams, "cmd", cmd)) return identStage_none; // will only produce an error answer
+    const JSONCmdDesc *c = findJSONCmd(cmd);
+    if (!c) return identStage_full; // not registered, might be handled by a derived handleJSONCmd()
+    if ((c->flags & cmd_needsIdentification)==0) return identStage_none;
+    if (!c->needsDefs) return identStage_full;
+    IdentStage stage = identStage_basic;
+    for (const DefKey *d = c->needsDefs; *d!=noDefKey; d++) {
+      stage = max(stage, defIdentStage(*d));
     }
-    checkProducer(aCallback);
+    return stage;
   }
 
 
-  void checkProducer(SimpleCB aCallback)
+  // identification stage needed for all commands in a JSON request
+  IdentStage requestIdentStage(JsonObjectPtr aCmdObj)
   {
-    string def;
+    if (!aCmdObj) return identStage_none; // will only produce an error answer
+    JsonObjectPtr params = requestParams(aCmdObj);
+    JsonObjectPtr batch;
+    if (params && params->get("batch", batch) && batch->isType(json_type_array)) {
+      IdentStage stage = identStage_none;
+      for (int i=0; i<batch->arrayLength(); i++) stage = max(stage, cmdIdentStage(batch->arrayGet(i)));
+      return stage;
+    }
+    return cmdIdentStage(params);
+  }
 
-    // - make sure we have at least a "unknown" producer
-    setDefDefault("PRODUCER", "unknown");
-    // - feed
-    readDefFromFirstLine(mDefspath+"p44feed", "FIRMWARE_FEED");
-    // - version
-    readDefFromFirstLine(mDefspath+"p44version", "FIRMWARE_VERSION");
-    // - user level
-    if (!readDefFromFirstLine("/tmp/p44userlevel", "STATUS_USER_LEVEL")) {
-      if (!readDefFromFirstLine(FLASH_PATH "p44userlevel", "STATUS_USER_LEVEL")) {
-        if (getDef("PRODUCT_DEFAULT_USER_LEVEL", def)) {
-          // use product specific default user level
-          mDefs["STATUS_USER_LEVEL"] = def;
-        }
-        else {
-          // production default is 0, testing/beta/development default is 1
-          mDefs["STATUS_USER_LEVEL"] = getDef("FIRMWARE_FEED")=="prod" ? "0" : "1";
-        }
-      }
+
+  virtual ErrorPtr handleJSONCmd(string aCmd, JsonObjectPtr aParams, JsonObjectPtr aCmdObj, JsonObjectPtr& aAnswer)
+  {
+    const JSONCmdDesc *c = findJSONCmd(aCmd);
+    if (!c) {
+      return ErrorPtr(new Error(1,"Unknown 'cmd'"));
     }
-    // check for dynamic variant getter
-    //  such as: "/sbin/ubootenv --print 'p44variant' | sed -r -n -e '/^p44variant=/s/p44variant=//p'"
-    //  or: "cat /boot/p44variant"
-    if (getDef("PLATFORM_VARIANT_GETTER", def)) {
-      MainLoop::currentMainLoop().fork_and_system(
-        boost::bind(&P44maintd::variantQueryDone, this, aCallback, _1, _2),
-        def.c_str(),
-        true, NULL, // collect stdout into string
-        0 // mute stderr
-      );
+    ErrorPtr err = (this->*(c->handler))(aParams, aCmdObj, aAnswer);
+    if (!aAnswer && Error::isOK(err) && (c->flags & cmd_async)==0) {
+      // synchronous commands always answer
+      aAnswer = emptyAnswer();
+    }
+    return err;
+  }
+
+
+  void processJSON(const char *aJSONCommand)
+  {
+    LOG(LOG_DEBUG, "Received command line JSON call: '%s'", aJSONCommand);
+    processJSONRequest(JsonObject::objFromText(aJSONCommand));
+  }
+
+
+  void processJSONRequest(JsonObjectPtr aCmdObj)
+  {
+    if (!aCmdObj) {
+      answerAndTerminate(makeErrorAnswer(ErrorPtr(new Error(1,"Cannot decode JSON"))));
       return;
     }
-    // if we get here, variant info is already there, so we can continue processing it
-    processVariantSpecifics(aCallback);
+    JsonObjectPtr params = requestParams(aCmdObj);
+    JsonObjectPtr batch;
+    if (params && params->get("batch", batch)) {
+      runBatch(batch, aCmdObj);
+      return;
+    }
+    processJSONCmd(params, aCmdObj);
   }
 
 
-  void variantQueryDone(SimpleCB aCallback, ErrorPtr err, const string &aAnswer)
+  void processJSONCmd(JsonObjectPtr aParams, JsonObjectPtr aCmdObj)
   {
-    string v = trimWhiteSpace(aAnswer);
-    if (v.size()>0) {
-      mDefs["PRODUCT_VARIANT"] = v;
+    ErrorPtr err;
+    JsonObjectPtr answer;
+    string cmd;
+    if (checkStringParam(aParams, "cmd", cmd)) {
+      if (mResultKey.empty() && answerFromCache(aParams)) return; // not yet looked up (server, batch)
+      // handle command
+      size_t ph = mProfiler.begin("dispatch", cmd);
+      FlashWriter::writer().setCommand(cmd);
+      err = handleJSONCmd(cmd, aParams, aCmdObj, answer);
+      mProfiler.end(ph);
+      if (!answer && Error::isOK(err)) {
+        // answer comes later, usually from a subprocess
+        mProfiler.begin("awaitAnswer", cmd); // ends with answerText()
+      }
     }
     else {
-      // assume variant 0 if not set
-      mDefs["PRODUCT_VARIANT"] = "0"; // e.g. DEH v3
+      err = ErrorPtr(new Error(1,"Missing 'cmd'"));
+    }
+    if (!Error::isOK(err)) {
+      // generate error message answer
+      answer = makeErrorAnswer(err);
+    }
+    // return error or result answer if any
+    if (answer) {
+      answerAndTerminate(answer);
     }
-    processVariantSpecifics(aCallback);
   }
 
 
-  virtual void setDerivedDefs()
+  // MARK: ===== result cache
+
+  // The web UI polls some queries repeatedly. Their answers are cached across processes for the
+  // command's cacheTTL, so a poll costs a single file read instead of identification and helper runs.
+
+  // answer a cacheable query from the result cache
+  // @return true if answered (and app terminated), false if the query must be run. On a cache miss,
+  //   the answer of the query will be stored in the cache when it is delivered.
+  bool answerFromCache(JsonObjectPtr aParams)
   {
-    // - copyright range
-    struct timeval t;
-    gettimeofday(&t, NULL);
-    struct tm *tim = localtime(&t.tv_sec);
-    setDefDefault("PRODUCT_COPYRIGHT_YEARS", string_format("2013-%04d", tim->tm_year+1900));
-    // - copyright holder
-    setDefDefault("PRODUCT_COPYRIGHT_HOLDER", "plan44.ch");
+    mResultKey.clear();
+    string cmd;
+    if (!checkStringParam(aParams, "cmd", cmd)) return false;
+    const JSONCmdDesc *c = findJSONCmd(cmd);
+    if (!c || c->cacheTTL<=0 || (cmdFlags(aParams) & cmd_readonly)==0) return false;
+    string key = aParams->json_str();
+    string cached;
+    size_t ph = mProfiler.begin("resultCache", cmd);
+    bool hit = ResultCache::lookup(key, cached, mResultGeneration);
+    mProfiler.end(ph);
+    if (hit) {
+      LOG(LOG_INFO, "answering '%s' from result cache", cmd.c_str());
+      answerText(cached);
+      terminateApp(EXIT_SUCCESS);
+      return true;
+    }
+    mResultKey = key;
+    mResultTTL = c->cacheTTL;
+    return false;
   }
 
 
-  void processVariantSpecifics(SimpleCB aCallback)
+  // to be called by every command that changes something cached queries might report.
+  // The cache is invalidated when the request is complete (including deferred flash writes).
+  void resultsChanged()
   {
-    string def;
+    mResultsChanged = true;
+  }
 
-    // try to load product variant specific settings
-    if (getDef("PRODUCT_VARIANT", def)) {
-      readDefsFrom(mDefspath+"p44variant-" + getDef("PRODUCT_IDENTIFIER") + "-" + def + ".defs", mDefs);
+
+  // update result cache with the now complete answer of the current request
+  void updateResultCache(boost::string_view aJSONAnswer)
+  {
+    if (mResultsChanged) {
+      ResultCache::invalidate();
+      mResultsChanged = false;
     }
-    // overrides from individual configuration
-    readDefsFrom(FLASH_PATH "/p44custom.defs", mDefs);
-    // get unit variables
-    // - serial
-    mDefs["UNIT_SERIALNO"] = string_format("%lld", serial());
-    // - MAC address
-    uint64_t mac = macAddress();
-    string macStr;
-    mDefs["UNIT_MAC_DECIMAL"] = string_format("%lld", mac);
-    for (int i=0; i<6; ++i) {
-      if (i>0) macStr += ":";
-      string_format_append(macStr, "%02X",(unsigned int)((mac>>((5-i)*8)) & 0xFF));
+    else if (!mResultKey.empty()) {
+      ResultCache::store(mResultKey, aJSONAnswer, mResultTTL, mResultGeneration);
     }
-    mDefs["UNIT_MACADDRESS"] = macStr;
-    // - IPv4
-    uint32_t ipv4 = ipv4Address();
-    mDefs["STATUS_IPV4"] = string_format("%d.%d.%d.%d", (ipv4>>24) & 0xFF, (ipv4>>16) & 0xFF, (ipv4>>8) & 0xFF, ipv4 & 0xFF);
-    // - host name
-    getDef("PRODUCT_HOSTPREFIX", def, "unknown");
-    mDefs["UNIT_HOSTNAME"] = string_format("%s_%lld",def.c_str(), serial());
-    // Derived default values
-    setDerivedDefs();
-    // done
-    aCallback();
+    mResultKey.clear();
   }
 
 
-  int userlevel()
+  // MARK: ===== batch processing
+
+  // Each command of a batch runs in a forked child process which inherits the identification and processes
+  // the command exactly like a single command, with stdout being a pipe to the parent. This way, asynchronous
+  // commands need no special handling, and the queries of read-only commands run concurrently.
+  // Mutating commands run exclusively, in the order given. All answers are returned as one array.
+
+  void runBatch(JsonObjectPtr aItems, JsonObjectPtr aCmdObj)
   {
-    string def;
-    int userlevel = 0;
-    if (getDef("STATUS_USER_LEVEL", def)) {
-      sscanf(def.c_str(), "%d", &userlevel);
+    if (!aItems->isType(json_type_array)) {
+      answerAndTerminate(makeErrorAnswer(ErrorPtr(new Error(1,"'batch' must be an array"))));
+      return;
     }
-    return userlevel;
+    mBatch.clear();
+    mBatchCmdObj = aCmdObj;
+    mBatchNext = 0;
+    mBatchRunning = 0;
+    mBatchExclusive = false;
+    for (int i=0; i<aItems->arrayLength(); i++) {
+      BatchItem b;
+      b.params = aItems->arrayGet(i);
+      int flags = cmdFlags(b.params);
+      b.readonly = (flags & cmd_readonly)!=0;
+      b.pid = -1;
+      b.fd = -1;
+      b.phase = PhaseProfiler::none;
+      if (!b.params || !b.params->isType(json_type_object) || b.params->get("batch")) {
+        b.answer = makeErrorAnswer(ErrorPtr(new Error(1,"Invalid batch item")));
+      }
+      else if (flags & cmd_rawOutput) {
+        b.answer = makeErrorAnswer(ErrorPtr(new Error(1,"Command cannot be used in a batch")));
+      }
+      mBatch.push_back(b);
+    }
+    continueBatch();
   }
 
 
-  // MARK: ===== command line actions
-
-  virtual void initialize()
+  void continueBatch()
   {
-    // need full platform identification first
-    identifyDynamically(boost::bind(&P44maintd::platformCommands, this));
+    while (mBatchNext<mBatch.size()) {
+      BatchItem &b = mBatch[mBatchNext];
+      if (!b.answer) {
+        // must be run
+        if (b.readonly ? mBatchExclusive : mBatchRunning>0) return; // must wait
+        if (!startBatchItem(mBatchNext)) return; // child process, not running the batch
+      }
+      mBatchNext++;
+    }
+    if (mBatchRunning>0) return;
+    // all done
+    JsonObjectPtr results = JsonObject::newArray();
+    for (BatchItemsVector::iterator pos = mBatch.begin(); pos!=mBatch.end(); ++pos) {
+      results->arrayAppend(pos->answer);
+    }
+    mBatch.clear();
+    answerAndTerminate(makeAnswer(results));
   }
 
 
-  // check commands that need full platform identification before being run
-  virtual void platformCommands()
+  // @return false in the child process
+  bool startBatchItem(size_t aIndex)
   {
-    // check operation to perform
-    const char *jsonCommand;
-    int intOpt;
-    if (getStringOption("json", jsonCommand)) {
-      // process JSON command line call
-      processJSON(jsonCommand);
+    BatchItem &b = mBatch[aIndex];
+    int fds[2];
+    if (pipe(fds)<0) {
+      b.answer = makeErrorAnswer(SysError::errNo("cannot create pipe: "));
+      return true;
     }
-    else if (getOption("deviceinfo")) {
-      // show device info
-      showDeviceInfo();
+    fflush(stdout); // make sure child does not inherit pending output
+    pid_t pid = fork();
+    if (pid<0) {
+      b.answer = makeErrorAnswer(SysError::errNo("cannot fork: "));
+      close(fds[0]);
+      close(fds[1]);
+      return true;
     }
-    else if (getOption("defs")) {
-      // show device info
-      showDefs();
+    if (pid==0) {
+      // child: only process this item, answer goes to the pipe
+      JsonObjectPtr params = b.params;
+      for (BatchItemsVector::iterator pos = mBatch.begin(); pos!=mBatch.end(); ++pos) {
+        if (pos->fd>=0) {
+          MainLoop::currentMainLoop().unregisterPollHandler(pos->fd);
+          close(pos->fd);
+        }
+      }
+      mBatch.clear();
+      close(fds[0]);
+      dup2(fds[1], STDOUT_FILENO);
+      close(fds[1]);
+      processJSONCmd(params, mBatchCmdObj);
+      return false;
     }
-    else if (getIntOption("factoryreset", intOpt)) {
-      // factory reset
-      factoryReset(intOpt);
+    // parent
+    close(fds[1]);
+    b.pid = pid;
+    b.fd = fds[0];
+    b.phase = mProfiler.begin("batchItem", string_format("#%zu", aIndex));
+    mBatchRunning++;
+    if (!b.readonly) mBatchExclusive = true;
+    LOG(LOG_INFO, "batch item #%zu running in pid %d", aIndex, pid);
+    MainLoop::currentMainLoop().registerPollHandler(b.fd, POLLIN, boost::bind(&P44maintd::batchOutputReady, this, aIndex, _1, _2));
+    MainLoop::currentMainLoop().waitForPid(boost::bind(&P44maintd::batchItemExited, this, _1, _2), pid);
+    return true;
+  }
+
+
+  bool batchOutputReady(size_t aIndex, int aFd, int aPollFlags)
+  {
+    if (aIndex>=mBatch.size()) return true; // not running the batch (child process)
+    BatchItem &b = mBatch[aIndex];
+    if (aPollFlags & POLLIN) {
+      char buf[1024];
+      ssize_t n = read(aFd, buf, sizeof(buf));
+      if (n>0) {
+        b.output.append(buf, n);
+        return true;
+      }
+      if (n<0 && (errno==EINTR || errno==EAGAIN)) return true; // no data yet, wait for next poll
     }
-    else {
-      // no operation
-      terminateApp(EXIT_FAILURE);
+    else if ((aPollFlags & (POLLHUP|POLLERR))==0) {
+      return false; // not handled
+    }
+    // EOF or error: item done
+    mProfiler.end(b.phase);
+    MainLoop::currentMainLoop().unregisterPollHandler(aFd);
+    close(aFd);
+    b.fd = -1;
+    b.answer = JsonObject::objFromText(b.output.c_str());
+    if (!b.answer) {
+      b.answer = makeErrorAnswer(ErrorPtr(new Error(1,"Command did not answer")));
     }
+    mBatchRunning--;
+    if (!b.readonly) mBatchExclusive = false;
+    continueBatch();
+    return true;
   }
 
 
-  // MARK: ===== reboot
+  void batchItemExited(pid_t aPid, int aStatus)
+  {
+    // completion is detected by EOF of the output, this is only for reaping the child
+    LOG(LOG_DEBUG, "batch item pid %d exited with status %d", aPid, aStatus);
+  }
 
 
-  virtual void watchdog_arm(int aTimeoutSeconds)
+  // MARK: ===== JSON command handlers
+
+  ErrorPtr cmd_restart(JsonObjectPtr aParams, JsonObjectPtr aCmdObj, JsonObjectPtr &aAnswer)
   {
-    // not implemented
+    ErrorPtr err;
+    aAnswer = restart_from_ui(err, false);
+    return err;
   }
 
 
-  void system_reboot(bool aHardReset, bool aPowerOff)
+  ErrorPtr cmd_poweroff(JsonObjectPtr aParams, JsonObjectPtr aCmdObj, JsonObjectPtr &aAnswer)
   {
-    // signal "busy"
-    enableLEDs();
-    mRedLED->steadyOn();
-    mGreenLED->steadyOn();
-    // Now reboot
-    if (aHardReset) {
-      #if !BUILDENV_XCODE && !BUILDENV_GENERIC
-      // use the watchdog as a fallback
-      watchdog_arm(10); // ten seconds later, watchdog should hit anyway
-      // but issue hard Linux system reset / power off right now
-      reboot(aPowerOff ? RB_POWER_OFF : RB_AUTOBOOT);
-      #endif
-    }
-    else {
-      // reboot
-      watchdog_arm(3*60); // as a fallback, trigger watchdog 3 minutes later
-      string sdcmd = string_format("sv stop p44mbrd vdcd mg44; sync; %s", aPowerOff ? "poweroff" : "reboot");
-      MainLoop::currentMainLoop().fork_and_system(
-        NoOP,
-        #if !BUILDENV_XCODE && !BUILDENV_GENERIC
-        sdcmd.c_str()
-        #else
-        "echo dummy call simulating restart or shutdown"
-        #endif
-        ,true, NULL, // capture output to prevent output going to mg44
-        0 // mute stderr
-      );
-    }
+    ErrorPtr err;
+    aAnswer = restart_from_ui(err, true);
+    return err;
   }
 
 
-  // MARK: ===== JSON interface for web
+  ErrorPtr cmd_configbackup(JsonObjectPtr aParams, JsonObjectPtr aCmdObj, JsonObjectPtr &aAnswer)
+  {
+    ErrorPtr err;
+    config_backup(aParams, err);
+    return err;
+  }
 
 
-  JsonObjectPtr makeAnswer(JsonObjectPtr aResultObj)
+  ErrorPtr cmd_configrestoreprep(JsonObjectPtr aParams, JsonObjectPtr aCmdObj, JsonObjectPtr &aAnswer)
   {
-    // create answer
-    JsonObjectPtr answer = JsonObject::newObj();
-    if (!aResultObj) aResultObj = JsonObject::newNull();
-    answer->add("result", aResultObj);
-    return answer;
+    ErrorPtr err;
+    aAnswer = config_restore_prep(aCmdObj, err); // uploadedfile is not a uri_param nor post data, but one level up
+    return err;
   }
 
 
-  JsonObjectPtr makeErrorAnswer(ErrorPtr aError)
+  ErrorPtr cmd_configrestoreapply(JsonObjectPtr aParams, JsonObjectPtr aCmdObj, JsonObjectPtr &aAnswer)
   {
-    // create error answer
-    JsonObjectPtr answer = JsonObject::newObj();
-    JsonObjectPtr e = JsonObject::newObj();
-    e->add("code", JsonObject::newInt32((int)aError->getErrorCode()));
-    e->add("message", JsonObject::newString(aError->getErrorMessage()));
-    answer->add("error", e);
-    return answer;
+    ErrorPtr err;
+    aAnswer = config_restore_apply(aParams, err);
+    return err;
+  }
+
+
+  #if !BUILDENV_DIGIESP
+
+  ErrorPtr cmd_tzconfig(JsonObjectPtr aParams, JsonObjectPtr aCmdObj, JsonObjectPtr &aAnswer)
+  {
+    ErrorPtr err;
+    aAnswer = timezoneconfig(aParams, err);
+    return err;
+  }
+
+
+  ErrorPtr cmd_wificonfig(JsonObjectPtr aParams, JsonObjectPtr aCmdObj, JsonObjectPtr &aAnswer)
+  {
+    ErrorPtr err;
+    aAnswer = wificonfig(aParams, err);
+    return err;
+  }
+
+  #endif // !BUILDENV_DIGIESP
+
+
+  ErrorPtr cmd_ipconfig(JsonObjectPtr aParams, JsonObjectPtr aCmdObj, JsonObjectPtr &aAnswer)
+  {
+    ErrorPtr err;
+    aAnswer = ipconfig(aParams, err);
+    return err;
+  }
+
+
+  ErrorPtr cmd_setpassword(JsonObjectPtr aParams, JsonObjectPtr aCmdObj, JsonObjectPtr &aAnswer)
+  {
+    ErrorPtr err;
+    aAnswer = setpassword(aParams, err);
+    return err;
+  }
+
+
+  ErrorPtr cmd_factoryreset(JsonObjectPtr aParams, JsonObjectPtr aCmdObj, JsonObjectPtr &aAnswer)
+  {
+    ErrorPtr err;
+    aAnswer = factory_reset_from_ui(aParams, err);
+    return err;
   }
 
 
-  JsonObjectPtr emptyAnswer()
+  ErrorPtr cmd_devinfo(JsonObjectPtr aParams, JsonObjectPtr aCmdObj, JsonObjectPtr &aAnswer)
   {
-    // create null answer
-    return makeAnswer(JsonObject::newNull());
+    JsonWriter w;
+    w.beginObject().key("result");
+    devinfo(w);
+    w.endObject();
+    answerAndTerminate(w);
+    return ErrorPtr();
   }
 
 
-  JsonObjectPtr statusAnswer(ErrorPtr aError, JsonObjectPtr aResultObj = JsonObjectPtr())
+  ErrorPtr cmd_userlevel(JsonObjectPtr aParams, JsonObjectPtr aCmdObj, JsonObjectPtr &aAnswer)
   {
-    if (Error::isOK(aError)) {
-      return makeAnswer(aResultObj);
-    }
-    else {
-      return makeErrorAnswer(aError);
-    }
+    ErrorPtr err;
+    aAnswer = userlevelaccess(aParams, err);
+    return err;
   }
 
 
-  void answer(JsonObjectPtr aJSONAnswer)
+  ErrorPtr cmd_property(JsonObjectPtr aParams, JsonObjectPtr aCmdObj, JsonObjectPtr &aAnswer)
   {
-    if (aJSONAnswer) {
-      LOG(LOG_DEBUG, "Replying with JSON answer: '%s'", aJSONAnswer->json_c_str());
-      puts(aJSONAnswer->json_c_str());
-    }
+    ErrorPtr err;
+    aAnswer = property(aParams, err);
+    return err;
   }
 
 
-  void answerAndTerminate(JsonObjectPtr aJSONAnswer)
+  ErrorPtr cmd_alert(JsonObjectPtr aParams, JsonObjectPtr aCmdObj, JsonObjectPtr &aAnswer)
   {
-    answer(aJSONAnswer);
-    terminateApp(EXIT_SUCCESS);
+    ErrorPtr err;
+    aAnswer = alert_from_ui(aParams, err);
+    return err;
   }
 
 
-  virtual ErrorPtr handleJSONCmd(string aCmd, JsonObjectPtr aParams, JsonObjectPtr aCmdObj, JsonObjectPtr& aAnswer)
+  ErrorPtr cmd_flushcaches(JsonObjectPtr aParams, JsonObjectPtr aCmdObj, JsonObjectPtr &aAnswer)
   {
-    ErrorPtr err;
+    flushCaches();
+    aAnswer = emptyAnswer();
+    return ErrorPtr();
+  }
 
-    // decode command
-    if (aCmd=="restart") {
-      aAnswer = restart_from_ui(err, false);
-    }
-    else if (aCmd=="poweroff") {
-      aAnswer = restart_from_ui(err, true);
-    }
-    else if (aCmd=="configbackup") {
-      config_backup(err);
-    }
-    else if (aCmd=="configrestoreprep") {
-      aAnswer = config_restore_prep(aCmdObj, err); // uploadedfile is not a uri_param nor post data, but one level up
-    }
-    else if (aCmd=="configrestoreapply") {
-      aAnswer = config_restore_apply(aParams, err);
-    }
-    #if !BUILDENV_DIGIESP
-    else if (aCmd=="tzconfig") {
-      aAnswer = timezoneconfig(aParams, err);
-    }
-    else if (aCmd=="wificonfig") {
-      aAnswer = wificonfig(aParams, err);
-    }
-    #endif // !BUILDENV_DIGIESP
-    else if (aCmd=="ipconfig") {
-      aAnswer = ipconfig(aParams, err);
-    }
-    else if (aCmd=="setpassword") {
-      aAnswer = setpassword(aParams, err);
-    }
-    else if (aCmd=="factoryreset") {
-      aAnswer = factory_reset_from_ui(aParams, err);
-    }
-    else if (aCmd=="devinfo") {
-      aAnswer = devinfo(err);
-    }
-    else if (aCmd=="userlevel") {
-      aAnswer = userlevelaccess(aParams, err);
-    }
-    else if (aCmd=="property") {
-      aAnswer = property(aParams, err);
-    }
-    else if (aCmd=="alert") {
-      aAnswer = alert_from_ui(aParams, err);
-    }
-    else {
-      err = ErrorPtr(new Error(1,"Unknown 'cmd'"));
-    }
+
+  // check flash files against the stored checksums, "mode":"update" to store the current ones instead
+  ErrorPtr cmd_verify(JsonObjectPtr aParams, JsonObjectPtr aCmdObj, JsonObjectPtr &aAnswer)
+  {
+    ErrorPtr err;
+    aAnswer = verify(aParams, err);
     return err;
   }
 
 
-  void processJSON(const char *aJSONCommand)
+  ErrorPtr cmd_serialconvert(JsonObjectPtr aParams, JsonObjectPtr aCmdObj, JsonObjectPtr &aAnswer)
   {
-    LOG(LOG_DEBUG, "Received command line JSON call: '%s'", aJSONCommand);
-    JsonObjectPtr cmdObj = JsonObject::objFromText(aJSONCommand);
     ErrorPtr err;
-    JsonObjectPtr answer;
-    if (cmdObj) {
-      // { "method":"GET", "uri":"aga", "uri_params": {"cmd": "ipconfig", "ipaddr": "1.2.3.4", "netmask": "255.255.255.0", "dhcp": 0, "gw":"1.2.3.1" } }
-      // { "method":"POST", "uri":"aga", "data": {"cmd": "ipconfig", "ipaddr": "1.2.3.4", "netmask": "255.255.255.0", "dhcp": 0, "gw":"1.2.3.1" } }
-      // extract actual JSON request data
-      // - try POST data first
-      JsonObjectPtr params = cmdObj->get("data");
-      if (!params) {
-        // no POST data, try uri_params
-        params = cmdObj->get("uri_params");
-      }
-      // - extract command
-      string cmd;
-      if (checkStringParam(params, "cmd", cmd)) {
-        // handle command
-        err = handleJSONCmd(cmd, params, cmdObj, answer);
-      }
-      else {
-        err = ErrorPtr(new Error(1,"Missing 'cmd'"));
-      }
-    }
-    else {
-      err = ErrorPtr(new Error(1,"Cannot decode JSON"));
-    }
-    if (!Error::isOK(err)) {
-      // generate error message answer
-      answer = makeErrorAnswer(err);
-    }
-    // return error or result answer if any
-    if (answer) {
-      answerAndTerminate(answer);
+    serialconvert(aParams, err);
+    return err;
+  }
+
+
+  // flash write counters per command since boot, "reset":true to restart counting
+  ErrorPtr cmd_flashstats(JsonObjectPtr aParams, JsonObjectPtr aCmdObj, JsonObjectPtr &aAnswer)
+  {
+    JsonObjectPtr o;
+    FlashWriter::CountersMap stats;
+    FlashWriter::readStats(stats, aParams->get("reset", o) && o->boolValue());
+    JsonWriter w;
+    w.beginObject().key("result").beginObject();
+    FlashWriter::Counters total = { 0, 0, 0 };
+    for (FlashWriter::CountersMap::const_iterator pos = stats.begin(); pos!=stats.end(); ++pos) {
+      w.key(pos->first).beginObject();
+      w.addInt("files", pos->second.files).addInt("bytes", pos->second.bytes).addInt("skipped", pos->second.skipped);
+      w.endObject();
+      total.files += pos->second.files;
+      total.bytes += pos->second.bytes;
+      total.skipped += pos->second.skipped;
     }
+    w.key("_total").beginObject();
+    w.addInt("files", total.files).addInt("bytes", total.bytes).addInt("skipped", total.skipped);
+    w.endObject();
+    w.endObject().endObject();
+    answerAndTerminate(w);
+    return ErrorPtr();
   }
 
 
@@ -1344,58 +5636,94 @@ public:
 
   JsonObjectPtr timezoneconfig(JsonObjectPtr aUriParams, ErrorPtr &err)
   {
-    // check for parameters to set
-    string tzcmd;
+    const TimezoneCatalog &catalog = TimezoneCatalog::catalog();
+    // check for catalog queries
     JsonObjectPtr o;
+    if (aUriParams->get("list", o)) {
+      // list zone names, optionally only those starting with a prefix (e.g. "Europe/")
+      string prefix;
+      if (o->isType(json_type_string)) prefix = o->stringValue();
+      size_t first, end;
+      catalog.withPrefix(prefix, first, end);
+      JsonObjectPtr zones = JsonObject::newArray();
+      for (size_t i=first; i<end; i++) {
+        zones->arrayAppend(JsonObject::newString(timezones[i].tzname));
+      }
+      JsonObjectPtr result = JsonObject::newObj();
+      result->add("timezones", zones);
+      return makeAnswer(result);
+    }
+    if (aUriParams->get("timezonespec", o)) {
+      // list zone names using a given POSIX TZ spec
+      vector<const TZInfo *> found;
+      catalog.withSpec(o->stringValue(), found);
+      JsonObjectPtr zones = JsonObject::newArray();
+      for (size_t i=0; i<found.size(); i++) {
+        zones->arrayAppend(JsonObject::newString(found[i]->tzname));
+      }
+      JsonObjectPtr result = JsonObject::newObj();
+      result->add("timezones", zones);
+      return makeAnswer(result);
+    }
+    // check for parameters to set
     if (aUriParams->get("timezonename", o)) {
       // search for time zone spec
       string tzName = o->stringValue();
       const char *tzSpec = NULL;
-      const TZInfo *tzP = timezones;
-      while (tzP->tzname) {
-        if (tzName==tzP->tzname) {
-          tzSpec = tzP->tzspec;
-          break;
-        }
-        tzP++;
+      const TZInfo *tzP = catalog.find(tzName);
+      if (tzP) {
+        tzSpec = tzP->tzspec;
       }
       if (!tzSpec) {
         err = ErrorPtr(new Error(1,"Unknown time zone name"));
       }
+      else if (!mUciPath.empty()) {
+        // set in-process
+        resultsChanged();
+        FlashUciConfig uci(mUciPath);
+        err = uci.set("system.@system[0].zonename", tzName);
+        if (Error::isOK(err)) err = uci.set("system.@system[0].timezone", tzSpec);
+        if (Error::isOK(err)) err = uci.commit();
+        if (Error::isOK(err) && uciIsLive()) {
+          // live config: also activate for processes started from now on
+          err = string_tofile(TZ_FILE, string(tzSpec)+"\n");
+        }
+        if (Error::isOK(err)) answerAndTerminate(emptyAnswer());
+      }
       else {
-        // set
+        // set via uci command line tool
         #if BUILDENV_XCODE || BUILDENV_GENERIC
         answerAndTerminate(emptyAnswer());
         #else
-        tzcmd = string_format(
-          "uci set system.@system[0].zonename='%s';"
-          "uci set system.@system[0].timezone='%s';"
-          "uci commit system;"
-          "echo $(uci -q get system.@system[0].timezone) >/tmp/TZ",
-          tzName.c_str(),
-          tzSpec
-        );
-        MainLoop::currentMainLoop().fork_and_system(
-          boost::bind(&P44maintd::tzset_done, this, _1, _2),
-          tzcmd.c_str(),
-          true, NULL, // capture output to prevent output going to mg44
-          0 // mute stderr
-        );
+        HelperSequence tzcmds;
+        HelperArgs uci(1, "uci");
+        uci.push_back("set");
+        uci.push_back("system.@system[0].zonename=" + tzName);
+        tzcmds.push_back(uci);
+        uci.back() = string("system.@system[0].timezone=") + tzSpec;
+        tzcmds.push_back(uci);
+        uci.back() = "system";
+        uci[1] = "commit";
+        tzcmds.push_back(uci);
+        runHelpers(boost::bind(&P44maintd::tzset_done, this, string(tzSpec), _1, _2), tzcmds);
         #endif
       }
     }
+    else if (!mUciPath.empty()) {
+      // show current time zone, read in-process
+      FlashUciConfig uci(mUciPath);
+      string tzName;
+      uci.get("system.@system[0].zonename", tzName);
+      tzget_done(ErrorPtr(), tzName);
+    }
     else {
       // show current time zone
       #if BUILDENV_XCODE || BUILDENV_GENERIC
       // fake answer
       tzget_done(err, "Europe/Zurich");
       #else
-      MainLoop::currentMainLoop().fork_and_system(
-        boost::bind(&P44maintd::tzget_done, this, _1, _2),
-        "uci -q get system.@system[0].zonename",
-        true, NULL, // capture output to prevent output going to mg44
-        0 // mute stderr
-      );
+      const char *uciget[] = { "uci", "-q", "get", "system.@system[0].zonename" };
+      runHelper(boost::bind(&P44maintd::tzget_done, this, _1, _2), HelperArgs(uciget, uciget+4));
       #endif
     }
     return JsonObjectPtr();
@@ -1404,15 +5732,22 @@ public:
 
   void tzget_done(ErrorPtr err, const string &aAnswer)
   {
+    if (Error::notOK(err)) mResultKey.clear(); // do not cache failed query
     JsonObjectPtr result = JsonObject::newObj();
-    result->add("timezonename", JsonObject::newString(trimWhiteSpace(aAnswer)));
+    string tzName = trimWhiteSpace(aAnswer);
+    result->add("timezonename", JsonObject::newString(tzName));
+    const TZInfo *tzP = TimezoneCatalog::catalog().find(tzName);
+    if (tzP) result->add("timezonespec", JsonObject::newString(tzP->tzspec));
     answerAndTerminate(makeAnswer(result));
   }
 
 
 
-  void tzset_done(ErrorPtr err, const string &aAnswer)
+  void tzset_done(string aTzSpec, ErrorPtr err, const string &aAnswer)
   {
+    resultsChanged();
+    // activate for processes started from now on
+    string_tofile(TZ_FILE, aTzSpec+"\n");
     // TZ successfully set, report success to Web UI
     answerAndTerminate(emptyAnswer());
   }
@@ -1425,7 +5760,29 @@ public:
   // MARK: ===== network configuration
 
 
-  bool addSetIpCmd(string &aSetIp, JsonObjectPtr aUriParams, const char *aBootVarName)
+  // command setting one IP config variable
+  static HelperArgs ipSetCmd(const string &aVarName, const string &aValue)
+  {
+    HelperArgs a;
+    #if BUILDENV_DIGIESP
+    a.push_back("ubootenv");
+    a.push_back("--set");
+    a.push_back(aVarName + "=" + aValue);
+    #elif BUILDENV_XCODE || BUILDENV_GENERIC
+    a.push_back("echo");
+    a.push_back("set");
+    a.push_back(aVarName + "=" + aValue);
+    #else
+    // standard way is via p44ipconf
+    a.push_back("p44ipconf");
+    a.push_back(aVarName);
+    a.push_back(aValue);
+    #endif
+    return a;
+  }
+
+
+  bool addSetIpCmd(HelperSequence &aSetIp, JsonObjectPtr aUriParams, const char *aBootVarName)
   {
     JsonObjectPtr o = aUriParams->get(aBootVarName);
     if (o) {
@@ -1435,14 +5792,7 @@ public:
       int result = inet_pton(AF_INET, ipval.c_str(), &(sa.sin_addr));
       if (result==0) return false; // invalid IP
       // is valid
-      #if BUILDENV_DIGIESP
-      aSetIp += string_format("ubootenv --set '%s=%s';",aBootVarName, ipval.c_str());
-      #elif BUILDENV_XCODE || BUILDENV_GENERIC
-      aSetIp += string_format("echo set %s=%s; ",aBootVarName, ipval.c_str());
-      #else
-      // standard way is via p44ipconf
-      aSetIp += string_format("p44ipconf %s %s;", aBootVarName, ipval.c_str());
-      #endif
+      aSetIp.push_back(ipSetCmd(aBootVarName, ipval));
     }
     // no or valid IP
     return true;
@@ -1451,53 +5801,47 @@ public:
 
   JsonObjectPtr ipconfig(JsonObjectPtr aUriParams, ErrorPtr &err)
   {
+    #if !BUILDENV_DIGIESP
+    if (!mUciPath.empty()) return uciIpconfig(aUriParams, err);
+    #endif
     // check for parameters to set
-    string setcmd;
+    HelperSequence setcmds;
     JsonObjectPtr o = aUriParams->get("dhcp");
     if (o) {
       // dhcp flag must be there or else we consider this only a query for current values
       bool ok = true;
       bool dhcp = o->boolValue();
       // first set DHCP flag
-      #if BUILDENV_DIGIESP
-      setcmd = string_format("ubootenv --set 'dhcp=%s';", dhcp ? "on" : "off");
-      #elif BUILDENV_XCODE || BUILDENV_GENERIC
-      setcmd = string_format("echo set dhcp=%s; ", dhcp ? "on" : "off");
+      #if BUILDENV_OPENWRT
+      setcmds.push_back(ipSetCmd("dhcp", dhcp ? "1" : "0"));
       #else
-      // standard way is via p44ipconf
-      setcmd = string_format("p44ipconf dhcp %d;", dhcp ? 1 : 0);
+      setcmds.push_back(ipSetCmd("dhcp", dhcp ? "on" : "off"));
       #endif
       // Set IP addresses
       if (!dhcp) {
         // manual IP
         ok = ok &&
-          addSetIpCmd(setcmd, aUriParams, "ipaddr") &&
-          addSetIpCmd(setcmd, aUriParams, "netmask") &&
-          addSetIpCmd(setcmd, aUriParams, "gatewayip");
+          addSetIpCmd(setcmds, aUriParams, "ipaddr") &&
+          addSetIpCmd(setcmds, aUriParams, "netmask") &&
+          addSetIpCmd(setcmds, aUriParams, "gatewayip");
       }
       // always set DNS IPs
       ok = ok &&
-        addSetIpCmd(setcmd, aUriParams, "dnsip") &&
-        addSetIpCmd(setcmd, aUriParams, "dnsip2");
+        addSetIpCmd(setcmds, aUriParams, "dnsip") &&
+        addSetIpCmd(setcmds, aUriParams, "dnsip2");
       // add ipv6
       bool ipv6 = false;
       if (aUriParams->get("ipv6", o)) {
         ipv6 = o->boolValue();
-        setcmd += string_format("p44ipconf ipv6 %d;", ipv6);
+        setcmds.push_back(ipSetCmd("ipv6", ipv6 ? "1" : "0"));
       }
       #if BUILDENV_OPENWRT
       // need to commit
-      setcmd += "p44ipconf commit now";
+      setcmds.push_back(ipSetCmd("commit", "now"));
       #endif
-      // now execute the set command
-      LOG(LOG_DEBUG,"Executing IP config commands: %s", setcmd.c_str());
+      // now execute the set commands
       if (ok) {
-        MainLoop::currentMainLoop().fork_and_system(
-          boost::bind(&P44maintd::cfgset_done, this, _1, _2),
-          setcmd.c_str(),
-          true, NULL, // capture output to prevent output going to mg44
-          0 // mute stderr
-        );
+        runHelpers(boost::bind(&P44maintd::cfgset_done, this, _1, _2), setcmds);
         return JsonObjectPtr(); // no answer now, but later when we get data
       }
       else {
@@ -1507,75 +5851,208 @@ public:
       }
     }
     else {
-      // query only
-      MainLoop::currentMainLoop().fork_and_system(
-        boost::bind(&P44maintd::ipquery_done, this, _1, _2),
-        #if BUILDENV_DIGIESP
-        "echo -n currentip=;ifconfig | sed -n -e 's/:127\\.0\\.0\\.1 //g' -e 's/ *inet addr:\\([0-9.]\\+\\).*/\\1/gp';/sbin/ubootenv --print 'dhcp ipaddr netmask gatewayip dnsip dnsip2'"
-        #elif BUILDENV_XCODE
-        "echo 'currentip=123.45.67.89'; echo 'dhcp=on'; echo 'ipv6=1'; echo 'ipaddr=192.168.42.99'; echo 'netmask=255.255.255.0'; echo 'gatewayip=192.168.42.1'; echo 'dnsip=8.8.8.8'; echo 'dnsip2=0.0.0.0'"
-        #elif BUILDENV_GENERIC
-        "echo 'currentip=123.42.42.42'; echo 'dhcp=on'; echo 'ipaddr=192.168.42.98'; echo 'netmask=255.255.255.0'; echo 'gatewayip=192.168.42.1'; echo 'dnsip=2.2.2.2'; echo 'dnsip2=0.0.0.0'"
-        #else
-        // standard way is via p44ipconf
-        "p44ipconf"
-        #endif
-        , true, NULL, // capture output to prevent output going to mg44
-        0 // mute stderr
-      );
+      // query only: live status comes from netlink, only the persisted config needs an external tool
+      #if BUILDENV_DIGIESP
+      const char *query[] = { "/sbin/ubootenv", "--print", "dhcp ipaddr netmask gatewayip dnsip dnsip2", NULL };
+      #elif BUILDENV_XCODE
+      const char *query[] = { "printf", "%s\\n", "currentip=123.45.67.89", "dhcp=on", "ipv6=1", "ipaddr=192.168.42.99", "netmask=255.255.255.0", "gatewayip=192.168.42.1", "dnsip=8.8.8.8", "dnsip2=0.0.0.0", NULL };
+      #elif BUILDENV_GENERIC
+      const char *query[] = { "printf", "%s\\n", "dhcp=on", "ipaddr=192.168.42.98", "netmask=255.255.255.0", "gatewayip=192.168.42.1", "dnsip=2.2.2.2", "dnsip2=0.0.0.0", NULL };
+      #else
+      // standard way is via p44ipconf
+      const char *query[] = { "p44ipconf", NULL };
+      #endif
+      HelperArgs args;
+      for (const char **q = query; *q; q++) args.push_back(*q);
+      runHelper(boost::bind(&P44maintd::ipquery_done, this, _1, _2), args);
       return JsonObjectPtr(); // no answer now, but later when we get data
     }
   }
 
 
 
-  static string getVar(const string &aStr, const string &aVarName)
+  static boost::string_view cfgValue(const DefsMap &aCfg, boost::string_view aKey, boost::string_view aDefault = boost::string_view())
   {
-    string vn = aVarName + "=";
-    size_t pos = aStr.find(vn);
-    if (pos!=string::npos) {
-      pos+=vn.size();
-      size_t ep = aStr.find("\n",pos);
-      if (ep==string::npos) {
-        ep = aStr.size(); // to the end
-      }
-      return aStr.substr(pos,ep-pos);
+    boost::string_view v;
+    if (!aCfg.get(aKey, v) || v.empty()) return aDefault;
+    return v;
+  }
+
+
+  // parse var=value lines of config tool output in a single pass
+  static void parseConfigVars(const string &aAnswer, DefsMap &aCfg)
+  {
+    DefsParser parser(aAnswer.data(), aAnswer.size());
+    boost::string_view k, v;
+    while (parser.next(k, v)) aCfg.set(k, v);
+  }
+
+
+  void ipquery_done(ErrorPtr aErr, const string &aAnswer)
+  {
+    if (Error::notOK(aErr)) mResultKey.clear(); // do not cache failed query
+    DefsMap cfg;
+    parseConfigVars(aAnswer, cfg);
+    ipAnswer(cfg);
+  }
+
+
+  void ipAnswer(const DefsMap &cfg)
+  {
+    JsonWriter w;
+    w.beginObject().key("result").beginObject();
+    bool liveStatus = false;
+    #if !BUILDENV_XCODE
+    // live status directly from the kernel
+    NetStatus ns;
+    ErrorPtr err = ns.read();
+    if (Error::isOK(err)) {
+      w.addString("currentip", NetStatus::ipv4String(ns.mIPv4)); // 0.0.0.0 when there is no IPv4 address
+      w.addString("currentnetmask", NetStatus::ipv4String(ns.mNetmask));
+      w.addString("currentgatewayip", NetStatus::ipv4String(ns.mGateway));
+      w.addBool("dhcplease", ns.mDhcpLease);
+      w.addString("ipv6_link", ns.mIPv6Link);
+      w.addString("ipv6_global", ns.mIPv6Global);
+      liveStatus = true;
     }
     else {
-      return "";
+      LOG(LOG_WARNING, "Cannot read network status via netlink: %s", err->description().c_str());
+    }
+    #endif
+    if (!liveStatus) {
+      // status as far as reported by the config tool, current IPv4 from the unit otherwise
+      boost::string_view ip = cfgValue(cfg, "currentip");
+      if (ip.empty()) w.addString("currentip", dottedIPv4(ipv4Address()));
+      else w.addString("currentip", ip);
+      w.addString("ipv6_link", cfgValue(cfg, "ipv6_link"));
+      w.addString("ipv6_global", cfgValue(cfg, "ipv6_global"));
     }
+    // persisted config
+    w.addBool("dhcp", cfgValue(cfg, "dhcp")=="on");
+    w.addBool("ipv6", cfgValue(cfg, "ipv6")=="1");
+    w.addString("ipaddr", cfgValue(cfg, "ipaddr", "0.0.0.0"));
+    w.addString("netmask", cfgValue(cfg, "netmask", "0.0.0.0"));
+    w.addString("gatewayip", cfgValue(cfg, "gatewayip", "0.0.0.0"));
+    w.addString("dnsip", cfgValue(cfg, "dnsip", "0.0.0.0"));
+    w.addString("dnsip2", cfgValue(cfg, "dnsip2", "0.0.0.0"));
+    w.endObject().endObject();
+    answerAndTerminate(w);
+  }
+
+
+  #if !BUILDENV_DIGIESP
+
+  static bool validIPv4(const string &aIp)
+  {
+    struct in_addr a;
+    return inet_pton(AF_INET, aIp.c_str(), &a)==1;
   }
 
 
-  static string getIpVar(const string &aStr, const string &aVarName)
+  JsonObjectPtr uciIpconfig(JsonObjectPtr aUriParams, ErrorPtr &err)
   {
-    string v = getVar(aStr, aVarName);
-    if (v.empty()) v="0.0.0.0";
-    return v;
+    FlashUciConfig uci(mUciPath);
+    string iface;
+    getDef(def_PRODUCT_UCI_NETWORK_INTERFACE, iface, DEFAULT_UCI_NETWORK_INTERFACE);
+    iface = "network." + iface + ".";
+    vector<string> dns;
+    if (uci.getList(iface+"dns", dns) && dns.size()==1) {
+      // plain option can contain multiple addresses separated by spaces
+      string all = dns[0];
+      dns.clear();
+      const char *p = all.c_str();
+      string ip;
+      while (nextPart(p, ip, ' ')) if (!ip.empty()) dns.push_back(ip);
+    }
+    JsonObjectPtr o = aUriParams->get("dhcp");
+    if (!o) {
+      // query only
+      DefsMap cfg;
+      string v;
+      if (uci.get(iface+"proto", v)) cfg.set("dhcp", v=="dhcp" ? "on" : "off");
+      cfg.set("ipv6", uci.get(iface+"ipv6", v) ? v : "1"); // OpenWrt enables IPv6 unless explicitly disabled
+      if (uci.get(iface+"ipaddr", v)) cfg.set("ipaddr", v);
+      if (uci.get(iface+"netmask", v)) cfg.set("netmask", v);
+      if (uci.get(iface+"gateway", v)) cfg.set("gatewayip", v);
+      if (dns.size()>0) cfg.set("dnsip", dns[0]);
+      if (dns.size()>1) cfg.set("dnsip2", dns[1]);
+      ipAnswer(cfg);
+      return JsonObjectPtr(); // already answered
+    }
+    // collect all changes
+    bool ok = true;
+    bool dhcp = o->boolValue();
+    err = uci.set(iface+"proto", dhcp ? "dhcp" : "static");
+    if (!dhcp) {
+      // manual IP
+      static const char * const ipParams[] = { "ipaddr", "netmask", "gatewayip", NULL };
+      for (const char * const *pp = ipParams; *pp && ok && Error::isOK(err); pp++) {
+        if (aUriParams->get(*pp, o)) {
+          string ip = o->stringValue();
+          ok = validIPv4(ip);
+          if (ok) err = uci.set(iface + (strcmp(*pp, "gatewayip")==0 ? "gateway" : *pp), ip);
+        }
+      }
+    }
+    // always set DNS IPs
+    for (int i=0; i<2 && ok; i++) {
+      if (aUriParams->get(i==0 ? "dnsip" : "dnsip2", o)) {
+        string ip = o->stringValue();
+        ok = validIPv4(ip);
+        if (dns.size()<=(size_t)i) dns.resize(i+1);
+        dns[i] = ip;
+      }
+    }
+    if (ok && Error::isOK(err)) {
+      vector<string> used;
+      for (size_t i=0; i<dns.size(); i++) {
+        if (!dns[i].empty() && dns[i]!="0.0.0.0") used.push_back(dns[i]);
+      }
+      err = used.empty() ? uci.unset(iface+"dns") : uci.setList(iface+"dns", used);
+    }
+    if (aUriParams->get("ipv6", o) && Error::isOK(err)) {
+      err = uci.set(iface+"ipv6", o->boolValue() ? "1" : "0");
+    }
+    if (!ok) {
+      err = ErrorPtr(new Error(415, "Invalid IP address parameters"));
+      return makeErrorAnswer(err); // error
+    }
+    // commit all at once
+    if (Error::isOK(err)) err = uci.commit();
+    if (Error::isOK(err)) activateUciChanges();
+    return JsonObjectPtr();
   }
 
 
+  // @return true if mUciPath is the system's live UCI config directory, also when specified by
+  //   another path (symlink, bind mount) to it
+  bool uciIsLive()
+  {
+    if (mUciPath.empty() || !*DEFAULT_UCI_PATH) return false;
+    struct stat cur, live;
+    if (stat(mUciPath.c_str(), &cur)<0 || stat(DEFAULT_UCI_PATH, &live)<0) return false;
+    return cur.st_dev==live.st_dev && cur.st_ino==live.st_ino;
+  }
 
-  void ipquery_done(ErrorPtr aErr, const string &aAnswer)
+
+  // make committed UCI changes effective, answers when done
+  void activateUciChanges()
   {
-    // separate elements
-    JsonObjectPtr result = JsonObject::newObj();
-    result->add("currentip", JsonObject::newString(getDef("STATUS_IPV4")));
-    result->add("dhcp", JsonObject::newBool(getVar(aAnswer, "dhcp")=="on"));
-    result->add("ipv6", JsonObject::newBool(getVar(aAnswer, "ipv6")=="1"));
-    result->add("ipaddr", JsonObject::newString(getIpVar(aAnswer, "ipaddr")));
-    result->add("ipv6_link", JsonObject::newString(getVar(aAnswer, "ipv6_link")));
-    result->add("ipv6_global", JsonObject::newString(getVar(aAnswer, "ipv6_global")));
-    result->add("netmask", JsonObject::newString(getIpVar(aAnswer, "netmask")));
-    result->add("gatewayip", JsonObject::newString(getIpVar(aAnswer, "gatewayip")));
-    result->add("dnsip", JsonObject::newString(getIpVar(aAnswer, "dnsip")));
-    result->add("dnsip2", JsonObject::newString(getIpVar(aAnswer, "dnsip2")));
-    answerAndTerminate(makeAnswer(result));
+    if (!uciIsLive()) {
+      // not the live config (e.g. test fixtures), nothing to reload
+      cfgset_done(ErrorPtr(), "");
+      return;
+    }
+    const char *reload[] = { "/etc/init.d/network", "reload" }; // also reconfigures wireless
+    runHelper(boost::bind(&P44maintd::cfgset_done, this, _1, _2), HelperArgs(reload, reload+2));
   }
 
+  #endif // !BUILDENV_DIGIESP
+
 
   void cfgset_done(ErrorPtr err, const string &aAnswer)
   {
+    resultsChanged(); // also when failed, changes might be partially applied
     // IP parameters successfully set, report success to Web UI
     answerAndTerminate(emptyAnswer());
   }
@@ -1585,72 +6062,144 @@ public:
 
   #if !BUILDENV_DIGIESP
 
+  // command setting one wifi config variable, values are passed verbatim (no shell quoting involved)
+  static HelperArgs wifiSetCmd(const string &aVarName, const string &aValue)
+  {
+    HelperArgs a;
+    #if BUILDENV_XCODE || BUILDENV_GENERIC
+    a.push_back("echo");
+    a.push_back("p44wificonf");
+    #else
+    a.push_back("p44wificonf");
+    #endif
+    a.push_back(aVarName);
+    a.push_back(aValue);
+    return a;
+  }
+
+
   JsonObjectPtr wificonfig(JsonObjectPtr aUriParams, ErrorPtr &err)
   {
+    if (!mUciPath.empty()) return uciWificonfig(aUriParams, err);
     // check for parameters to set
-    string setcmd;
+    HelperSequence setcmds;
     string iface = "cli";
-    bool changes = false;
     for (int i = 0; i<2; i++) {
       JsonObjectPtr ifparams = aUriParams->get(iface.c_str());
       if (ifparams) {
-        changes = true;
         JsonObjectPtr o;
-        o = ifparams->get("enabled"); if (o) setcmd += string_format(" p44wificonf %s %d;", iface.c_str(), o->boolValue() ? 1 : 0);
-        o = ifparams->get("ssid"); if (o) setcmd += string_format(" p44wificonf %s_ssid '%s';", iface.c_str(), o->stringValue().c_str());
-        o = ifparams->get("encryption"); if (o) setcmd += string_format(" p44wificonf %s_encryption '%s';", iface.c_str(), o->stringValue().c_str());
-        o = ifparams->get("key"); if (o) setcmd += string_format(" p44wificonf %s_key '%s';", iface.c_str(), o->stringValue().c_str());
+        o = ifparams->get("enabled"); if (o) setcmds.push_back(wifiSetCmd(iface, o->boolValue() ? "1" : "0"));
+        o = ifparams->get("ssid"); if (o) setcmds.push_back(wifiSetCmd(iface + "_ssid", o->stringValue()));
+        o = ifparams->get("encryption"); if (o) setcmds.push_back(wifiSetCmd(iface + "_encryption", o->stringValue()));
+        o = ifparams->get("key"); if (o) setcmds.push_back(wifiSetCmd(iface + "_key", o->stringValue()));
       }
       iface = "ap";
     }
-    if (changes) {
+    if (!setcmds.empty()) {
       // apply them
-      setcmd += " p44wificonf commit now";
-      #if BUILDENV_XCODE || BUILDENV_GENERIC
-      setcmd = "echo "+shellQuote(setcmd)+" >/tmp/p44maint_p44wificonf";
-      #endif
-      // now execute the set command
-      LOG(LOG_DEBUG,"Executing Wifi config commands: %s", setcmd.c_str());
-      MainLoop::currentMainLoop().fork_and_system(
-        boost::bind(&P44maintd::cfgset_done, this, _1, _2),
-        setcmd.c_str(),
-        true, NULL, // capture output to prevent output going to mg44
-        0 // mute stderr
-      );
+      setcmds.push_back(wifiSetCmd("commit", "now"));
+      // now execute the set commands
+      runHelpers(boost::bind(&P44maintd::cfgset_done, this, _1, _2), setcmds);
       return JsonObjectPtr(); // no answer now, but later when we get data
     }
     else {
       // query only
-      MainLoop::currentMainLoop().fork_and_system(
-        boost::bind(&P44maintd::wifiquery_done, this, _1, _2),
-        #if BUILDENV_XCODE || BUILDENV_GENERIC
-        "echo 'cli=1'; echo 'cli_ssid=DUMMY'; echo 'cli_key=supersecret'; echo 'cli_encryption=psk2'; echo 'ap=0'; echo 'ap_ssid=AP_DUMMY'; echo 'ap_key='; echo 'ap_encryption=none';"
-        #else
-        // standard way is via p44ipconf
-        "p44wificonf"
-        #endif
-        , true, NULL, // capture output to prevent output going to mg44
-        0 // mute stderr
-      );
+      #if BUILDENV_XCODE || BUILDENV_GENERIC
+      const char *query[] = { "printf", "%s\\n", "cli=1", "cli_ssid=DUMMY", "cli_key=supersecret", "cli_encryption=psk2", "ap=0", "ap_ssid=AP_DUMMY", "ap_key=", "ap_encryption=none", NULL };
+      #else
+      // standard way is via p44wificonf
+      const char *query[] = { "p44wificonf", NULL };
+      #endif
+      HelperArgs args;
+      for (const char **q = query; *q; q++) args.push_back(*q);
+      runHelper(boost::bind(&P44maintd::wifiquery_done, this, _1, _2), args);
       return JsonObjectPtr(); // no answer now, but later when we get data
     }
   }
 
   void wifiquery_done(ErrorPtr aErr, const string &aAnswer)
   {
-    // separate elements
-    JsonObjectPtr result = JsonObject::newObj();
+    if (Error::notOK(aErr)) mResultKey.clear(); // do not cache failed query
+    DefsMap cfg;
+    parseConfigVars(aAnswer, cfg);
+    wifiAnswer(cfg);
+  }
+
+
+  void wifiAnswer(const DefsMap &cfg)
+  {
+    JsonWriter w;
+    w.beginObject().key("result").beginObject();
     string iface = "cli";
     for (int i=0; i<2; i++) {
-      JsonObjectPtr ifparams = JsonObject::newObj();
-      ifparams->add("enabled", JsonObject::newBool(getVar(aAnswer, iface)=="1"));
-      ifparams->add("ssid", JsonObject::newString(getVar(aAnswer, iface+"_ssid")));
-      ifparams->add("encryption", JsonObject::newString(getVar(aAnswer, iface+"_encryption")));
-      ifparams->add("key", JsonObject::newString(getVar(aAnswer, iface+"_key")));
-      result->add(iface.c_str(), ifparams);
+      w.key(iface).beginObject();
+      w.addBool("enabled", cfgValue(cfg, iface)=="1");
+      w.addString("ssid", cfgValue(cfg, iface+"_ssid"));
+      w.addString("encryption", cfgValue(cfg, iface+"_encryption"));
+      w.addString("key", cfgValue(cfg, iface+"_key"));
+      w.endObject();
       iface = "ap";
     }
-    answerAndTerminate(makeAnswer(result));
+    w.endObject().endObject();
+    answerAndTerminate(w);
+  }
+
+
+  // UCI section of the wifi client ("cli") or access point ("ap") interface
+  // @return section path, empty if there is no such interface
+  static string wifiSection(UciConfig &aUci, const string &aIface)
+  {
+    // named section, or first wifi-iface in matching mode
+    string mode;
+    if (aUci.get("wireless."+aIface+".mode", mode)) return "wireless."+aIface;
+    return aUci.findSection("wireless", "wifi-iface", "mode", aIface=="cli" ? "sta" : "ap");
+  }
+
+
+  JsonObjectPtr uciWificonfig(JsonObjectPtr aUriParams, ErrorPtr &err)
+  {
+    static const char * const wifiOptions[] = { "ssid", "encryption", "key", NULL };
+    FlashUciConfig uci(mUciPath);
+    DefsMap cfg;
+    bool changes = false;
+    string iface = "cli";
+    for (int i=0; i<2 && Error::isOK(err); i++) {
+      string sec = wifiSection(uci, iface);
+      JsonObjectPtr ifparams = aUriParams->get(iface.c_str());
+      if (ifparams) {
+        // set
+        changes = true;
+        if (sec.empty()) {
+          err = ErrorPtr(new Error(1, "No '" + iface + "' wifi interface configured"));
+          break;
+        }
+        JsonObjectPtr o;
+        if (ifparams->get("enabled", o)) err = uci.set(sec+".disabled", o->boolValue() ? "0" : "1");
+        for (const char * const *pp = wifiOptions; *pp && Error::isOK(err); pp++) {
+          if (ifparams->get(*pp, o)) err = uci.set(sec+"."+*pp, o->stringValue());
+        }
+      }
+      else if (!sec.empty()) {
+        // collect for query
+        string v;
+        cfg.set(iface, uci.get(sec+".disabled", v) && v=="1" ? "0" : "1");
+        for (const char * const *pp = wifiOptions; *pp; pp++) {
+          if (uci.get(sec+"."+*pp, v)) cfg.set(iface+"_"+*pp, v);
+        }
+      }
+      iface = "ap";
+    }
+    if (Error::isOK(err)) {
+      if (!changes) {
+        wifiAnswer(cfg);
+      }
+      else {
+        // commit all at once
+        err = uci.commit();
+        if (Error::isOK(err)) activateUciChanges();
+      }
+    }
+    return JsonObjectPtr();
   }
 
   #endif // !BUILDENV_DIGIESP
@@ -1662,57 +6211,151 @@ public:
   // show device info as text on console
   void showDeviceInfo()
   {
-    printf("Model       : %s\n", getDef("PRODUCT_MODEL").c_str());
-    printf("Variant     : %s\n", getDef("PRODUCT_VARIANT").c_str());
-    printf("Producer    : %s\n", getDef("PRODUCER").c_str());
-    printf("GTIN        : %s\n", getDef("PRODUCT_GTIN").c_str());
-    printf("Serial      : %s\n", getDef("UNIT_SERIALNO").c_str());
-    printf("Platform    : %s\n", getDef("PLATFORM_NAME").c_str());
-    printf("OS          : %s\n", getDef("PLATFORM_OS_IDENTIFIER").c_str());
-    printf("Firmware    : %s_%s\n", getDef("FIRMWARE_VERSION").c_str(), getDef("FIRMWARE_FEED").c_str());
-    printf("hostname    : %s\n", getDef("UNIT_HOSTNAME").c_str());
-    printf("IPv4        : %s\n", getDef("STATUS_IPV4").c_str());
+    printf("Model       : %s\n", getDef(def_PRODUCT_MODEL).c_str());
+    printf("Variant     : %s\n", getDef(def_PRODUCT_VARIANT).c_str());
+    printf("Producer    : %s\n", getDef(def_PRODUCER).c_str());
+    printf("GTIN        : %s\n", getDef(def_PRODUCT_GTIN).c_str());
+    printf("Serial      : %s\n", getDef(def_UNIT_SERIALNO).c_str());
+    printf("Platform    : %s\n", getDef(def_PLATFORM_NAME).c_str());
+    printf("OS          : %s\n", getDef(def_PLATFORM_OS_IDENTIFIER).c_str());
+    printf("Firmware    : %s_%s\n", getDef(def_FIRMWARE_VERSION).c_str(), getDef(def_FIRMWARE_FEED).c_str());
+    printf("hostname    : %s\n", getDef(def_UNIT_HOSTNAME).c_str());
+    printf("IPv4        : %s\n", getDef(def_STATUS_IPV4).c_str());
+    fflush(stdout);
+    profileToStderr();
     terminateApp(EXIT_SUCCESS);
   }
 
 
   void showDefs()
   {
-    for (DefsMap::iterator pos = mDefs.begin(); pos!=mDefs.end(); pos++) {
-      printf("%s=%s\n", pos->first.c_str(), shellQuote(pos->second).c_str());
+    ShellVarWriter w;
+    for (DefsMap::Iterator i(mDefs); i.valid(); i.next()) {
+      w.assignment(i.key(), i.value());
     }
+    w.flush(STDOUT_FILENO);
+    logAllocations("showDefs");
+    profileToStderr();
     terminateApp(EXIT_SUCCESS);
   }
 
 
-
-  // return device info as JSON for web interface
-  JsonObjectPtr devinfo(ErrorPtr &err)
+
+  // write device info as JSON object for web interface
+  void devinfo(JsonWriter &aWriter)
+  {
+    aWriter.beginObject();
+    for (DefsMap::Iterator i(mDefs); i.valid(); i.next()) {
+      aWriter.addString(i.key(), i.value());
+    }
+    // add time
+    aWriter.addInt("timetick", time(NULL));
+    struct tm t;
+    MainLoop::mainLoopTimeTolocalTime(MainLoop::now(), t);
+    aWriter.addInt("localtimetick", time(NULL)+t.tm_gmtoff);
+    // uptime
+    int uptime = -1;
+    #if BUILDENV_XCODE || BUILDENV_GENERIC
+    uptime = 352800; // 4 days and 2 hours
+    #else
+    struct sysinfo info;
+    sysinfo(&info);
+    uptime = info.uptime;
+    #endif
+    aWriter.addInt("uptime", uptime);
+    aWriter.endObject();
+  }
+
+
+
+  // MARK: ===== serial number conversion
+
+  // convert serial number to MAC address or vice versa, detected by format
+  // (MAC addresses have 12 hex digits, serial numbers are decimal and never have more than 10 digits)
+  // @return false if aText is neither a MAC address nor a serial number with a known OUI encoding
+  static bool convertSerialOrMac(boost::string_view aText, string &aConverted)
+  {
+    uint64_t v;
+    if (parseMac(aText, v)) {
+      string_format_append(aConverted, "%llu", (unsigned long long)serialFromMac(v));
+      return true;
+    }
+    if (parseSerial(aText, v) && (v = macFromSerial(v))!=0) {
+      appendMac(aConverted, v);
+      return true;
+    }
+    return false;
+  }
+
+
+  // - "serials":[...] (numbers or decimal strings): answer "macs":[...]
+  // - "macs":[...] (strings, with or without ':' or '-' separators): answer "serials":[...]
+  // entries which cannot be converted are null in the answer
+  void serialconvert(JsonObjectPtr aUriParams, ErrorPtr &err)
+  {
+    JsonObjectPtr list;
+    bool toMac = aUriParams->get("serials", list);
+    if (!toMac && !aUriParams->get("macs", list)) {
+      err = ErrorPtr(new Error(415, "missing 'serials' or 'macs'"));
+      return;
+    }
+    if (!list->isType(json_type_array)) {
+      err = ErrorPtr(new Error(415, "'serials' or 'macs' must be an array"));
+      return;
+    }
+    JsonWriter w;
+    w.beginObject().key("result").beginObject().key(toMac ? "macs" : "serials").beginArray();
+    string v;
+    for (int i=0; i<list->arrayLength(); i++) {
+      JsonObjectPtr o = list->arrayGet(i);
+      uint64_t n;
+      v.clear();
+      if (o && (toMac ? parseSerial(o->stringValue(), n) && (n = macFromSerial(n))!=0 : parseMac(o->stringValue(), n))) {
+        if (toMac) {
+          appendMac(v, n);
+          w.stringValue(v);
+        }
+        else {
+          w.intValue(serialFromMac(n));
+        }
+      }
+      else {
+        w.nullValue();
+      }
+    }
+    w.endArray().endObject().endObject();
+    answerAndTerminate(w);
+  }
+
+
+  // convert serial numbers and MAC addresses read from stdin, one per line, writing one line per input line to stdout
+  // (empty for invalid input)
+  void serialConvertLines()
   {
-    JsonObjectPtr result = JsonObject::newObj();
-    for (DefsMap::iterator pos = mDefs.begin(); pos!=mDefs.end(); pos++) {
-      result->add(pos->first.c_str(), JsonObject::newString(pos->second));
+    string in;
+    char buf[16384];
+    ssize_t n;
+    while ((n = read(STDIN_FILENO, buf, sizeof(buf)))>0 || (n<0 && errno==EINTR)) {
+      if (n>0) in.append(buf, n);
     }
-    // add time
-    result->add("timetick", JsonObject::newInt64(time(NULL)));
-    struct tm t;
-    MainLoop::mainLoopTimeTolocalTime(MainLoop::now(), t);
-    result->add("localtimetick", JsonObject::newInt64(time(NULL)+t.tm_gmtoff));
-    // uptime
-    int uptime = -1;
-    #if BUILDENV_XCODE || BUILDENV_GENERIC
-    uptime = 352800; // 4 days and 2 hours
-    #else
-    struct sysinfo info;
-    sysinfo(&info);
-    uptime = info.uptime;
-    #endif
-    result->add("uptime", JsonObject::newInt64(uptime));
-    return makeAnswer(result);
+    string out;
+    out.reserve(in.size()*2);
+    boost::string_view rest = in;
+    while (!rest.empty()) {
+      size_t e = rest.find('\n');
+      boost::string_view line = rest.substr(0, e);
+      rest.remove_prefix(e==boost::string_view::npos ? rest.size() : e+1);
+      while (!line.empty() && isspace((unsigned char)line.back())) line.remove_suffix(1);
+      while (!line.empty() && isspace((unsigned char)line.front())) line.remove_prefix(1);
+      convertSerialOrMac(line, out);
+      out += '\n';
+    }
+    int status = writeAll(STDOUT_FILENO, out) ? EXIT_SUCCESS : EXIT_FAILURE;
+    profileToStderr();
+    terminateApp(status);
   }
 
 
-
   // MARK: ===== password
 
   JsonObjectPtr setpassword(JsonObjectPtr aUriParams, ErrorPtr &err)
@@ -1720,7 +6363,7 @@ public:
     // check for parameters to set
     JsonObjectPtr o;
     string username;
-    getDef("PRODUCT_WEBADMIN_USER", username,"vdcadmin");
+    getDef(def_PRODUCT_WEBADMIN_USER, username,"vdcadmin");
     // optionally use different user name
     if (aUriParams->get("username", o)) {
       username = o->stringValue();
@@ -1729,9 +6372,8 @@ public:
       string password = o->stringValue();
       // use mg44 to modify global password file
       #if BUILDENV_XCODE || BUILDENV_GENERIC
-      const char *path = "/bin/echo";
       const char *cmd[] = {
-        "echo",
+        "/bin/echo",
         "set user/password to",
         username.c_str(),
         "/",
@@ -1740,10 +6382,9 @@ public:
       };
       #else
       // mg44 -A /flash/webui_authfile P44-xx-xx ${user} ${pw}
-      string model = getDef("PRODUCT_MODEL");
-      const char *path = "/usr/bin/mg44";
+      string model = getDef(def_PRODUCT_MODEL);
       const char *cmd[] = {
-        "mg44",
+        "/usr/bin/mg44",
         "-A", // create/edit auth file
         FLASH_PATH "webui_authfile", // auth file is on user file system
         model.c_str(), // model name as auth domain
@@ -1752,12 +6393,9 @@ public:
         NULL
       };
       #endif
-      MainLoop::currentMainLoop().fork_and_execve(
-        boost::bind(&P44maintd::passwordUpdated, this, _1),
-        path, (char **)cmd, NULL,
-        true, NULL, // capture output to prevent output going to mg44
-        0 // mute stderr
-      );
+      HelperArgs args;
+      for (const char **c = cmd; *c; c++) args.push_back(*c);
+      runHelper(boost::bind(&P44maintd::passwordUpdated, this, _1), args); // capture output to prevent output going to mg44
       return JsonObjectPtr(); // no answer now, but later when we get data
     }
     err = ErrorPtr(new Error(1, "missing password"));
@@ -1767,6 +6405,7 @@ public:
 
   void passwordUpdated(ErrorPtr aError)
   {
+    resultsChanged();
     if (Error::isOK(aError)) {
       answerAndTerminate(emptyAnswer());
     }
@@ -1778,39 +6417,100 @@ public:
 
   // MARK: ===== persistent properties
 
+  static bool validPropertyKey(const string &aKey)
+  {
+    return !aKey.empty() && aKey.find_first_of("/.")==string::npos; // safeguard, keys used to be file names
+  }
+
+
+  static JsonObjectPtr propertyValue(const PropertyStore &aStore, const string &aKey)
+  {
+    string json;
+    if (!aStore.get(lowerCase(aKey), json)) return JsonObjectPtr();
+    return JsonObject::objFromText(json.c_str(), json.size());
+  }
+
+
   // generic key/value JSON property store
+  // - "key" (+ "value" to set, null value to delete) for a single property
+  // - "keys":[...] to get multiple properties, "prefix":"..." to get all properties with keys starting with prefix
+  // - "values":{...} to set multiple properties at once (null values delete)
   JsonObjectPtr property(JsonObjectPtr aUriParams, ErrorPtr &err)
   {
-    JsonObjectPtr o = aUriParams->get("key");
-    if (!o) return emptyAnswer();
-    string key = o->stringValue();
-    if (key.find_first_of("/.")!=string::npos) return emptyAnswer(); // safeguard
-    string file = FLASH_PATH "p44_property_" + lowerCase(key);
-    if (aUriParams->get("value", o, false)) { // do not ignore NULL, we need it for delete
-      if (o) {
-        // set a new value
-        string_tofile(file, o->json_str() + "\n");
+    PropertyStore store(FLASH_PATH);
+    PropertyStore::Changes changes;
+    JsonObjectPtr o;
+    string key;
+    if (aUriParams->get("values", o)) {
+      // set multiple
+      if (!o->isType(json_type_object)) {
+        err = ErrorPtr(new Error(415, "'values' must be an object"));
+        return JsonObjectPtr();
+      }
+      JsonObjectPtr v;
+      o->resetKeyIteration();
+      while (o->nextKeyValue(key, v)) {
+        if (!validPropertyKey(key)) continue;
+        changes.push_back(make_pair(lowerCase(key), v ? v->json_str() : ""));
+      }
+    }
+    else if (aUriParams->get("key", o)) {
+      key = o->stringValue();
+      if (!validPropertyKey(key)) return emptyAnswer();
+      if (aUriParams->get("value", o, false)) { // do not ignore NULL, we need it for delete
+        changes.push_back(make_pair(lowerCase(key), o ? o->json_str() : ""));
       }
       else {
-        // remove the value
-        unlink(file.c_str());
+        // query the current value
+        err = store.load();
+        if (Error::notOK(err)) return JsonObjectPtr();
+        JsonObjectPtr v = propertyValue(store, key);
+        if (v) return makeAnswer(v);
+        return emptyAnswer();
       }
-      return emptyAnswer();
+    }
+    else if (aUriParams->get("keys", o)) {
+      // get multiple, missing ones as null
+      err = store.load();
+      if (Error::notOK(err)) return JsonObjectPtr();
+      JsonObjectPtr result = JsonObject::newObj();
+      for (int i=0; i<o->arrayLength(); i++) {
+        JsonObjectPtr k = o->arrayGet(i);
+        if (!k) continue;
+        key = k->stringValue();
+        result->add(key.c_str(), propertyValue(store, key));
+      }
+      return makeAnswer(result);
+    }
+    else if (aUriParams->get("prefix", o)) {
+      // get all with prefix
+      err = store.load();
+      if (Error::notOK(err)) return JsonObjectPtr();
+      string prefix = lowerCase(o->stringValue());
+      JsonObjectPtr result = JsonObject::newObj();
+      const PropertyStore::ValueMap &values = store.values();
+      for (PropertyStore::ValueMap::const_iterator pos = values.lower_bound(prefix); pos!=values.end() && pos->first.compare(0, prefix.size(), prefix)==0; ++pos) {
+        result->add(pos->first.c_str(), JsonObject::objFromText(pos->second.c_str(), pos->second.size()));
+      }
+      return makeAnswer(result);
     }
     else {
-      // query the current value
-      JsonObjectPtr v = JsonObject::objFromFile(file.c_str());
-      if (v) return makeAnswer(v);
       return emptyAnswer();
     }
+    // apply changes in one go
+    resultsChanged();
+    err = store.update(changes);
+    if (Error::notOK(err)) return JsonObjectPtr();
+    return emptyAnswer();
   }
 
 
   JsonObjectPtr getProperty(string aKey)
   {
-    if (aKey.find_first_of("/.")!=string::npos) return JsonObjectPtr();
-    string file = FLASH_PATH "p44_property_" + lowerCase(aKey);
-    return JsonObject::objFromFile(file.c_str());
+    if (!validPropertyKey(aKey)) return JsonObjectPtr();
+    PropertyStore store(FLASH_PATH);
+    if (Error::notOK(store.load())) return JsonObjectPtr();
+    return propertyValue(store, aKey);
   }
 
 
@@ -1824,7 +6524,9 @@ public:
     if (o) {
       // set the user level = write to /flash/p44userlevel
       int userlevel = o->int32Value();
-      return statusAnswer(string_tofile(FLASH_PATH "p44userlevel", string_format("%d",userlevel)));
+      FlashWriter::writer().write(FLASH_PATH "p44userlevel", string_format("%d",userlevel));
+      resultsChanged(); // devinfo reports the user level
+      return emptyAnswer();
     }
     else {
       // query the level
@@ -1835,80 +6537,379 @@ public:
 
   // MARK: ===== (pesistent) alerts
 
-  #define ALERT_DIR "p44alerts/"
-
+  // - no params: return next pending alert
+  // - "new":{...}: create new alert, returns its id (identical pending alerts are counted, not duplicated)
+  // - "confirm":id or [ids...]: confirm (remove) alert(s), "confirmall":true to confirm all
+  // - "count":true: number of pending alerts
+  // - "list":true: pending alerts in queue order, "offset"/"limit" for paging, headers only unless "full":true
   JsonObjectPtr alert_from_ui(JsonObjectPtr aUriParams, ErrorPtr &err)
   {
-    JsonObjectPtr o = aUriParams->get("new");
-    if (o) {
-      // create new alert, return ID
-      return makeAnswer(JsonObject::newString(newAlert(o)));
+    JsonObjectPtr o;
+    if (aUriParams->get("new", o)) {
+      // create new alert, return ID (of the identical pending alert, if any, null if suppressed by rate limit)
+      string id = newAlert(o, &err);
+      if (Error::notOK(err)) return JsonObjectPtr();
+      return makeAnswer(id.empty() ? JsonObjectPtr() : JsonObject::newString(id));
     }
-    o = aUriParams->get("confirm");
-    if (o) {
-      // confirm existing alert
-      confirmAlert(o->stringValue());
+    if (aUriParams->get("confirm", o)) {
+      // confirm existing alert(s)
+      vector<string> ids;
+      if (o->isType(json_type_array)) {
+        for (int i=0; i<o->arrayLength(); i++) {
+          JsonObjectPtr id = o->arrayGet(i);
+          if (id) ids.push_back(id->stringValue());
+        }
+      }
+      else {
+        ids.push_back(o->stringValue());
+      }
+      confirmAlerts(ids);
       return emptyAnswer();
     }
-    // return next pending alert
-    return makeAnswer(nextAlert());
+    bool confirmAll = aUriParams->get("confirmall", o) && o->boolValue();
+    bool count = aUriParams->get("count", o) && o->boolValue();
+    bool list = aUriParams->get("list", o) && o->boolValue();
+    if (!confirmAll && !count && !list) {
+      // return next pending alert
+      return makeAnswer(nextAlert());
+    }
+    AlertQueue queue(FLASH_PATH ALERT_DIR, alertRateLimit(), alertMaxPending());
+    err = queue.lock();
+    if (Error::notOK(err)) return JsonObjectPtr();
+    JsonObjectPtr answer;
+    if (confirmAll) {
+      queue.removeAll();
+      answer = emptyAnswer();
+    }
+    else if (count) {
+      JsonObjectPtr result = JsonObject::newObj();
+      result->add("count", JsonObject::newInt64(queue.headers().size()));
+      answer = makeAnswer(result);
+    }
+    else {
+      // page of alerts
+      const AlertQueue::HeaderVector &headers = queue.headers();
+      size_t offset = aUriParams->get("offset", o) && o->int32Value()>0 ? o->int32Value() : 0;
+      size_t limit = aUriParams->get("limit", o) && o->int32Value()>0 ? o->int32Value() : headers.size();
+      bool full = aUriParams->get("full", o) && o->boolValue();
+      JsonObjectPtr alerts = JsonObject::newArray();
+      for (size_t i=offset; i<headers.size() && i<offset+limit; i++) {
+        JsonObjectPtr a;
+        if (full) {
+          a = queue.alert(headers[i]);
+          if (!a) continue; // file has gone missing
+        }
+        else {
+          a = JsonObject::newObj();
+          a->add("id", JsonObject::newString(headers[i].id));
+          a->add("created", JsonObject::newInt64(headers[i].created/Second));
+          a->add("priority", JsonObject::newInt32(headers[i].priority));
+          a->add("occurrences", JsonObject::newInt32(headers[i].count));
+          a->add("lastseen", JsonObject::newInt64(headers[i].lastSeen/Second));
+        }
+        alerts->arrayAppend(a);
+      }
+      JsonObjectPtr result = JsonObject::newObj();
+      result->add("count", JsonObject::newInt64(headers.size()));
+      result->add("alerts", alerts);
+      answer = makeAnswer(result);
+    }
+    ErrorPtr uerr = queue.unlock();
+    if (Error::isOK(err)) err = uerr;
+    return Error::isOK(err) ? answer : JsonObjectPtr();
   }
 
 
-  string newAlert(JsonObjectPtr aAlert)
+  MLMicroSeconds alertRateLimit()
   {
-    string alertId;
-    JsonObjectPtr o;
-    if (aAlert->get("id", o)) {
-      // id defined in the alert already -> use it
-      alertId = o->stringValue();
+    int rateLimit = DEFAULT_ALERT_RATE_LIMIT;
+    getIntOption("alertratelimit", rateLimit);
+    return rateLimit*Second;
+  }
+
+
+  size_t alertMaxPending()
+  {
+    int maxAlerts = DEFAULT_MAX_ALERTS;
+    getIntOption("maxalerts", maxAlerts);
+    return maxAlerts;
+  }
+
+
+  // create new alert
+  // @param aErrP if not NULL, set to the error, if any
+  // @return id of the alert (or of the identical pending alert counted instead), empty if suppressed by rate limit or on error
+  string newAlert(JsonObjectPtr aAlert, ErrorPtr *aErrP = NULL)
+  {
+    AlertQueue queue(FLASH_PATH ALERT_DIR, alertRateLimit(), alertMaxPending());
+    string id;
+    ErrorPtr err = queue.lock();
+    if (Error::isOK(err)) {
+      err = queue.add(aAlert, id);
+      ErrorPtr uerr = queue.unlock();
+      if (Error::isOK(err)) err = uerr;
     }
-    else {
-      // no predefined alert ID -> create random alert ID
-      alertId = string_format("%lld_%d", MainLoop::now(), rand());
-      aAlert->add("id", JsonObject::newString(alertId));
+    if (Error::notOK(err)) {
+      LOG(LOG_ERR, "cannot create alert: %s", err->description().c_str());
+      id.clear();
+    }
+    if (aErrP) *aErrP = err;
+    return id;
+  }
+
+
+  // confirm (remove) alerts
+  // @return number of alerts that were pending
+  size_t confirmAlerts(const vector<string> &aAlertIds)
+  {
+    AlertQueue queue(FLASH_PATH ALERT_DIR, alertRateLimit(), alertMaxPending());
+    size_t n = 0;
+    ErrorPtr err = queue.lock();
+    if (Error::isOK(err)) {
+      for (size_t i=0; i<aAlertIds.size(); i++) {
+        if (queue.remove(aAlertIds[i])) n++;
+      }
+      err = queue.unlock();
     }
-    string alertFile = string_format(FLASH_PATH ALERT_DIR "alert_%s", alertId.c_str());
-    mkdir(FLASH_PATH ALERT_DIR, S_IRWXU | S_IRWXG | S_IROTH | S_IXOTH);
-    string_tofile(alertFile, aAlert->json_str());
-    return alertId;
+    if (Error::notOK(err)) LOG(LOG_ERR, "cannot confirm alerts: %s", err->description().c_str());
+    return n;
   }
 
+
   bool confirmAlert(const string aAlertId)
   {
-    if (aAlertId.find_first_of("/.")!=string::npos) return false; // safeguard
-    string alertFile = string_format(FLASH_PATH ALERT_DIR "alert_%s", aAlertId.c_str());
-    return (unlink(alertFile.c_str())==0);
+    return confirmAlerts(vector<string>(1, aAlertId))>0;
   }
 
 
+  // @return next pending alert, NULL if none
   JsonObjectPtr nextAlert()
   {
-    string path = FLASH_PATH ALERT_DIR;
-    DIR* alertDir = opendir(path.c_str());
+    AlertQueue queue(FLASH_PATH ALERT_DIR, alertRateLimit(), alertMaxPending());
     JsonObjectPtr alert;
-    if (alertDir) {
-      while (true) {
-        struct dirent *ent = readdir(alertDir);
-        if (!ent) break;
-        if (ent->d_name[0]=='.') continue;
-        // real file name
-        pathstring_format_append(path, "%s", ent->d_name);
-        alert = JsonObject::objFromFile(path.c_str());
-        break;
+    ErrorPtr err = queue.lock();
+    if (Error::isOK(err)) {
+      while (!queue.headers().empty()) {
+        alert = queue.alert(queue.headers().front());
+        if (alert) break;
+        queue.remove(queue.headers().front().id); // file has gone missing
       }
-      closedir(alertDir);
+      err = queue.unlock();
     }
+    if (Error::notOK(err)) LOG(LOG_ERR, "cannot read alerts: %s", err->description().c_str());
     return alert;
   }
 
 
+  // MARK: ===== flash integrity
+
+  typedef struct {
+    uint32_t crc;
+    uint64_t size;
+    time_t mtime;
+    ino_t inode;
+  } FlashChecksum;
+  typedef map<string, FlashChecksum> FlashChecksumMap; // by path relative to FLASH_PATH
+
+
+  // checksum a file or directory (recursively) in FLASH_PATH
+  ErrorPtr scanFlashChecksums(const string &aRelPath, FlashChecksumMap &aChecksums)
+  {
+    string path = FLASH_PATH + aRelPath;
+    struct stat st;
+    if (lstat(path.c_str(), &st)<0) {
+      if (errno==ENOENT) return ErrorPtr();
+      return SysError::errNo("cannot stat flash file: ");
+    }
+    if (S_ISREG(st.st_mode)) {
+      FlashChecksum c;
+      c.mtime = st.st_mtime;
+      c.inode = st.st_ino;
+      ErrorPtr err = fileCrc32(path, c.crc, c.size);
+      if (Error::isOK(err)) aChecksums[aRelPath] = c;
+      return err;
+    }
+    if (!S_ISDIR(st.st_mode)) return ErrorPtr();
+    DIR *dir = opendir(path.c_str());
+    if (!dir) return SysError::errNo("cannot open flash directory: ");
+    ErrorPtr err;
+    struct dirent *de;
+    while (Error::isOK(err) && (de = readdir(dir))!=NULL) {
+      if (strcmp(de->d_name, ".")==0 || strcmp(de->d_name, "..")==0) continue;
+      err = scanFlashChecksums(aRelPath + "/" + de->d_name, aChecksums);
+    }
+    closedir(dir);
+    return err;
+  }
+
+
+  // checksum all files p44maintd maintains in FLASH_PATH
+  ErrorPtr currentFlashChecksums(FlashChecksumMap &aChecksums)
+  {
+    static const char * const flashFiles[] = {
+      "p44custom.defs",
+      "p44userlevel",
+      "webui_authfile",
+      PROPERTY_STORE_FILE,
+      "p44alerts", // ALERT_DIR
+      NULL
+    };
+    ErrorPtr err;
+    for (const char * const *f = flashFiles; Error::isOK(err) && *f; f++) {
+      err = scanFlashChecksums(*f, aChecksums);
+    }
+    return err;
+  }
+
+
+  // checksums file: magic and crc32 of the rest of the file on the first line,
+  // then "<crc32> <size> <mtime> <inode> <path>" lines
+  ErrorPtr saveFlashChecksums(const FlashChecksumMap &aChecksums)
+  {
+    string body;
+    for (FlashChecksumMap::const_iterator pos = aChecksums.begin(); pos!=aChecksums.end(); ++pos) {
+      string_format_append(body, "%08X %llu %lld %llu %s\n",
+        pos->second.crc, (unsigned long long)pos->second.size, (long long)pos->second.mtime,
+        (unsigned long long)pos->second.inode, pos->first.c_str()
+      );
+    }
+    FastCrc32 crc;
+    crc.addBytes(body.size(), (const uint8_t *)body.data());
+    return FlashWriter::writer().writeNow(FLASH_PATH FLASH_CHECKSUMS_FILE, string_format(FLASH_CHECKSUMS_MAGIC " %08X\n", crc.getCRC()) + body);
+  }
+
+
+  // @param aFound set when there is a checksums file
+  ErrorPtr loadFlashChecksums(FlashChecksumMap &aChecksums, bool &aFound)
+  {
+    string data;
+    aFound = readFileAtOnce(FLASH_PATH FLASH_CHECKSUMS_FILE, data);
+    if (!aFound) return ErrorPtr();
+    unsigned fileCrc;
+    size_t eol = data.find('\n');
+    if (eol==string::npos || sscanf(data.c_str(), FLASH_CHECKSUMS_MAGIC " %8X", &fileCrc)!=1) {
+      return ErrorPtr(new Error(500, "checksums file damaged, use mode 'update'"));
+    }
+    FastCrc32 crc;
+    crc.addBytes(data.size()-eol-1, (const uint8_t *)data.data()+eol+1);
+    if (crc.getCRC()!=fileCrc) return ErrorPtr(new Error(500, "checksums file damaged, use mode 'update'"));
+    const char *p = data.c_str()+eol+1;
+    string line;
+    while (nextPart(p, line, '\n')) {
+      FlashChecksum c;
+      unsigned long long size, inode;
+      long long mtime;
+      int n = 0;
+      if (sscanf(line.c_str(), "%8X %llu %lld %llu %n", &c.crc, &size, &mtime, &inode, &n)<4 || n==0) continue;
+      c.size = size;
+      c.mtime = (time_t)mtime;
+      c.inode = (ino_t)inode;
+      aChecksums[line.substr(n)] = c;
+    }
+    return ErrorPtr();
+  }
+
+
+  // verify flash files against the stored checksums, or store new checksums with mode "update".
+  // A file with different content is reported as "modified" when it was written (replaced or appended)
+  // after checksumming, and as "corrupt" when it still has its original inode and mtime.
+  JsonObjectPtr verify(JsonObjectPtr aUriParams, ErrorPtr &err)
+  {
+    size_t ph = mProfiler.begin("verify");
+    FlashChecksumMap current;
+    err = currentFlashChecksums(current);
+    JsonObjectPtr o;
+    JsonObjectPtr result = JsonObject::newObj();
+    if (Error::isOK(err) && aUriParams->get("mode", o) && o->stringValue()=="update") {
+      err = saveFlashChecksums(current);
+      result->add("files", JsonObject::newInt32((int)current.size()));
+      mProfiler.end(ph);
+      return Error::isOK(err) ? makeAnswer(result) : JsonObjectPtr();
+    }
+    FlashChecksumMap stored;
+    bool found = false;
+    if (Error::isOK(err)) err = loadFlashChecksums(stored, found);
+    if (Error::notOK(err)) {
+      mProfiler.end(ph);
+      return JsonObjectPtr();
+    }
+    if (!found) {
+      LOG(LOG_WARNING, "no flash checksums yet, use mode 'update' to create them");
+      result->add("nochecksums", JsonObject::newBool(true));
+      mProfiler.end(ph);
+      return makeAnswer(result);
+    }
+    JsonObjectPtr corrupt = JsonObject::newArray();
+    JsonObjectPtr modified = JsonObject::newArray();
+    JsonObjectPtr missing = JsonObject::newArray();
+    JsonObjectPtr added = JsonObject::newArray();
+    int ok = 0;
+    for (FlashChecksumMap::const_iterator pos = stored.begin(); pos!=stored.end(); ++pos) {
+      FlashChecksumMap::const_iterator cur = current.find(pos->first);
+      if (cur==current.end()) {
+        missing->arrayAppend(JsonObject::newString(pos->first));
+      }
+      else if (cur->second.crc==pos->second.crc && cur->second.size==pos->second.size) {
+        ok++;
+      }
+      else if (cur->second.mtime==pos->second.mtime && cur->second.inode==pos->second.inode) {
+        LOG(LOG_ERR, "flash file %s is corrupt", pos->first.c_str());
+        corrupt->arrayAppend(JsonObject::newString(pos->first));
+      }
+      else {
+        modified->arrayAppend(JsonObject::newString(pos->first));
+      }
+    }
+    for (FlashChecksumMap::const_iterator pos = current.begin(); pos!=current.end(); ++pos) {
+      if (stored.find(pos->first)==stored.end()) added->arrayAppend(JsonObject::newString(pos->first));
+    }
+    result->add("intact", JsonObject::newBool(corrupt->arrayLength()==0));
+    result->add("files", JsonObject::newInt32((int)current.size()));
+    result->add("ok", JsonObject::newInt32(ok));
+    result->add("corrupt", corrupt);
+    result->add("modified", modified);
+    result->add("missing", missing);
+    result->add("new", added);
+    mProfiler.end(ph);
+    return makeAnswer(result);
+  }
+
+
   // MARK: ===== config backup & restore
 
-  void config_backup(ErrorPtr &err)
+  void config_backup(JsonObjectPtr aParams, ErrorPtr &err)
   {
+    string compression = "gzip";
+    JsonObjectPtr o = aParams->get("compression");
+    if (o) compression = o->stringValue();
+    if (compression!="gzip" && compression!="xz" && compression!="none") {
+      err = ErrorPtr(new Error(415, "unsupported compression, use gzip, xz or none"));
+      return;
+    }
+    string listFile = mDefspath + BACKUP_LIST_FILE;
+    bool inProcess = access(listFile.c_str(), R_OK)==0;
+    BackupManifest base;
+    bool incremental = false;
+    o = aParams->get("mode");
+    if (o && o->stringValue()=="incremental") {
+      // only changes relative to the backup described by the base manifest
+      incremental = true;
+      o = aParams->get("base");
+      if (!o || !base.parse(o->stringValue())) {
+        err = ErrorPtr(new Error(400, "incremental backup needs valid 'base' manifest"));
+        return;
+      }
+      if (!inProcess) {
+        err = ErrorPtr(new Error(501, "incremental backup needs " BACKUP_LIST_FILE));
+        return;
+      }
+    }
+    else if (o && o->stringValue()!="full") {
+      err = ErrorPtr(new Error(400, "unknown backup mode, use full or incremental"));
+      return;
+    }
     // create filename
-    string fn = getDef("UNIT_HOSTNAME") + "_" + string_ftime("%Y-%m-%d_%H.%M") + ".p44cfg";
+    string fn = getDef(def_UNIT_HOSTNAME) + "_" + string_ftime("%Y-%m-%d_%H.%M") + (incremental ? "_inc" : "") + ".p44cfg";
     // create headers
     printf(
       "\x03" "application/octet-stream\r\n"
@@ -1916,44 +6917,166 @@ public:
       fn.c_str()
     );
     fflush(stdout);
+    if (inProcess) {
+      // file set is configured: create archive in-process
+      err = streamBackup(listFile, compression, incremental ? &base : NULL);
+      if (Error::isOK(err)) {
+        profileToStderr();
+        terminateApp(EXIT_SUCCESS);
+      }
+      return;
+    }
     // let backup script do the actual output directly
     // - call the update script now
-    const char *path = "/bin/sh";
     const char *cmd[] = {
-      "sh",
-      "-c",
       #if BUILDENV_XCODE || BUILDENV_GENERIC
-      "echo this is a dummy config file",
+      "echo", "this is a dummy config file",
       #else
       "p44configbackup",
       #endif
       NULL
     };
     // exec the script
-    // close all non-std file descriptors
-    int fd = getdtablesize();
-    while (fd>STDERR_FILENO) close(fd--);
+    // do not pass on any non-std file descriptors
+    setCloexecAboveStdErr();
     // change to the requested child process
-    execve(path, (char **)cmd, environ); // replace process with new binary/script
+    execvp(cmd[0], (char **)cmd); // replace process with new binary/script
     // execv returns only in case of error
     err = ErrorPtr(new Error(1,"Cannot exec backup script"));
   }
 
 
+  // start aTool to compress what is written to aInFd into aOutFd
+  ErrorPtr startCompressor(const string &aTool, int aOutFd, int &aInFd, pid_t &aPid)
+  {
+    int p[2];
+    if (cloexecPipe(p)<0) return SysError::errNo("cannot create compressor pipe: ");
+    const char *argv[] = { aTool.c_str(), "-c", NULL };
+    int ret = spawnProcess(aPid, argv, p[0], aOutFd);
+    close(p[0]);
+    if (ret!=0) {
+      close(p[1]);
+      return SysError::err(ret, "cannot start compressor: ");
+    }
+    aInFd = p[1];
+    return ErrorPtr();
+  }
+
+
+  // close compressor input and wait for it to finish
+  ErrorPtr endCompressor(const string &aTool, int aInFd, pid_t aPid)
+  {
+    close(aInFd);
+    int status;
+    while (waitpid(aPid, &status, 0)<0 && errno==EINTR);
+    if (!(WIFEXITED(status) && WEXITSTATUS(status)==0)) {
+      return ErrorPtr(new Error(1, "backup compressor failed: " + aTool));
+    }
+    return ErrorPtr();
+  }
+
+
+  // stream a tar archive of the unit's defs, the content manifest and the files listed in aListFile to stdout,
+  // through an external compressor unless aCompression is "none"
+  // @param aBase if set, only entries that differ from this manifest are archived, plus a list of deleted entries
+  ErrorPtr streamBackup(const string &aListFile, const string &aCompression, const BackupManifest *aBase)
+  {
+    MLMicroSeconds start = MainLoop::now();
+    BackupManifest manifest;
+    string list;
+    if (!readFileAtOnce(aListFile, list)) return SysError::errNo("cannot read backup list: ");
+    const char *p = list.c_str();
+    string line;
+    ErrorPtr err;
+    while (Error::isOK(err) && nextPart(p, line, '\n')) {
+      line = trimWhiteSpace(line);
+      if (line.empty() || line[0]=='#') continue;
+      err = manifest.scan(line);
+    }
+    if (Error::notOK(err)) return err;
+    int out = STDOUT_FILENO;
+    pid_t compressor = -1;
+    if (aCompression!="none") {
+      err = startCompressor(aCompression, STDOUT_FILENO, out, compressor);
+      if (Error::notOK(err)) return err;
+    }
+    TarWriter tar(out);
+    // defs first, so restore preparation finds them without reading the entire archive
+    ShellVarWriter w;
+    for (DefsMap::Iterator i(mDefs); i.valid(); i.next()) {
+      w.assignment(i.key(), i.value());
+    }
+    err = tar.addData(BACKUP_DEFS_MEMBER, w.data(), time(NULL));
+    if (Error::isOK(err)) err = tar.addData(BACKUP_MANIFEST_MEMBER, manifest.text(), time(NULL));
+    if (Error::isOK(err) && aBase) {
+      string delta = string_format("base %08X\n", BackupManifest::id(aBase->text()));
+      for (BackupManifest::EntryMap::const_iterator pos = aBase->entries().begin(); pos!=aBase->entries().end(); ++pos) {
+        if (!manifest.find(pos->first)) delta += pos->first + "\n";
+      }
+      err = tar.addData(BACKUP_DELTA_MEMBER, delta, time(NULL));
+    }
+    for (BackupManifest::EntryMap::const_iterator pos = manifest.entries().begin(); Error::isOK(err) && pos!=manifest.entries().end(); ++pos) {
+      if (aBase && !aBase->differs(pos->first, pos->second)) continue; // unchanged
+      // verify against the manifest already sent, files might have changed since scanning them
+      err = tar.addPath("/" + pos->first, pos->second.type, pos->second.crc, pos->second.size);
+    }
+    if (Error::isOK(err)) err = tar.finish();
+    if (compressor>0) {
+      ErrorPtr cerr = endCompressor(aCompression, out, compressor);
+      if (Error::isOK(err)) err = cerr;
+    }
+    MLMicroSeconds t = MainLoop::now()-start;
+    string stats = string_format("%zu files, %llu bytes, %lld mS, %.1f kB/s",
+      tar.files(), (unsigned long long)tar.bytes(), (long long)(t/MilliSecond),
+      t>0 ? (double)tar.bytes()*Second/t/1024 : 0.0
+    );
+    LOG(LOG_NOTICE, "%s config backup (%s): %s", aBase ? "incremental" : "full", aCompression.c_str(), stats.c_str());
+    mProfiler.end(mProfiler.begin("backup", stats, start));
+    return err;
+  }
+
+
   JsonObjectPtr config_restore_prep(JsonObjectPtr aUriParams, ErrorPtr &err)
   {
     JsonObjectPtr o = aUriParams->get("uploadedfile");
     if (o) {
       string fn = o->stringValue();
+      // look at the defs in the archive only, extraction is done by configrestoreapply
+      DefsMap cfgDefs;
+      bool hasDefs = false;
+      bool isDelta = false;
+      ErrorPtr ierr = inspectRestoreArchive(fn, cfgDefs, hasDefs, isDelta);
+      if (Error::isOK(ierr) && isDelta) {
+        // incremental backup: apply to what was prepared from the previous upload(s)
+        err = mergeRestoreDelta(fn);
+        if (Error::notOK(err)) return JsonObjectPtr();
+        configPrepAnswer(cfgDefs, false);
+        return JsonObjectPtr(); // already answered
+      }
+      if (Error::isOK(ierr) && !hasDefs) {
+        // not a p44 config archive (or a very old one), let the script decide
+        ierr = ErrorPtr(new Error(1, "archive has no " BACKUP_DEFS_MEMBER));
+      }
+      if (Error::isOK(ierr)) {
+        if (fn==RESTORE_ARCHIVE_FILE || rename(fn.c_str(), RESTORE_ARCHIVE_FILE)==0) {
+          configPrepAnswer(cfgDefs, false);
+          return JsonObjectPtr(); // already answered
+        }
+        ierr = SysError::errNo("cannot keep archive for restore: ");
+      }
+      LOG(LOG_INFO, "archive not inspected in-process (%s)", ierr->description().c_str());
+      unlink(RESTORE_ARCHIVE_FILE); // make sure configrestoreapply uses the script-prepared data
       LOG(LOG_NOTICE, "calling config restore script (preparation phase)");
-      string rcmd;
+      HelperArgs rcmd;
       #if BUILDENV_XCODE || BUILDENV_GENERIC
-      rcmd = string_format("echo /tmp/config_restore"); // real restore script returns the prep dir path
-//      rcmd = string_format("echo archive unusable; false"); // real restore script returns the prep dir path
+      rcmd.push_back("echo");
+      rcmd.push_back("/tmp/config_restore"); // real restore script returns the prep dir path
       #else
-      rcmd = string_format("p44configrestore --prepare \"%s\"", fn.c_str());
+      rcmd.push_back("p44configrestore");
+      rcmd.push_back("--prepare");
+      rcmd.push_back(fn);
       #endif
-      MainLoop::currentMainLoop().fork_and_system(boost::bind(&P44maintd::configPrepared, this, _1, _2), rcmd.c_str(), true);
+      runHelper(boost::bind(&P44maintd::configPrepared, this, _1, _2), rcmd, true, false);
       return JsonObjectPtr(); // no answer now, but later when we get data
     }
     err = ErrorPtr(new Error(1,"missing 'uploadedfile' param"));
@@ -1980,39 +7103,188 @@ public:
   }
 
 
+  // scan archive for the defs member, without extracting anything. The entire archive is read,
+  // so truncated or corrupt archives are detected here already, not only when applying them.
+  // @param aHasDefs set when the archive contains defs (otherwise, it is an old style archive)
+  // @param aIsDelta set when the archive is an incremental backup
+  // @return error when aArchive is not a complete (possibly compressed) tar archive
+  ErrorPtr inspectRestoreArchive(const string &aArchive, DefsMap &aCfgDefs, bool &aHasDefs, bool &aIsDelta)
+  {
+    size_t ph = mProfiler.begin("inspectArchive", aArchive);
+    TarReader tar;
+    ErrorPtr err = tar.open(aArchive);
+    string name;
+    char type;
+    uint64_t size;
+    int afterDefs = -1; // member index relative to the defs member
+    aHasDefs = false;
+    aIsDelta = false;
+    while (Error::isOK(err) && tar.nextMember(name, type, size, err)) {
+      if (type=='0' && afterDefs<0 && (name==BACKUP_DEFS_MEMBER || name=="./" BACKUP_DEFS_MEMBER)) {
+        string defs;
+        err = tar.readData(defs);
+        if (Error::isOK(err)) aHasDefs = parseDefs(defs, aCfgDefs);
+        afterDefs = 0;
+        continue;
+      }
+      if (afterDefs>=0) afterDefs++;
+      // metadata members directly follow the defs
+      if ((afterDefs==1 || afterDefs==2) && name==BACKUP_DELTA_MEMBER) aIsDelta = true;
+    }
+    tar.close();
+    mProfiler.end(ph);
+    return err;
+  }
+
+
+  ErrorPtr readArchiveMember(const string &aArchive, const string &aMember, string &aData)
+  {
+    TarReader tar;
+    ErrorPtr err = tar.open(aArchive);
+    string name;
+    char type;
+    uint64_t size;
+    while (Error::isOK(err) && tar.nextMember(name, type, size, err)) {
+      if (name==aMember) return tar.readData(aData);
+    }
+    if (Error::isOK(err)) err = ErrorPtr(new Error(1, "archive has no " + aMember));
+    return err;
+  }
+
+
+  // apply incremental backup aDelta to the archive prepared for restore (a full backup, possibly with deltas
+  // applied already). Every file of the resulting archive is verified against the crc32 manifest of aDelta.
+  ErrorPtr mergeRestoreDelta(const string &aDelta)
+  {
+    size_t ph = mProfiler.begin("mergeDelta", aDelta);
+    BackupManifest base;
+    string baseText;
+    ErrorPtr err = readArchiveMember(RESTORE_ARCHIVE_FILE, BACKUP_MANIFEST_MEMBER, baseText);
+    if (Error::notOK(err) || !base.parse(baseText)) {
+      mProfiler.end(ph);
+      return ErrorPtr(new Error(409, "incremental backup needs the full backup it is based on to be uploaded first"));
+    }
+    // metadata of the delta
+    static const char * const metaMembers[3] = { BACKUP_DEFS_MEMBER, BACKUP_MANIFEST_MEMBER, BACKUP_DELTA_MEMBER };
+    string meta[3];
+    TarReader delta;
+    string name;
+    char type;
+    uint64_t size;
+    err = delta.open(aDelta);
+    for (int i=0; i<3 && Error::isOK(err); i++) {
+      if (!delta.nextMember(name, type, size, err) || name!=metaMembers[i]) {
+        if (Error::isOK(err)) err = ErrorPtr(new Error(1, "malformed incremental backup"));
+        break;
+      }
+      err = delta.readData(meta[i]);
+    }
+    BackupManifest manifest;
+    unsigned baseId;
+    if (Error::isOK(err) && (!manifest.parse(meta[1]) || sscanf(meta[2].c_str(), "base %8X", &baseId)!=1)) {
+      err = ErrorPtr(new Error(1, "malformed incremental backup"));
+    }
+    if (Error::isOK(err) && baseId!=BackupManifest::id(base.text())) {
+      err = ErrorPtr(new Error(409, "incremental backup is not based on the archive prepared so far"));
+    }
+    if (Error::notOK(err)) {
+      mProfiler.end(ph);
+      return err;
+    }
+    // write merged archive: unchanged members from the prepared archive, then the delta's members
+    // unique temp name, created exclusively (0600), so nothing planted in /tmp is followed or truncated
+    char tmpTemplate[] = RESTORE_ARCHIVE_FILE ".XXXXXX";
+    int fd = mkstemp(tmpTemplate);
+    if (fd<0) {
+      mProfiler.end(ph);
+      return SysError::errNo("cannot create merged archive: ");
+    }
+    fcntl(fd, F_SETFD, FD_CLOEXEC);
+    string tmpName = tmpTemplate;
+    int out;
+    pid_t compressor;
+    err = startCompressor("gzip", fd, out, compressor);
+    if (Error::isOK(err)) {
+      TarWriter tar(out);
+      set<string> seen;
+      err = tar.addData(BACKUP_DEFS_MEMBER, meta[0], time(NULL));
+      if (Error::isOK(err)) err = tar.addData(BACKUP_MANIFEST_MEMBER, meta[1], time(NULL));
+      TarReader prepared;
+      if (Error::isOK(err)) err = prepared.open(RESTORE_ARCHIVE_FILE);
+      while (Error::isOK(err) && prepared.nextMember(name, type, size, err)) {
+        const BackupManifest::Entry *e = manifest.find(name);
+        const BackupManifest::Entry *be = base.find(name);
+        if (!e || !be || manifest.differs(name, *be)) continue; // deleted, changed or metadata
+        err = copyVerifiedMember(prepared, tar, name, type, size, *e);
+        seen.insert(name);
+      }
+      while (Error::isOK(err) && delta.nextMember(name, type, size, err)) {
+        const BackupManifest::Entry *e = manifest.find(name);
+        if (!e) {
+          err = ErrorPtr(new Error(1, "incremental backup contains unlisted member " + name));
+          break;
+        }
+        err = copyVerifiedMember(delta, tar, name, type, size, *e);
+        seen.insert(name);
+      }
+      for (BackupManifest::EntryMap::const_iterator pos = manifest.entries().begin(); Error::isOK(err) && pos!=manifest.entries().end(); ++pos) {
+        if (pos->second.type!='d' && seen.count(pos->first)==0) {
+          err = ErrorPtr(new Error(1, "restore archive is missing " + pos->first));
+        }
+      }
+      if (Error::isOK(err)) err = tar.finish();
+      prepared.close(); // also ends its decompressor
+      ErrorPtr cerr = endCompressor("gzip", out, compressor);
+      if (Error::isOK(err)) err = cerr;
+    }
+    close(fd);
+    if (Error::isOK(err) && rename(tmpName.c_str(), RESTORE_ARCHIVE_FILE)<0) {
+      err = SysError::errNo("cannot replace prepared archive: ");
+    }
+    if (Error::isOK(err)) unlink(aDelta.c_str());
+    else unlink(tmpName.c_str());
+    mProfiler.end(ph);
+    return err;
+  }
+
+
+  ErrorPtr copyVerifiedMember(TarReader &aFrom, TarWriter &aTo, const string &aName, char aType, uint64_t aSize, const BackupManifest::Entry &aEntry)
+  {
+    char entryType = aType=='0' ? 'f' : (aType=='2' ? 'l' : (aType=='5' ? 'd' : 0));
+    if (entryType!=aEntry.type) return ErrorPtr(new Error(1, "restore archive member has wrong type: " + aName));
+    ErrorPtr err = aTo.addHeader(aName, aType, aFrom.mode(), aSize, aFrom.mtime(), aFrom.linkTarget().c_str());
+    if (Error::notOK(err) || entryType=='d') return err;
+    FastCrc32 crc;
+    uint64_t n = 0;
+    if (entryType=='l') {
+      crc.addBytes(aFrom.linkTarget().size(), (const uint8_t *)aFrom.linkTarget().data());
+      n = aFrom.linkTarget().size();
+    }
+    else {
+      char buf[8192];
+      size_t got;
+      while (Error::isOK(err = aFrom.readChunk(buf, sizeof(buf), got)) && got>0) {
+        crc.addBytes(got, (const uint8_t *)buf);
+        n += got;
+        err = aTo.addContent(buf, got);
+        if (Error::notOK(err)) return err;
+      }
+      if (Error::isOK(err)) err = aTo.endContent(aSize);
+    }
+    if (Error::isOK(err) && (crc.getCRC()!=aEntry.crc || n!=aEntry.size)) {
+      err = ErrorPtr(new Error(1, "crc32 mismatch in restore archive: " + aName));
+    }
+    return err;
+  }
+
+
   void configPrepared(ErrorPtr aErr, const string &aResult)
   {
     if (Error::isOK(aErr)) {
       string prepdir = trimWhiteSpace(aResult);
-      // checks
-      bool oldArchive = false;
-      bool differentModel = false;
-      bool differentSerial = false;
-      bool oldFirmware = false;
       // get defs from backup
       DefsMap cfgDefs;
-      if (!readDefsFrom(prepdir + "/p44defs", cfgDefs)) {
-        LOG(LOG_WARNING, "old config archive, does not have p44defs");
-        oldArchive = true;
-      }
-      else {
-        // we have read something from defs
-        differentModel = !(getDef("PRODUCT_GTIN")==getDef("PRODUCT_GTIN", &cfgDefs));
-        differentSerial = !(getDef("UNIT_SERIALNO")==getDef("UNIT_SERIALNO", &cfgDefs));
-        oldFirmware = comparableVersion(getDef("FIRMWARE_VERSION")) < comparableVersion(getDef("FIRMWARE_VERSION", &cfgDefs));
-      }
-      // provide result
-      JsonObjectPtr result = JsonObject::newObj();
-      result->add("gtin", JsonObject::newString(getDef("PRODUCT_GTIN", &cfgDefs)));
-      result->add("model", JsonObject::newString(getDef("PRODUCT_MODEL", &cfgDefs)));
-      result->add("serial", JsonObject::newString(getDef("UNIT_SERIALNO", &cfgDefs)));
-      result->add("version", JsonObject::newString(getDef("FIRMWARE_VERSION", &cfgDefs)));
-      result->add("time", JsonObject::newString(getDef("STATUS_TIME", &cfgDefs)));
-      result->add("oldarchive", JsonObject::newBool(oldArchive));
-      result->add("differentmodel", JsonObject::newBool(differentModel));
-      result->add("differentserial", JsonObject::newBool(differentSerial));
-      result->add("oldfirmware", JsonObject::newBool(oldFirmware));
-      answerAndTerminate(makeAnswer(result));
+      configPrepAnswer(cfgDefs, !readDefsFrom(prepdir + "/" BACKUP_DEFS_MEMBER, cfgDefs));
       return;
     }
     if (Error::isError(aErr, ExecError::domain(), 1)) {
@@ -2024,6 +7296,35 @@ public:
   }
 
 
+  void configPrepAnswer(DefsMap &aCfgDefs, bool aOldArchive)
+  {
+    // checks
+    bool differentModel = false;
+    bool differentSerial = false;
+    bool oldFirmware = false;
+    if (aOldArchive) {
+      LOG(LOG_WARNING, "old config archive, does not have p44defs");
+    }
+    else {
+      differentModel = !(getDef(def_PRODUCT_GTIN)==getDef(def_PRODUCT_GTIN, &aCfgDefs));
+      differentSerial = !(getDef(def_UNIT_SERIALNO)==getDef(def_UNIT_SERIALNO, &aCfgDefs));
+      oldFirmware = comparableVersion(getDef(def_FIRMWARE_VERSION)) < comparableVersion(getDef(def_FIRMWARE_VERSION, &aCfgDefs));
+    }
+    // provide result
+    JsonObjectPtr result = JsonObject::newObj();
+    result->add("gtin", JsonObject::newString(getDef(def_PRODUCT_GTIN, &aCfgDefs)));
+    result->add("model", JsonObject::newString(getDef(def_PRODUCT_MODEL, &aCfgDefs)));
+    result->add("serial", JsonObject::newString(getDef(def_UNIT_SERIALNO, &aCfgDefs)));
+    result->add("version", JsonObject::newString(getDef(def_FIRMWARE_VERSION, &aCfgDefs)));
+    result->add("time", JsonObject::newString(getDef(def_STATUS_TIME, &aCfgDefs)));
+    result->add("oldarchive", JsonObject::newBool(aOldArchive));
+    result->add("differentmodel", JsonObject::newBool(differentModel));
+    result->add("differentserial", JsonObject::newBool(differentSerial));
+    result->add("oldfirmware", JsonObject::newBool(oldFirmware));
+    answerAndTerminate(makeAnswer(result));
+  }
+
+
 
   JsonObjectPtr config_restore_apply(JsonObjectPtr aUriParams, ErrorPtr &err)
   {
@@ -2031,27 +7332,21 @@ public:
     if (o){
       int mode = o->int32Value();
       if (mode>=0 && mode<=3) {
-        #if BUILDENV_XCODE || BUILDENV_GENERIC
-        printf("Real unit would execute: p44configrestore --apply %d", mode);
-        answerAndTerminate(emptyAnswer());
-        #else
-        // exec the script to apply restore
-        string c = string_format("p44configrestore --apply %d", mode);
-        const char *path = "/bin/sh";
-        const char *cmd[4] = {
-          "sh",
-          "-c",
-          c.c_str(),
-          NULL
-        };
-        // close all non-std file descriptors
-        int fd = getdtablesize();
-        while (fd>STDERR_FILENO) close(fd--);
-        // change to the requested child process
-        execve(path, (char **)cmd, environ); // replace process with new binary/script
-        // execv returns only in case of error
-        err = ErrorPtr(new Error(1,"Cannot exec restore apply script"));
-        #endif
+        if (access(RESTORE_ARCHIVE_FILE, F_OK)==0) {
+          // archive was only inspected by configrestoreprep, extract it now
+          HelperArgs pcmd;
+          #if BUILDENV_XCODE || BUILDENV_GENERIC
+          pcmd.push_back("echo");
+          pcmd.push_back("/tmp/config_restore");
+          #else
+          pcmd.push_back("p44configrestore");
+          pcmd.push_back("--prepare");
+          pcmd.push_back(RESTORE_ARCHIVE_FILE);
+          #endif
+          runHelper(boost::bind(&P44maintd::restoreArchiveExtracted, this, mode, _1, _2), pcmd, true, false);
+          return JsonObjectPtr(); // no answer now
+        }
+        err = applyRestore(mode);
         return JsonObjectPtr();
       }
     }
@@ -2060,6 +7355,48 @@ public:
   }
 
 
+  void restoreArchiveExtracted(int aMode, ErrorPtr aErr, const string &aOutput)
+  {
+    if (Error::notOK(aErr)) {
+      if (Error::isError(aErr, ExecError::domain(), 1)) {
+        // use returned string as error message
+        aErr = ErrorPtr(new Error(1, trimWhiteSpace(aOutput)));
+      }
+      LOG(LOG_ERR, "extracting restore archive failed: %s", aErr->description().c_str());
+      answerAndTerminate(makeErrorAnswer(ErrorPtr(new Error(422, string("Cannot extract restore archive: ") + aErr->getErrorMessage()))));
+      return;
+    }
+    unlink(RESTORE_ARCHIVE_FILE);
+    ErrorPtr err = applyRestore(aMode);
+    if (Error::notOK(err)) answerAndTerminate(makeErrorAnswer(err));
+  }
+
+
+  // replace this process by the restore script applying the prepared config
+  // @return error if the script could not be run, otherwise the script answers (or reboots)
+  ErrorPtr applyRestore(int aMode)
+  {
+    string m = string_format("%d", aMode);
+    const char *cmd[] = { "p44configrestore", "--apply", m.c_str(), NULL };
+    // process will be replaced, so invalidate now rather than when answering
+    ResultCache::invalidate();
+    #if BUILDENV_XCODE || BUILDENV_GENERIC
+    printf("Real unit would execute:");
+    for (const char **a = cmd; *a; a++) printf(" %s", *a);
+    answerAndTerminate(emptyAnswer());
+    return ErrorPtr();
+    #else
+    // exec the script to apply restore
+    // do not pass on any non-std file descriptors
+    setCloexecAboveStdErr();
+    // change to the requested child process
+    execvp(cmd[0], (char **)cmd); // replace process with new binary/script
+    // execv returns only in case of error
+    return ErrorPtr(new Error(1,"Cannot exec restore apply script"));
+    #endif
+  }
+
+
   // MARK: ===== factory reset
 
   void factoryReset(int aMode)
@@ -2070,16 +7407,17 @@ public:
     mGreenLED->steadyOn();
     // do factory reset
     LOG(LOG_NOTICE, "calling factory reset script");
-    string res;
+    HelperArgs res;
     #if BUILDENV_XCODE || BUILDENV_GENERIC
-    res = string_format("echo 'real platform would execute:' p44factoryreset %d", aMode);
-    #else
-    // call factory reset script
-    res = string_format("p44factoryreset %d", aMode);
+    res.push_back("echo");
+    res.push_back("real platform would execute:");
     #endif
-    MainLoop::currentMainLoop().fork_and_system(
+    // call factory reset script
+    res.push_back("p44factoryreset");
+    res.push_back(string_format("%d", aMode));
+    runHelper(
       boost::bind(&P44maintd::endApp, this, false), // exit with red LED on
-      res.c_str()
+      res, false, false
     );
   }
 
@@ -0,0 +1,185 @@
+//  SPDX-License-Identifier: GPL-3.0-or-later
+//
+//  Copyright (c) 2024 plan44.ch / Lukas Zeller, Zurich, Switzerland
+//
+//  Author: Lukas Zeller <luz@plan44.ch>
+//
+//  This file is part of p44utils.
+//
+//  p44utils is free software: you can redistribute it and/or modify
+//  it under the terms of the GNU General Public License as published by
+//  the Free Software Foundation, either version 3 of the License, or
+//  (at your option) any later version.
+//
+//  p44utils is distributed in the hope that it will be useful,
+//  but WITHOUT ANY WARRANTY; without even the implied warranty of
+//  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+//  GNU General Public License for more details.
+//
+//  You should have received a copy of the GNU General Public License
+//  along with p44utils. If not, see <http://www.gnu.org/licenses/>.
+//
+
+// Conformance driver for DefsParser.
+// Each .defs file given on the command line is parsed with DefsParser and with the line-by-line
+// parser p44maintd used before (readDefsFrom), and both results are compared with the .defs file's
+// .expected companion. Expected files list the resulting KEY=[VALUE] pairs sorted by key, with
+// control chars and backslashes in C escape notation.
+//
+// Build and run from this directory, with P44UTILS pointing to the p44utils sources:
+//   g++ -std=gnu++11 -I../.. -I$P44UTILS defsparser_test.cpp $P44UTILS/utils.cpp -o defsparser_test
+//   ./defsparser_test *.defs
+// Exit status is 0 when all files conform.
+
+#include "defsparser.hpp"
+#include "utils.hpp"
+
+#include <map>
+#include <stdio.h>
+
+using namespace p44;
+
+typedef std::map<string, string> DefsResult;
+
+
+// the parser as it was in p44maintd before DefsParser, unchanged except for the map type
+static bool oldReadDefsFrom(string aFileName, DefsResult &aDefs)
+{
+  string line;
+  bool readAnything = false;
+  FILE *file = fopen(aFileName.c_str(), "r");
+  if (file) {
+    // file opened
+    string l, key, value;
+    while (string_fgetline(file, line)) {
+      l = trimWhiteSpace(line, true, false);
+      if (l.size()>0 && l[0]!='#') {
+        // not comment
+        if (keyAndValue(line, key, value, '=')) {
+          // key/value
+          if (value.size()>0 && (value[0]=='"' || value[0]=='\'')) {
+            // consider quoted, means that \ is escape and string ends when quote appears again
+            string dequoted;
+            char quote = value[0];
+            size_t i=1;
+            bool escaped = false;
+            while (i<value.size()) {
+              if (!escaped) {
+                if (value[i]==quote) break;
+                if (value[i]=='\\') {
+                  escaped = true;
+                  i++;
+                  continue;
+                }
+              }
+              dequoted += value[i];
+              escaped = false;
+              i++;
+            }
+            aDefs[key] = dequoted;
+          }
+          else {
+            // use as-is
+            aDefs[key] = value;
+          }
+          readAnything = true;
+        }
+      }
+    }
+    fclose(file);
+  }
+  return readAnything;
+}
+
+
+static bool readFile(const string aFileName, string &aContents)
+{
+  FILE *file = fopen(aFileName.c_str(), "rb");
+  if (!file) return false;
+  char buf[4096];
+  size_t n;
+  aContents.clear();
+  while ((n = fread(buf, 1, sizeof(buf), file))>0) aContents.append(buf, n);
+  fclose(file);
+  return true;
+}
+
+
+static void parseWithDefsParser(const string &aText, DefsResult &aDefs)
+{
+  DefsParser parser(aText.data(), aText.size());
+  boost::string_view key, value;
+  while (parser.next(key, value)) {
+    aDefs[string(key.data(), key.size())].assign(value.data(), value.size());
+  }
+}
+
+
+static string escaped(const string &aStr)
+{
+  string res;
+  for (size_t i=0; i<aStr.size(); i++) {
+    unsigned char c = aStr[i];
+    switch (c) {
+      case '\\': res += "\\\\"; break;
+      case '\r': res += "\\r"; break;
+      case '\n': res += "\\n"; break;
+      case '\t': res += "\\t"; break;
+      default:
+        if (c<0x20 || c>0x7E) string_format_append(res, "\\x%02X", c);
+        else res += (char)c;
+        break;
+    }
+  }
+  return res;
+}
+
+
+static string rendered(const DefsResult &aDefs)
+{
+  string res;
+  for (DefsResult::const_iterator pos = aDefs.begin(); pos!=aDefs.end(); ++pos) {
+    string_format_append(res, "%s=[%s]\n", escaped(pos->first).c_str(), escaped(pos->second).c_str());
+  }
+  return res;
+}
+
+
+int main(int argc, char **argv)
+{
+  if (argc<2) {
+    fprintf(stderr, "usage: %s file.defs [file.defs...]\n", argv[0]);
+    return EXIT_FAILURE;
+  }
+  int failures = 0;
+  for (int i=1; i<argc; i++) {
+    string fn = argv[i];
+    string expfn = fn;
+    size_t e = expfn.rfind(".defs");
+    if (e!=string::npos) expfn.erase(e);
+    expfn += ".expected";
+    string text, expected;
+    if (!readFile(fn, text) || !readFile(expfn, expected)) {
+      fprintf(stderr, "%s: cannot read defs or expected file\n", fn.c_str());
+      failures++;
+      continue;
+    }
+    DefsResult newDefs, oldDefs;
+    parseWithDefsParser(text, newDefs);
+    oldReadDefsFrom(fn, oldDefs);
+    string newRes = rendered(newDefs);
+    string oldRes = rendered(oldDefs);
+    bool ok = true;
+    if (newRes!=expected) {
+      printf("%s: DefsParser result differs from expected\n--- expected:\n%s--- DefsParser:\n%s", fn.c_str(), expected.c_str(), newRes.c_str());
+      ok = false;
+    }
+    if (oldRes!=newRes) {
+      printf("%s: old parser result differs from DefsParser\n--- old:\n%s--- DefsParser:\n%s", fn.c_str(), oldRes.c_str(), newRes.c_str());
+      ok = false;
+    }
+    if (ok) printf("%s: ok (%zu definitions)\n", fn.c_str(), newDefs.size());
+    else failures++;
+  }
+  return failures>0 ? EXIT_FAILURE : EXIT_SUCCESS;
+}
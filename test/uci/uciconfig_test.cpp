@@ -0,0 +1,205 @@
+//  SPDX-License-Identifier: GPL-3.0-or-later
+//
+//  Copyright (c) 2024 plan44.ch / Lukas Zeller, Zurich, Switzerland
+//
+//  Author: Lukas Zeller <luz@plan44.ch>
+//
+//  This file is part of p44utils.
+//
+//  p44utils is free software: you can redistribute it and/or modify
+//  it under the terms of the GNU General Public License as published by
+//  the Free Software Foundation, either version 3 of the License, or
+//  (at your option) any later version.
+//
+//  p44utils is distributed in the hope that it will be useful,
+//  but WITHOUT ANY WARRANTY; without even the implied warranty of
+//  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+//  GNU General Public License for more details.
+//
+//  You should have received a copy of the GNU General Public License
+//  along with p44utils. If not, see <http://www.gnu.org/licenses/>.
+//
+
+// Conformance driver for UciConfig.
+// Each .ops file given on the command line names a UCI package file in the same directory (the .ops
+// file's name without extension), and lists operations to run on it, one per line:
+//   get <path>                  getlist <path>
+//   set <path> <value>          setlist <path> <value> [<value>...]
+//   unset <path>                find <package> <type> <option> <value>
+//   commit                      reload (continue with a new UciConfig, seeing committed packages)
+// The transcript of results and committed package texts is compared with the .ops file's .expected
+// companion. Committed packages are kept in memory, the fixture files are never modified.
+//
+// Build and run from this directory, with P44UTILS pointing to the p44utils sources:
+//   g++ -std=gnu++11 -I../.. -I$P44UTILS uciconfig_test.cpp $P44UTILS/error.cpp $P44UTILS/utils.cpp -o uciconfig_test
+//   ./uciconfig_test *.ops
+// Exit status is 0 when all files conform.
+
+#include "uciconfig.hpp"
+
+#include <map>
+#include <stdio.h>
+
+using namespace p44;
+
+typedef std::map<string, string> PackageTexts;
+
+
+static bool readFile(const string aFileName, string &aContents)
+{
+  FILE *file = fopen(aFileName.c_str(), "rb");
+  if (!file) return false;
+  char buf[4096];
+  size_t n;
+  aContents.clear();
+  while ((n = fread(buf, 1, sizeof(buf), file))>0) aContents.append(buf, n);
+  fclose(file);
+  return true;
+}
+
+
+// reads fixture files, but keeps committed packages in memory and logs them to the transcript
+class TestUciConfig : public UciConfig
+{
+  PackageTexts &mCommitted;
+  string &mTranscript;
+
+public:
+
+  TestUciConfig(const string &aDir, PackageTexts &aCommitted, string &aTranscript) :
+    UciConfig(aDir), mCommitted(aCommitted), mTranscript(aTranscript) {};
+
+protected:
+
+  virtual bool readPackage(const string &aPath, string &aText)
+  {
+    PackageTexts::iterator pos = mCommitted.find(aPath);
+    if (pos!=mCommitted.end()) {
+      aText = pos->second;
+      return true;
+    }
+    return readFile(aPath, aText);
+  }
+
+  virtual ErrorPtr writePackage(const string &aPath, const string &aText)
+  {
+    mCommitted[aPath] = aText;
+    string_format_append(mTranscript, "--- %s\n%s---\n", aPath.substr(aPath.rfind('/')+1).c_str(), aText.c_str());
+    return ErrorPtr();
+  }
+
+};
+
+
+// split off the next space separated word from aRest
+static string nextWord(string &aRest)
+{
+  size_t sp = aRest.find(' ');
+  string w = aRest.substr(0, sp);
+  aRest.erase(0, sp==string::npos ? sp : sp+1);
+  return w;
+}
+
+
+static void appendStatus(string &aTranscript, ErrorPtr aErr)
+{
+  if (Error::isOK(aErr)) aTranscript += "ok\n";
+  else string_format_append(aTranscript, "! %s\n", aErr->getErrorMessage());
+}
+
+
+static string runOps(const string &aDir, const string &aOps)
+{
+  string transcript;
+  PackageTexts committed;
+  TestUciConfig *uci = new TestUciConfig(aDir, committed, transcript);
+  size_t ls = 0;
+  while (ls<aOps.size()) {
+    size_t le = aOps.find('\n', ls);
+    if (le==string::npos) le = aOps.size();
+    string line = aOps.substr(ls, le-ls);
+    ls = le+1;
+    if (line.empty() || line[0]=='#') continue;
+    transcript += line + "\n";
+    // split into op, path and the rest
+    string rest = line;
+    string op = nextWord(rest);
+    string path = nextWord(rest);
+    if (op=="get") {
+      string v;
+      if (uci->get(path, v)) transcript += "= " + v + "\n";
+      else transcript += "! not found\n";
+    }
+    else if (op=="getlist") {
+      vector<string> vs;
+      if (uci->getList(path, vs)) {
+        transcript += "=";
+        for (size_t i=0; i<vs.size(); i++) transcript += " [" + vs[i] + "]";
+        transcript += "\n";
+      }
+      else transcript += "! not found\n";
+    }
+    else if (op=="set") {
+      appendStatus(transcript, uci->set(path, rest));
+    }
+    else if (op=="setlist") {
+      vector<string> vs;
+      while (!rest.empty()) vs.push_back(nextWord(rest));
+      appendStatus(transcript, uci->setList(path, vs));
+    }
+    else if (op=="unset") {
+      appendStatus(transcript, uci->unset(path));
+    }
+    else if (op=="find") {
+      // find <package> <type> <option> <value>
+      string type = nextWord(rest);
+      string option = nextWord(rest);
+      transcript += "= " + uci->findSection(path, type, option, rest) + "\n";
+    }
+    else if (op=="commit") {
+      appendStatus(transcript, uci->commit());
+    }
+    else if (op=="reload") {
+      delete uci;
+      uci = new TestUciConfig(aDir, committed, transcript);
+    }
+    else {
+      transcript += "! unknown op\n";
+    }
+  }
+  delete uci;
+  return transcript;
+}
+
+
+int main(int argc, char **argv)
+{
+  if (argc<2) {
+    fprintf(stderr, "usage: %s file.ops [file.ops...]\n", argv[0]);
+    return EXIT_FAILURE;
+  }
+  int failures = 0;
+  for (int i=1; i<argc; i++) {
+    string fn = argv[i];
+    string base = fn;
+    size_t e = base.rfind(".ops");
+    if (e!=string::npos) base.erase(e);
+    size_t s = base.rfind('/');
+    string dir = s==string::npos ? "./" : base.substr(0, s+1);
+    string ops, expected;
+    if (!readFile(fn, ops) || !readFile(base+".expected", expected)) {
+      fprintf(stderr, "%s: cannot read ops or expected file\n", fn.c_str());
+      failures++;
+      continue;
+    }
+    string res = runOps(dir, ops);
+    if (res!=expected) {
+      printf("%s: result differs from expected\n--- expected:\n%s--- UciConfig:\n%s", fn.c_str(), expected.c_str(), res.c_str());
+      failures++;
+    }
+    else {
+      printf("%s: ok\n", fn.c_str());
+    }
+  }
+  return failures>0 ? EXIT_FAILURE : EXIT_SUCCESS;
+}
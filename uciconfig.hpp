@@ -0,0 +1,402 @@
+//  SPDX-License-Identifier: GPL-3.0-or-later
+//
+//  Copyright (c) 2024 plan44.ch / Lukas Zeller, Zurich, Switzerland
+//
+//  Author: Lukas Zeller <luz@plan44.ch>
+//
+//  This file is part of p44utils.
+//
+//  p44utils is free software: you can redistribute it and/or modify
+//  it under the terms of the GNU General Public License as published by
+//  the Free Software Foundation, either version 3 of the License, or
+//  (at your option) any later version.
+//
+//  p44utils is distributed in the hope that it will be useful,
+//  but WITHOUT ANY WARRANTY; without even the implied warranty of
+//  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+//  GNU General Public License for more details.
+//
+//  You should have received a copy of the GNU General Public License
+//  along with p44utils. If not, see <http://www.gnu.org/licenses/>.
+//
+
+#ifndef __p44maintd__uciconfig__
+#define __p44maintd__uciconfig__
+
+#include "error.hpp"
+#include "utils.hpp"
+
+#include <string>
+#include <vector>
+#include <algorithm>
+#include <ctype.h>
+#include <string.h>
+
+#include <boost/utility/string_view.hpp>
+
+namespace p44 {
+
+  // in-process reader/writer for UCI config packages (the files in /etc/config on OpenWrt),
+  // so a batch of config changes needs no `uci` process per value, and is committed with
+  // one write per changed package. Derived classes provide the actual file access.
+  // Values are addressed like with the uci command line tool: "package.section.option", where
+  // section is a section name or "@type[index]" (negative index counts from the end).
+  // @note like `uci commit`, writing a package back does not preserve comments
+  class UciConfig
+  {
+    typedef struct {
+      string name;
+      bool isList;
+      vector<string> values;
+    } Option;
+
+    typedef struct {
+      string type;
+      string name; // empty for anonymous sections
+      vector<Option> options;
+    } Section;
+
+    typedef struct {
+      string name;
+      vector<Section> sections;
+      bool changed;
+    } Package;
+
+    string mDir;
+    vector<Package> mPackages; // loaded packages
+
+  protected:
+
+    // read package file
+    // @return false if it does not exist
+    virtual bool readPackage(const string &aPath, string &aText) = 0;
+
+    // (atomically) replace package file
+    virtual ErrorPtr writePackage(const string &aPath, const string &aText) = 0;
+
+  public:
+
+    // @param aDir directory containing the package files, with trailing slash
+    UciConfig(const string &aDir) : mDir(aDir) {};
+    virtual ~UciConfig() {};
+
+    // get option value
+    // @return false if option does not exist
+    // @note list options return all values separated by spaces, as `uci get` does
+    bool get(boost::string_view aPath, string &aValue)
+    {
+      const Option *o = findOption(aPath);
+      if (!o) return false;
+      aValue.clear();
+      for (size_t i=0; i<o->values.size(); i++) {
+        if (i>0) aValue += ' ';
+        aValue += o->values[i];
+      }
+      return true;
+    }
+
+    // get all values of a list option (or the single value of a plain option)
+    bool getList(boost::string_view aPath, vector<string> &aValues)
+    {
+      const Option *o = findOption(aPath);
+      if (!o) return false;
+      aValues = o->values;
+      return true;
+    }
+
+    // set plain option, section must exist
+    ErrorPtr set(boost::string_view aPath, boost::string_view aValue)
+    {
+      vector<string> v(1, string(aValue.data(), aValue.size()));
+      return store(aPath, false, v);
+    }
+
+    // set list option (replacing all of its values), section must exist
+    ErrorPtr setList(boost::string_view aPath, const vector<string> &aValues)
+    {
+      return store(aPath, true, aValues);
+    }
+
+    // remove option
+    ErrorPtr unset(boost::string_view aPath)
+    {
+      ErrorPtr err;
+      Package *p;
+      Section *s;
+      boost::string_view opt;
+      if (!resolve(aPath, p, s, opt, err)) return err;
+      for (vector<Option>::iterator pos = s->options.begin(); pos!=s->options.end(); ++pos) {
+        if (pos->name==opt) {
+          s->options.erase(pos);
+          p->changed = true;
+          break;
+        }
+      }
+      return err;
+    }
+
+    // find the first section of aType having option aOption set to aValue
+    // @return path of the section ("package.@type[index]"), empty if none
+    string findSection(boost::string_view aPackage, boost::string_view aType, boost::string_view aOption, boost::string_view aValue)
+    {
+      ErrorPtr err;
+      Package *p = package(aPackage, err);
+      if (!p) return "";
+      int idx = 0;
+      for (size_t i=0; i<p->sections.size(); i++) {
+        Section &s = p->sections[i];
+        if (s.type!=aType) continue;
+        for (size_t j=0; j<s.options.size(); j++) {
+          if (s.options[j].name==aOption && s.options[j].values.size()==1 && s.options[j].values[0]==aValue) {
+            return string_format("%s.@%s[%d]", p->name.c_str(), s.type.c_str(), idx);
+          }
+        }
+        idx++;
+      }
+      return "";
+    }
+
+    // write back all changed packages
+    ErrorPtr commit()
+    {
+      for (size_t i=0; i<mPackages.size(); i++) {
+        Package &p = mPackages[i];
+        if (!p.changed) continue;
+        ErrorPtr err = writePackage(mDir+p.name, serialize(p));
+        if (Error::notOK(err)) return err;
+        p.changed = false;
+      }
+      return ErrorPtr();
+    }
+
+  private:
+
+    Package *package(boost::string_view aName, ErrorPtr &aErr)
+    {
+      for (size_t i=0; i<mPackages.size(); i++) {
+        if (mPackages[i].name==aName) return &mPackages[i];
+      }
+      // load it
+      Package p;
+      p.name.assign(aName.data(), aName.size());
+      p.changed = false;
+      string text;
+      if (p.name.empty() || p.name.find('/')!=string::npos || !readPackage(mDir+p.name, text)) {
+        aErr = ErrorPtr(new Error(1, "no UCI package '" + p.name + "'"));
+        return NULL;
+      }
+      aErr = parse(text, p);
+      if (Error::notOK(aErr)) return NULL;
+      mPackages.push_back(p);
+      return &mPackages.back();
+    }
+
+
+    bool resolve(boost::string_view aPath, Package *&aPackage, Section *&aSection, boost::string_view &aOption, ErrorPtr &aErr)
+    {
+      size_t d1 = aPath.find('.');
+      size_t d2 = d1==boost::string_view::npos ? d1 : aPath.find('.', d1+1);
+      if (d2==boost::string_view::npos) {
+        aErr = ErrorPtr(new Error(1, "invalid UCI path '" + string(aPath.data(), aPath.size()) + "'"));
+        return false;
+      }
+      aOption = aPath.substr(d2+1);
+      aPackage = package(aPath.substr(0, d1), aErr);
+      if (!aPackage) return false;
+      boost::string_view sec = aPath.substr(d1+1, d2-d1-1);
+      aSection = NULL;
+      if (sec.size()>0 && sec[0]=='@') {
+        // @type[index]
+        size_t b = sec.find('[');
+        if (b!=boost::string_view::npos && sec[sec.size()-1]==']') {
+          boost::string_view type = sec.substr(1, b-1);
+          int idx = atoi(string(sec.substr(b+1, sec.size()-b-2)).c_str());
+          int n = 0;
+          for (size_t i=0; i<aPackage->sections.size(); i++) {
+            if (aPackage->sections[i].type==type) n++;
+          }
+          if (idx<0) idx += n;
+          for (size_t i=0; i<aPackage->sections.size() && idx>=0; i++) {
+            if (aPackage->sections[i].type==type && idx--==0) aSection = &aPackage->sections[i];
+          }
+        }
+      }
+      else {
+        for (size_t i=0; i<aPackage->sections.size(); i++) {
+          if (aPackage->sections[i].name==sec) { aSection = &aPackage->sections[i]; break; }
+        }
+      }
+      if (!aSection) {
+        aErr = ErrorPtr(new Error(1, "no UCI section '" + string(aPath.substr(0, d2)) + "'"));
+        return false;
+      }
+      return true;
+    }
+
+
+    const Option *findOption(boost::string_view aPath)
+    {
+      ErrorPtr err;
+      Package *p;
+      Section *s;
+      boost::string_view opt;
+      if (!resolve(aPath, p, s, opt, err)) return NULL;
+      for (size_t i=0; i<s->options.size(); i++) {
+        if (s->options[i].name==opt) return &s->options[i];
+      }
+      return NULL;
+    }
+
+
+    ErrorPtr store(boost::string_view aPath, bool aIsList, const vector<string> &aValues)
+    {
+      ErrorPtr err;
+      Package *p;
+      Section *s;
+      boost::string_view opt;
+      if (!resolve(aPath, p, s, opt, err)) return err;
+      Option *o = NULL;
+      for (size_t i=0; i<s->options.size(); i++) {
+        if (s->options[i].name==opt) { o = &s->options[i]; break; }
+      }
+      if (!o) {
+        s->options.push_back(Option());
+        o = &s->options.back();
+        o->name.assign(opt.data(), opt.size());
+      }
+      else if (o->isList==aIsList && o->values==aValues) {
+        return err; // unchanged, no need to write package
+      }
+      o->isList = aIsList;
+      o->values = aValues;
+      p->changed = true;
+      return err;
+    }
+
+
+    // parse package file text, which consists of "config type ['name']", "option name 'value'"
+    // and "list name 'value'" statements (plus "package name", which is ignored)
+    static ErrorPtr parse(const string &aText, Package &aPackage)
+    {
+      const char *p = aText.data();
+      const char *e = p+aText.size();
+      vector<string> words;
+      int line = 1;
+      while (p<e) {
+        // collect the words of one line
+        words.clear();
+        int stmtLine = line;
+        while (p<e && *p!='\n') {
+          if (isspace((unsigned char)*p)) { p++; continue; }
+          if (*p=='#') {
+            // comment to end of line
+            while (p<e && *p!='\n') p++;
+            break;
+          }
+          // word, possibly consisting of multiple quoted and unquoted parts
+          words.push_back(string());
+          string &w = words.back();
+          while (p<e && !isspace((unsigned char)*p)) {
+            if (*p=='\'') {
+              // single quoted: no escapes at all
+              const char *q = (const char *)memchr(p+1, '\'', e-p-1);
+              if (!q) return ErrorPtr(new Error(1, string_format("unterminated quote in UCI package '%s' line %d", aPackage.name.c_str(), stmtLine)));
+              line += (int)std::count(p, q, '\n');
+              w.append(p+1, q-p-1);
+              p = q+1;
+            }
+            else if (*p=='"') {
+              // double quoted: backslash escapes next char
+              for (p++; p<e && *p!='"'; p++) {
+                if (*p=='\\' && p+1<e) p++;
+                if (*p=='\n') line++;
+                w += *p;
+              }
+              if (p>=e) return ErrorPtr(new Error(1, string_format("unterminated quote in UCI package '%s' line %d", aPackage.name.c_str(), stmtLine)));
+              p++;
+            }
+            else {
+              if (*p=='\\' && p+1<e) p++;
+              w += *p++;
+            }
+          }
+        }
+        if (p<e) { p++; line++; } // skip newline
+        if (words.empty() || words[0]=="package") continue;
+        if (words[0]=="config" && words.size()>=2 && words.size()<=3) {
+          aPackage.sections.push_back(Section());
+          Section &s = aPackage.sections.back();
+          s.type = words[1];
+          if (words.size()>2) s.name = words[2];
+        }
+        else if ((words[0]=="option" || words[0]=="list") && words.size()>=2 && words.size()<=3 && !aPackage.sections.empty()) {
+          Section &s = aPackage.sections.back();
+          bool isList = words[0]=="list";
+          string value = words.size()>2 ? words[2] : "";
+          Option *o = NULL;
+          for (size_t i=0; i<s.options.size(); i++) {
+            if (s.options[i].name==words[1]) { o = &s.options[i]; break; }
+          }
+          if (!o) {
+            s.options.push_back(Option());
+            o = &s.options.back();
+            o->name = words[1];
+            o->isList = isList;
+          }
+          else if (!isList || !o->isList) {
+            o->values.clear(); // plain option overrides previous value
+            o->isList = isList;
+          }
+          o->values.push_back(value);
+        }
+        else {
+          return ErrorPtr(new Error(1, string_format("invalid statement in UCI package '%s' line %d", aPackage.name.c_str(), stmtLine)));
+        }
+      }
+      return ErrorPtr();
+    }
+
+
+    static void appendQuoted(string &aText, const string &aValue)
+    {
+      aText += '\'';
+      for (size_t i=0; i<aValue.size(); i++) {
+        if (aValue[i]=='\'') aText += "'\\''"; else aText += aValue[i];
+      }
+      aText += '\'';
+    }
+
+
+    // serialize package the same way `uci commit` does
+    static string serialize(const Package &aPackage)
+    {
+      string text;
+      for (size_t i=0; i<aPackage.sections.size(); i++) {
+        const Section &s = aPackage.sections[i];
+        text += "\nconfig ";
+        text += s.type;
+        if (!s.name.empty()) {
+          text += ' ';
+          appendQuoted(text, s.name);
+        }
+        text += '\n';
+        for (size_t j=0; j<s.options.size(); j++) {
+          const Option &o = s.options[j];
+          for (size_t k=0; k<o.values.size(); k++) {
+            text += o.isList ? "\tlist " : "\toption ";
+            text += o.name;
+            text += ' ';
+            appendQuoted(text, o.values[k]);
+            text += '\n';
+          }
+        }
+      }
+      text += '\n';
+      return text;
+    }
+
+  };
+
+} // namespace p44
+
+#endif /* __p44maintd__uciconfig__ */